@@ -0,0 +1,103 @@
+// asset_loader.cpp
+#include "asset_loader.h"
+
+#include <misc/stb_image.h>
+
+#include <exception>
+#include <iostream>
+
+DecodedImage::DecodedImage(const string& path) : path(path)
+{
+    pixels = stbi_load(path.c_str(), &width, &height, &components, 0);
+}
+
+DecodedImage::~DecodedImage()
+{
+    stbi_image_free(pixels);
+}
+
+AssetLoader::AssetLoader(unsigned int threadCount)
+    : pendingTasks(0), stageMs(), wallMs(0.0f), begin(chrono::high_resolution_clock::now()), pool(threadCount)
+{
+}
+
+void AssetLoader::Run(function<void()> task)
+{
+    {
+        std::lock_guard<mutex> guard(lock);
+        pendingTasks++;
+    }
+    pool.Submit([this, task] {
+        try
+        {
+            task();
+        }
+        catch (const std::exception& e)
+        {
+            Log(string("ERROR::ASSET_LOADER:: ") + e.what());
+        }
+        {
+            std::lock_guard<mutex> guard(lock);
+            pendingTasks--;
+        }
+        changed.notify_all();
+    });
+}
+
+void AssetLoader::Upload(function<void()> upload)
+{
+    {
+        std::lock_guard<mutex> guard(lock);
+        uploads.push_back(std::move(upload));
+    }
+    changed.notify_all();
+}
+
+void AssetLoader::Finish()
+{
+    std::unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        changed.wait(guard, [this] { return !uploads.empty() || pendingTasks == 0; });
+        if (uploads.empty())
+            break;
+        function<void()> upload = std::move(uploads.front());
+        uploads.pop_front();
+
+        // the queue stays open to the workers while the GL call runs
+        guard.unlock();
+        auto uploadBegin = chrono::high_resolution_clock::now();
+        upload();
+        float ms = chrono::duration<float, std::milli>(chrono::high_resolution_clock::now() - uploadBegin).count();
+        guard.lock();
+        stageMs[(int)LoadStage::Upload] += ms;
+    }
+    wallMs = chrono::duration<float, std::milli>(chrono::high_resolution_clock::now() - begin).count();
+}
+
+void AssetLoader::AddTime(LoadStage stage, float ms)
+{
+    std::lock_guard<mutex> guard(lock);
+    stageMs[(int)stage] += ms;
+}
+
+void AssetLoader::AddTime(LoadStage stage, chrono::high_resolution_clock::time_point since)
+{
+    AddTime(stage, chrono::duration<float, std::milli>(chrono::high_resolution_clock::now() - since).count());
+}
+
+void AssetLoader::Log(const string& line)
+{
+    std::lock_guard<mutex> guard(lock);
+    std::cout << line << std::endl;
+}
+
+void AssetLoader::PrintTimings()
+{
+    std::lock_guard<mutex> guard(lock);
+    std::cout << "Asset loading: " << wallMs << " ms on " << pool.GetThreadCount() << " worker threads; "
+              << "import " << stageMs[(int)LoadStage::Import] << " ms, "
+              << "mesh processing " << stageMs[(int)LoadStage::Process] << " ms, "
+              << "image decode " << stageMs[(int)LoadStage::Decode] << " ms (summed over workers), "
+              << "GL upload " << stageMs[(int)LoadStage::Upload] << " ms" << std::endl;
+}
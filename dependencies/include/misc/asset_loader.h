@@ -0,0 +1,74 @@
+#ifndef ASSET_LOADER_H
+#define ASSET_LOADER_H
+
+#include <misc/thread_pool.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+using namespace std;
+
+// stages of asset loading that get their own line in the timing report
+enum class LoadStage {
+    Import,   // Assimp import or model cache read
+    Process,  // processMesh and OptimizeMesh, one task per aiMesh
+    Decode,   // texture containers, one task per texture or cubemap face; stb_image and compression when they are stale
+    Upload,   // glBufferData/glTexImage2D on the GL thread
+    Count
+};
+
+// pixels decoded by stb_image, freed with the object
+struct DecodedImage
+{
+    string path;
+    int width = 0;
+    int height = 0;
+    int components = 0;
+    unsigned char* pixels = nullptr;
+
+    explicit DecodedImage(const string& path);
+    ~DecodedImage();
+    DecodedImage(const DecodedImage&) = delete;
+    DecodedImage& operator=(const DecodedImage&) = delete;
+};
+
+// Runs asset import, mesh processing and image decoding on worker threads. Workers hand their finished
+// CPU buffers to Upload, and the GL thread drains that queue in Finish, so only GL calls are made there.
+class AssetLoader
+{
+public:
+    explicit AssetLoader(unsigned int threadCount = 0);
+
+    // runs the task on a worker; tasks may Run further tasks and queue uploads
+    void Run(function<void()> task);
+    // queues GL work for the thread that calls Finish
+    void Upload(function<void()> upload);
+    // GL thread: runs the queued uploads until every task has completed and nothing is left to upload
+    void Finish();
+
+    // adds to a stage's time, summed over all threads
+    void AddTime(LoadStage stage, float ms);
+    void AddTime(LoadStage stage, chrono::high_resolution_clock::time_point since);
+    // prints one line without interleaving with other threads
+    void Log(const string& line);
+    void PrintTimings();
+
+    unsigned int GetThreadCount() const { return pool.GetThreadCount(); }
+
+private:
+    mutex lock;
+    condition_variable changed;
+    deque<function<void()>> uploads;
+    unsigned int pendingTasks;
+    float stageMs[(int)LoadStage::Count];
+    float wallMs;
+    chrono::high_resolution_clock::time_point begin;
+
+    // destroyed first, so no worker outlives the state above
+    ThreadPool pool;
+};
+
+#endif
@@ -0,0 +1,645 @@
+// bvh.cpp
+#include "bvh.h"
+
+#include <misc/thread_pool.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_SSE2 1
+#endif
+
+// subtrees with fewer triangles than this are not worth a task of their own
+static const unsigned int PARALLEL_MIN_TRIANGLES = 4096;
+// traversal stack; a tree of depth d needs at most d + 1 entries
+static const int STACK_SIZE = 64;
+// below this level nodes are split at the median, which halves them: even 2^32 triangles then end in leaves
+// within STACK_SIZE - 2 levels, however clustered the geometry is that SAH would keep peeling slivers off
+static const int MAX_SAH_DEPTH = STACK_SIZE / 2;
+static const float INF = std::numeric_limits<float>::infinity();
+
+// per-triangle data the builder sorts by
+struct BuildPrimitive {
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    glm::vec3 centroid;
+};
+
+// a node whose subtree is still to be built, and the range of triangles it covers
+struct BVH::BuildTask {
+    uint32_t node;
+    uint32_t first;
+    uint32_t count;
+    int level;             // of the node, counted from the root
+    vector<Node> subtree;  // root at 0; the other indices move when it is stitched in
+};
+
+static float surfaceArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(0.0f));
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+// partitions order[first, first + count) by binned SAH; returns how many went left, 0 to make a leaf
+static uint32_t partition(const vector<BuildPrimitive>& primitives, vector<unsigned int>& order, uint32_t first,
+                          uint32_t count, const glm::vec3& nodeMin, const glm::vec3& nodeMax)
+{
+    glm::vec3 centroidMin(INF), centroidMax(-INF);
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        centroidMin = glm::min(centroidMin, primitives[order[i]].centroid);
+        centroidMax = glm::max(centroidMax, primitives[order[i]].centroid);
+    }
+
+    float bestCost = INF;
+    int bestAxis = -1;
+    int bestBin = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = centroidMax[axis] - centroidMin[axis];
+        if (extent <= 0.0f)
+            continue;
+        uint32_t binCounts[BVH_BINS] = {};
+        glm::vec3 binMin[BVH_BINS], binMax[BVH_BINS];
+        std::fill(binMin, binMin + BVH_BINS, glm::vec3(INF));
+        std::fill(binMax, binMax + BVH_BINS, glm::vec3(-INF));
+        float scale = BVH_BINS / extent;
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            const BuildPrimitive& primitive = primitives[order[i]];
+            int bin = std::min(BVH_BINS - 1, (int)((primitive.centroid[axis] - centroidMin[axis]) * scale));
+            binCounts[bin]++;
+            binMin[bin] = glm::min(binMin[bin], primitive.boundsMin);
+            binMax[bin] = glm::max(binMax[bin], primitive.boundsMax);
+        }
+
+        // sweep from the right to get the cost of every right side, then from the left
+        float rightArea[BVH_BINS];
+        uint32_t rightCount[BVH_BINS];
+        glm::vec3 sweepMin(INF), sweepMax(-INF);
+        uint32_t sweepCount = 0;
+        for (int bin = BVH_BINS - 1; bin > 0; bin--)
+        {
+            sweepMin = glm::min(sweepMin, binMin[bin]);
+            sweepMax = glm::max(sweepMax, binMax[bin]);
+            sweepCount += binCounts[bin];
+            rightArea[bin] = sweepCount ? surfaceArea(sweepMin, sweepMax) : 0.0f;
+            rightCount[bin] = sweepCount;
+        }
+        sweepMin = glm::vec3(INF);
+        sweepMax = glm::vec3(-INF);
+        sweepCount = 0;
+        for (int bin = 0; bin < BVH_BINS - 1; bin++)
+        {
+            sweepMin = glm::min(sweepMin, binMin[bin]);
+            sweepMax = glm::max(sweepMax, binMax[bin]);
+            sweepCount += binCounts[bin];
+            if (sweepCount == 0 || rightCount[bin + 1] == 0)
+                continue;
+            float cost = sweepCount * surfaceArea(sweepMin, sweepMax) + rightCount[bin + 1] * rightArea[bin + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = bin;
+            }
+        }
+    }
+
+    // a leaf is cheaper than any split, as long as it fits one pack
+    float leafCost = count * surfaceArea(nodeMin, nodeMax);
+    if (count <= BVH_LEAF_TRIANGLES && (bestAxis < 0 || bestCost >= leafCost))
+        return 0;
+
+    auto begin = order.begin() + first;
+    auto end = begin + count;
+    if (bestAxis < 0)
+    {
+        // every centroid in one place: halve the list, it still has to shrink to fit the leaves
+        return count / 2;
+    }
+    float scale = BVH_BINS / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+    float axisMin = centroidMin[bestAxis];
+    auto middle = std::partition(begin, end, [&](unsigned int triangle) {
+        int bin = std::min(BVH_BINS - 1, (int)((primitives[triangle].centroid[bestAxis] - axisMin) * scale));
+        return bin <= bestBin;
+    });
+    return (uint32_t)(middle - begin);
+}
+
+// partitions order[first, first + count) at the median centroid along the widest axis; returns how many went left,
+// 0 to make a leaf
+static uint32_t medianSplit(const vector<BuildPrimitive>& primitives, vector<unsigned int>& order, uint32_t first,
+                            uint32_t count)
+{
+    if (count <= BVH_LEAF_TRIANGLES)
+        return 0;
+    glm::vec3 centroidMin(INF), centroidMax(-INF);
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        centroidMin = glm::min(centroidMin, primitives[order[i]].centroid);
+        centroidMax = glm::max(centroidMax, primitives[order[i]].centroid);
+    }
+    glm::vec3 extent = centroidMax - centroidMin;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    auto begin = order.begin() + first;
+    std::nth_element(begin, begin + count / 2, begin + count, [&](unsigned int a, unsigned int b) {
+        return primitives[a].centroid[axis] < primitives[b].centroid[axis];
+    });
+    return count / 2;
+}
+
+// Builds the subtree of out[index], which sits at level; below depth 0 large ranges are handed back as tasks instead
+template <typename NodeT, typename TaskT>
+static void buildNode(const vector<BuildPrimitive>& primitives, vector<unsigned int>& order, vector<NodeT>& out,
+                      uint32_t index, uint32_t first, uint32_t count, int level, int depth, vector<TaskT>* tasks)
+{
+    glm::vec3 boundsMin(INF), boundsMax(-INF);
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        boundsMin = glm::min(boundsMin, primitives[order[i]].boundsMin);
+        boundsMax = glm::max(boundsMax, primitives[order[i]].boundsMax);
+    }
+    out[index].boundsMin = boundsMin;
+    out[index].boundsMax = boundsMax;
+
+    if (tasks && depth <= 0 && count >= PARALLEL_MIN_TRIANGLES)
+    {
+        TaskT task;
+        task.node = index;
+        task.first = first;
+        task.count = count;
+        task.level = level;
+        tasks->push_back(std::move(task));
+        return;
+    }
+
+    uint32_t leftCount = level < MAX_SAH_DEPTH ? partition(primitives, order, first, count, boundsMin, boundsMax)
+                                               : medianSplit(primitives, order, first, count);
+    if (leftCount == 0)
+    {
+        // the leaf's pack is assigned once the whole tree is flattened
+        out[index].leftOrPack = first;
+        out[index].count = count;
+        return;
+    }
+    uint32_t left = (uint32_t)out.size();
+    out.resize(out.size() + 2);
+    out[index].leftOrPack = left;
+    out[index].count = 0;
+    buildNode(primitives, order, out, left, first, leftCount, level + 1, depth - 1, tasks);
+    buildNode(primitives, order, out, left + 1, first + leftCount, count - leftCount, level + 1, depth - 1, tasks);
+}
+
+BVH::BVH()
+    : triangleCount(0), buildMs(0.0f)
+{
+}
+
+void BVH::Build(const vector<glm::vec3>& positions, unsigned int threadCount)
+{
+    auto begin = std::chrono::high_resolution_clock::now();
+    nodes.clear();
+    packs.clear();
+    objectPositions.clear();
+    triangleIds.clear();
+    triangleCount = (unsigned int)(positions.size() / 3);
+    if (triangleCount == 0)
+        return;
+
+    vector<BuildPrimitive> primitives(triangleCount);
+    vector<unsigned int> order(triangleCount);
+    for (unsigned int t = 0; t < triangleCount; t++)
+    {
+        const glm::vec3& a = positions[t * 3];
+        const glm::vec3& b = positions[t * 3 + 1];
+        const glm::vec3& c = positions[t * 3 + 2];
+        primitives[t].boundsMin = glm::min(a, glm::min(b, c));
+        primitives[t].boundsMax = glm::max(a, glm::max(b, c));
+        primitives[t].centroid = (primitives[t].boundsMin + primitives[t].boundsMax) * 0.5f;
+        order[t] = t;
+    }
+
+    // enough top levels to give every worker about two subtrees
+    ThreadPool pool(threadCount);
+    int topDepth = 1;
+    while ((1u << topDepth) < pool.GetThreadCount() * 2)
+        topDepth++;
+
+    vector<BuildTask> tasks;
+    nodes.resize(1);
+    buildNode(primitives, order, nodes, 0, 0, triangleCount, 0, topDepth, &tasks);
+
+    // the subtrees cover disjoint ranges of order, so they can be built side by side
+    vector<future<void>> pending;
+    for (BuildTask& task : tasks)
+    {
+        BuildTask* taskPtr = &task;
+        pending.push_back(pool.Submit([&primitives, &order, taskPtr] {
+            taskPtr->subtree.resize(1);
+            buildNode(primitives, order, taskPtr->subtree, 0, taskPtr->first, taskPtr->count, taskPtr->level, 0,
+                      (vector<BuildTask>*)nullptr);
+        }));
+    }
+    for (future<void>& result : pending)
+        result.get();
+
+    // stitch: a subtree's root replaces its placeholder, the rest is appended with its child indices moved
+    for (BuildTask& task : tasks)
+    {
+        uint32_t base = (uint32_t)nodes.size();
+        auto move = [base](Node node) {
+            if (node.count == 0)
+                node.leftOrPack = base + node.leftOrPack - 1;
+            return node;
+        };
+        nodes[task.node] = move(task.subtree[0]);
+        for (size_t i = 1; i < task.subtree.size(); i++)
+            nodes.push_back(move(task.subtree[i]));
+    }
+
+    // one pack per leaf, in node order
+    for (Node& node : nodes)
+    {
+        if (node.count == 0)
+            continue;
+        uint32_t first = node.leftOrPack;
+        node.leftOrPack = (uint32_t)(triangleIds.size() / BVH_LEAF_TRIANGLES);
+        for (uint32_t lane = 0; lane < BVH_LEAF_TRIANGLES; lane++)
+        {
+            if (lane < node.count)
+            {
+                unsigned int triangle = order[first + lane];
+                triangleIds.push_back(triangle);
+                objectPositions.insert(objectPositions.end(), positions.begin() + triangle * 3, positions.begin() + triangle * 3 + 3);
+            }
+            else
+            {
+                triangleIds.push_back(0);
+                objectPositions.insert(objectPositions.end(), 3, glm::vec3(0.0f));
+            }
+        }
+    }
+    packs.resize(triangleIds.size() / BVH_LEAF_TRIANGLES);
+    writePacks(nullptr);
+    refitNodes();
+    buildMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+}
+
+void BVH::Refit(const glm::mat4& transform)
+{
+    if (nodes.empty())
+        return;
+    writePacks(&transform);
+    refitNodes();
+}
+
+void BVH::writePacks(const glm::mat4* transform)
+{
+    for (size_t p = 0; p < packs.size(); p++)
+    {
+        TrianglePack& pack = packs[p];
+        for (int lane = 0; lane < BVH_LEAF_TRIANGLES; lane++)
+        {
+            const glm::vec3* corners = &objectPositions[(p * BVH_LEAF_TRIANGLES + lane) * 3];
+            glm::vec3 a = corners[0], b = corners[1], c = corners[2];
+            if (transform)
+            {
+                a = glm::vec3(*transform * glm::vec4(a, 1.0f));
+                b = glm::vec3(*transform * glm::vec4(b, 1.0f));
+                c = glm::vec3(*transform * glm::vec4(c, 1.0f));
+            }
+            // padding stays degenerate wherever it is moved to
+            glm::vec3 e1 = corners[1] == corners[0] && corners[2] == corners[0] ? glm::vec3(0.0f) : b - a;
+            glm::vec3 e2 = corners[1] == corners[0] && corners[2] == corners[0] ? glm::vec3(0.0f) : c - a;
+            pack.v0x[lane] = a.x; pack.v0y[lane] = a.y; pack.v0z[lane] = a.z;
+            pack.e1x[lane] = e1.x; pack.e1y[lane] = e1.y; pack.e1z[lane] = e1.z;
+            pack.e2x[lane] = e2.x; pack.e2y[lane] = e2.y; pack.e2z[lane] = e2.z;
+        }
+    }
+}
+
+// children always come after their parent, so one backwards pass sees every child before its parent
+void BVH::refitNodes()
+{
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+        Node& node = nodes[i];
+        if (node.count == 0)
+        {
+            const Node& left = nodes[node.leftOrPack];
+            const Node& right = nodes[node.leftOrPack + 1];
+            node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+            node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+            continue;
+        }
+        const TrianglePack& pack = packs[node.leftOrPack];
+        glm::vec3 boundsMin(INF), boundsMax(-INF);
+        for (uint32_t lane = 0; lane < node.count; lane++)
+        {
+            glm::vec3 a(pack.v0x[lane], pack.v0y[lane], pack.v0z[lane]);
+            glm::vec3 b = a + glm::vec3(pack.e1x[lane], pack.e1y[lane], pack.e1z[lane]);
+            glm::vec3 c = a + glm::vec3(pack.e2x[lane], pack.e2y[lane], pack.e2z[lane]);
+            boundsMin = glm::min(boundsMin, glm::min(a, glm::min(b, c)));
+            boundsMax = glm::max(boundsMax, glm::max(a, glm::max(b, c)));
+        }
+        node.boundsMin = boundsMin;
+        node.boundsMax = boundsMax;
+    }
+}
+
+// Moller-Trumbore against the four lanes of a pack
+int BVH::intersectPack(const TrianglePack& pack, unsigned int count, const glm::vec3& origin, const glm::vec3& direction,
+                       float tMin, float& tMax) const
+{
+    float distances[4];
+    int hits;
+#ifdef BVH_SSE2
+    __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+    __m128 e1x = _mm_loadu_ps(pack.e1x), e1y = _mm_loadu_ps(pack.e1y), e1z = _mm_loadu_ps(pack.e1z);
+    __m128 e2x = _mm_loadu_ps(pack.e2x), e2y = _mm_loadu_ps(pack.e2y), e2z = _mm_loadu_ps(pack.e2z);
+    // p = d x e2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 valid = _mm_cmpgt_ps(absDet, _mm_set1_ps(1e-12f));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    // s = o - v0
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(origin.x), _mm_loadu_ps(pack.v0x));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(origin.y), _mm_loadu_ps(pack.v0y));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(origin.z), _mm_loadu_ps(pack.v0z));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+    // q = s x e1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+    __m128 zero = _mm_setzero_ps();
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, _mm_set1_ps(tMin)));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(tMax)));
+    hits = _mm_movemask_ps(valid) & ((1 << count) - 1);
+    _mm_storeu_ps(distances, t);
+#else
+    hits = 0;
+    for (unsigned int lane = 0; lane < count; lane++)
+    {
+        glm::vec3 e1(pack.e1x[lane], pack.e1y[lane], pack.e1z[lane]);
+        glm::vec3 e2(pack.e2x[lane], pack.e2y[lane], pack.e2z[lane]);
+        glm::vec3 p = glm::cross(direction, e2);
+        float det = glm::dot(e1, p);
+        if (std::fabs(det) <= 1e-12f)
+            continue;
+        float invDet = 1.0f / det;
+        glm::vec3 s = origin - glm::vec3(pack.v0x[lane], pack.v0y[lane], pack.v0z[lane]);
+        float u = glm::dot(s, p) * invDet;
+        glm::vec3 q = glm::cross(s, e1);
+        float v = glm::dot(direction, q) * invDet;
+        float t = glm::dot(e2, q) * invDet;
+        if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > tMin && t < tMax)
+        {
+            hits |= 1 << lane;
+            distances[lane] = t;
+        }
+    }
+#endif
+    int closest = -1;
+    for (int lane = 0; lane < 4; lane++)
+    {
+        if ((hits >> lane & 1) && distances[lane] < tMax)
+        {
+            tMax = distances[lane];
+            closest = lane;
+        }
+    }
+    return closest;
+}
+
+// 1 / direction with zero components nudged away from zero, so a ray starting on a box face gets no 0 * inf
+static glm::vec3 inverseOf(const glm::vec3& direction)
+{
+    glm::vec3 inverse;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float component = direction[axis];
+        if (std::fabs(component) < 1e-20f)
+            component = std::signbit(component) ? -1e-20f : 1e-20f;
+        inverse[axis] = 1.0f / component;
+    }
+    return inverse;
+}
+
+// entry distance of the ray into the box, or INF if it misses it before tMax
+static float intersectBox(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::vec3& origin,
+                          const glm::vec3& inverseDirection, float tMax)
+{
+    glm::vec3 t1 = (boundsMin - origin) * inverseDirection;
+    glm::vec3 t2 = (boundsMax - origin) * inverseDirection;
+    glm::vec3 entries = glm::min(t1, t2), exits = glm::max(t1, t2);
+    float entry = std::max(std::max(entries.x, entries.y), std::max(entries.z, 0.0f));
+    float exit = std::min(std::min(exits.x, exits.y), std::min(exits.z, tMax));
+    return entry <= exit ? entry : INF;
+}
+
+bool BVH::Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, RayHit& hit) const
+{
+    if (nodes.empty())
+        return false;
+    glm::vec3 inverseDirection = inverseOf(direction);
+    float tMax = maxDistance;
+    int bestPack = -1, bestLane = -1;
+
+    uint32_t stack[STACK_SIZE];
+    int stackSize = 0;
+    if (intersectBox(nodes[0].boundsMin, nodes[0].boundsMax, origin, inverseDirection, tMax) == INF)
+        return false;
+    uint32_t current = 0;
+    while (true)
+    {
+        const Node& node = nodes[current];
+        if (node.count)
+        {
+            int lane = intersectPack(packs[node.leftOrPack], node.count, origin, direction, 0.0f, tMax);
+            if (lane >= 0)
+            {
+                bestPack = (int)node.leftOrPack;
+                bestLane = lane;
+            }
+        }
+        else
+        {
+            // nearer child first; the other waits on the stack
+            uint32_t first = node.leftOrPack, second = node.leftOrPack + 1;
+            float firstEntry = intersectBox(nodes[first].boundsMin, nodes[first].boundsMax, origin, inverseDirection, tMax);
+            float secondEntry = intersectBox(nodes[second].boundsMin, nodes[second].boundsMax, origin, inverseDirection, tMax);
+            if (secondEntry < firstEntry)
+            {
+                std::swap(first, second);
+                std::swap(firstEntry, secondEntry);
+            }
+            if (firstEntry != INF)
+            {
+                if (secondEntry != INF)
+                    stack[stackSize++] = second;
+                current = first;
+                continue;
+            }
+        }
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+
+    if (bestPack < 0)
+        return false;
+    const TrianglePack& pack = packs[bestPack];
+    glm::vec3 e1(pack.e1x[bestLane], pack.e1y[bestLane], pack.e1z[bestLane]);
+    glm::vec3 e2(pack.e2x[bestLane], pack.e2y[bestLane], pack.e2z[bestLane]);
+    glm::vec3 normal = glm::normalize(glm::cross(e1, e2));
+    hit.distance = tMax;
+    hit.triangle = triangleIds[bestPack * BVH_LEAF_TRIANGLES + bestLane];
+    hit.position = origin + direction * tMax;
+    hit.normal = glm::dot(normal, direction) > 0.0f ? -normal : normal;
+    return true;
+}
+
+bool BVH::IntersectsSegment(const glm::vec3& from, const glm::vec3& to) const
+{
+    if (nodes.empty())
+        return false;
+    glm::vec3 direction = to - from;
+    glm::vec3 inverseDirection = inverseOf(direction);
+
+    uint32_t stack[STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const Node& node = nodes[stack[--stackSize]];
+        if (intersectBox(node.boundsMin, node.boundsMax, from, inverseDirection, 1.0f) == INF)
+            continue;
+        if (node.count)
+        {
+            float tMax = 1.0f;
+            if (intersectPack(packs[node.leftOrPack], node.count, from, direction, 0.0f, tMax) >= 0)
+                return true;
+        }
+        else
+        {
+            stack[stackSize++] = node.leftOrPack + 1;
+            stack[stackSize++] = node.leftOrPack;
+        }
+    }
+    return false;
+}
+
+// closest point on triangle abc to p (Ericson, Real-Time Collision Detection 5.1.5)
+static glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f)
+        return a;
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3)
+        return b;
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+        return a + ab * (d1 / (d1 - d3));
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6)
+        return c;
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+        return a + ac * (d2 / (d2 - d6));
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    float denominator = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+bool BVH::OverlapsSphere(const glm::vec3& center, float radius, glm::vec3* closestPoint) const
+{
+    if (nodes.empty())
+        return false;
+    // the search radius shrinks to the closest triangle found so far
+    float bestSquared = radius * radius;
+    bool found = false;
+
+    uint32_t stack[STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const Node& node = nodes[stack[--stackSize]];
+        glm::vec3 offset = center - glm::clamp(center, node.boundsMin, node.boundsMax);
+        if (glm::dot(offset, offset) > bestSquared)
+            continue;
+        if (node.count == 0)
+        {
+            stack[stackSize++] = node.leftOrPack + 1;
+            stack[stackSize++] = node.leftOrPack;
+            continue;
+        }
+        const TrianglePack& pack = packs[node.leftOrPack];
+        for (uint32_t lane = 0; lane < node.count; lane++)
+        {
+            glm::vec3 a(pack.v0x[lane], pack.v0y[lane], pack.v0z[lane]);
+            glm::vec3 b = a + glm::vec3(pack.e1x[lane], pack.e1y[lane], pack.e1z[lane]);
+            glm::vec3 c = a + glm::vec3(pack.e2x[lane], pack.e2y[lane], pack.e2z[lane]);
+            glm::vec3 point = closestPointOnTriangle(center, a, b, c);
+            glm::vec3 toPoint = point - center;
+            float squared = glm::dot(toPoint, toPoint);
+            if (squared <= bestSquared)
+            {
+                found = true;
+                bestSquared = squared;
+                if (!closestPoint)
+                    return true;
+                *closestPoint = point;
+            }
+        }
+    }
+    return found;
+}
+
+double BVH::MeasureRaysPerSecond(unsigned int rayCount, unsigned int& hits) const
+{
+    hits = 0;
+    if (nodes.empty() || rayCount == 0)
+        return 0.0;
+    // fixed seed, so runs are comparable
+    uint32_t state = 12345u;
+    auto random = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    };
+    glm::vec3 boundsMin = nodes[0].boundsMin, extent = nodes[0].boundsMax - nodes[0].boundsMin;
+    vector<glm::vec3> origins(rayCount), directions(rayCount);
+    for (unsigned int i = 0; i < rayCount; i++)
+    {
+        origins[i] = boundsMin + extent * glm::vec3(random(), random(), random());
+        glm::vec3 target = boundsMin + extent * glm::vec3(random(), random(), random());
+        directions[i] = target - origins[i];
+    }
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    RayHit hit;
+    for (unsigned int i = 0; i < rayCount; i++)
+        hits += Raycast(origins[i], directions[i], INF, hit) ? 1 : 0;
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+    return seconds > 0.0 ? rayCount / seconds : 0.0;
+}
@@ -0,0 +1,85 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+// leaves hold at most this many triangles, stored as one SIMD pack
+#define BVH_LEAF_TRIANGLES 4
+// SAH bins per axis when splitting a node
+#define BVH_BINS 16
+
+// closest intersection found by BVH::Raycast
+struct RayHit {
+    float distance = 0.0f;
+    unsigned int triangle = 0;        // index into the triangle list the BVH was built from
+    glm::vec3 position = glm::vec3(0.0f);
+    glm::vec3 normal = glm::vec3(0.0f);  // geometric, facing the ray
+};
+
+// Bounding volume hierarchy over a triangle soup, for picking, ground following and collision. It is built
+// top-down with binned SAH; the top levels are split on the calling thread and the subtrees below them are
+// built on a thread pool, then everything is flattened into one node array in which the children of a node
+// are stored next to each other and always after it. Leaves keep their triangles as structure-of-arrays packs
+// of four, which the ray and segment queries test with one SSE2 pass (one at a time where SSE2 is missing).
+// The triangles are kept in object space, so Refit can move the whole hierarchy with a model matrix.
+class BVH
+{
+public:
+    BVH();
+
+    // builds over triangles given as three positions each; threadCount 0 uses one per core
+    void Build(const vector<glm::vec3>& positions, unsigned int threadCount = 0);
+    // places the triangles with a new model matrix and refits every box bottom-up; the topology stays as built
+    void Refit(const glm::mat4& transform);
+
+    // closest hit along the ray within maxDistance; direction need not be normalized, distances are in its units
+    bool Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, RayHit& hit) const;
+    // true if anything lies between the two points; stops at the first triangle found
+    bool IntersectsSegment(const glm::vec3& from, const glm::vec3& to) const;
+    // true if any triangle comes closer to center than radius; closestPoint gets the nearest point found
+    bool OverlapsSphere(const glm::vec3& center, float radius, glm::vec3* closestPoint = nullptr) const;
+
+    bool IsBuilt() const { return !nodes.empty(); }
+    unsigned int GetTriangleCount() const { return triangleCount; }
+    unsigned int GetNodeCount() const { return (unsigned int)nodes.size(); }
+    float GetBuildMs() const { return buildMs; }
+
+    // casts rayCount random rays from inside the bounds towards random points in them and returns rays per second;
+    // hits gets how many of them hit a triangle
+    double MeasureRaysPerSecond(unsigned int rayCount, unsigned int& hits) const;
+
+private:
+    // 32 bytes, two to a cache line
+    struct Node {
+        glm::vec3 boundsMin;
+        uint32_t leftOrPack;  // first of the two children, or the leaf's pack
+        glm::vec3 boundsMax;
+        uint32_t count;       // triangles in the leaf, 0 for an inner node
+    };
+    // four triangles as vertex and two edges, for Moller-Trumbore; unused lanes have zero edges and never hit
+    struct TrianglePack {
+        float v0x[4], v0y[4], v0z[4];
+        float e1x[4], e1y[4], e1z[4];
+        float e2x[4], e2y[4], e2z[4];
+    };
+    struct BuildTask;
+
+    vector<Node> nodes;
+    vector<TrianglePack> packs;
+    vector<glm::vec3> objectPositions;  // three per triangle, in pack order
+    vector<unsigned int> triangleIds;   // pack lane -> index in the source list
+    unsigned int triangleCount;
+    float buildMs;
+
+    void writePacks(const glm::mat4* transform);
+    void refitNodes();
+    // closest hit within the leaf's pack, or -1
+    int intersectPack(const TrianglePack& pack, unsigned int count, const glm::vec3& origin, const glm::vec3& direction,
+                      float tMin, float& tMax) const;
+};
+
+#endif
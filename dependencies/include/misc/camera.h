@@ -20,6 +20,31 @@ const float SPEED       =  7.5f;
 const float SENSITIVITY =  0.1f;
 const float ZOOM        =  45.0f;
 
+// the six planes of a view frustum as (normal, distance), normals pointing inwards and of unit length;
+// left, right, bottom, top, near, far
+struct Frustum
+{
+    glm::vec4 planes[6];
+};
+
+// extracts the planes of the clip volume from a view-projection matrix (Gribb and Hartmann);
+// with a model-view-projection matrix they come out in object space
+inline Frustum ExtractFrustum(const glm::mat4& viewProjection)
+{
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++)
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+
+    Frustum frustum;
+    for (int i = 0; i < 3; i++)
+    {
+        frustum.planes[i * 2] = rows[3] + rows[i];
+        frustum.planes[i * 2 + 1] = rows[3] - rows[i];
+    }
+    for (glm::vec4& plane : frustum.planes)
+        plane /= glm::length(glm::vec3(plane));
+    return frustum;
+}
 
 // An abstract camera class that processes input and calculates the corresponding Euler Angles, Vectors and Matrices for use in OpenGL
 class Camera
@@ -64,6 +89,12 @@ public:
         return glm::lookAt(Position, Position + Front, Up);
     }
 
+    // the frustum seen through this camera with the given projection, in world space
+    Frustum GetFrustum(const glm::mat4& projection)
+    {
+        return ExtractFrustum(projection * GetViewMatrix());
+    }
+
     // processes input received from any keyboard-like input system. Accepts input parameter in the form of camera defined ENUM (to abstract it from windowing systems)
     void ProcessKeyboard(Camera_Movement direction, float deltaTime)
     {
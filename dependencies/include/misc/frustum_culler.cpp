@@ -0,0 +1,142 @@
+// frustum_culler.cpp
+#include "frustum_culler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FRUSTUM_CULLER_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FRUSTUM_CULLER_WIDTH 4
+#else
+#define FRUSTUM_CULLER_WIDTH 1
+#endif
+
+// every array is padded to this many bounds, so the SIMD loops never need a scalar tail
+static const unsigned int PADDING = 8;
+
+FrustumCuller::FrustumCuller()
+    : count(0)
+{
+}
+
+unsigned int FrustumCuller::Add(const glm::vec3& boundsMin, const glm::vec3& boundsMax, float radius)
+{
+    unsigned int index = count++;
+    size_t padded = (count + PADDING - 1) / PADDING * PADDING;
+    if (padded > centerX.size())
+    {
+        for (vector<float>* array : { &centerX, &centerY, &centerZ, &extentX, &extentY, &extentZ, &this->radius })
+            array->resize(padded, 0.0f);
+    }
+    visible.push_back(1);
+    Set(index, boundsMin, boundsMax, radius);
+    return index;
+}
+
+void FrustumCuller::Set(unsigned int index, const glm::vec3& boundsMin, const glm::vec3& boundsMax, float radius)
+{
+    glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+    glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+    centerX[index] = center.x;
+    centerY[index] = center.y;
+    centerZ[index] = center.z;
+    extentX[index] = extent.x;
+    extentY[index] = extent.y;
+    extentZ[index] = extent.z;
+    this->radius[index] = radius;
+}
+
+void FrustumCuller::Cull(const Frustum& frustum)
+{
+    auto begin = std::chrono::high_resolution_clock::now();
+    const glm::vec4* planes = frustum.planes;
+    unsigned int inside = 0;
+
+#if FRUSTUM_CULLER_WIDTH == 8
+    for (unsigned int i = 0; i < count; i += 8)
+    {
+        __m256 cx = _mm256_loadu_ps(&centerX[i]), cy = _mm256_loadu_ps(&centerY[i]), cz = _mm256_loadu_ps(&centerZ[i]);
+        __m256 ex = _mm256_loadu_ps(&extentX[i]), ey = _mm256_loadu_ps(&extentY[i]), ez = _mm256_loadu_ps(&extentZ[i]);
+        __m256 r = _mm256_loadu_ps(&radius[i]);
+        __m256 keep = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; p++)
+        {
+            const glm::vec4& plane = planes[p];
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), cx), _mm256_mul_ps(_mm256_set1_ps(plane.y), cy)),
+                                            _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.z), cz), _mm256_set1_ps(plane.w)));
+            __m256 reach = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(std::fabs(plane.x)), ex), _mm256_mul_ps(_mm256_set1_ps(std::fabs(plane.y)), ey)),
+                                         _mm256_mul_ps(_mm256_set1_ps(std::fabs(plane.z)), ez));
+            reach = _mm256_min_ps(reach, r);
+            keep = _mm256_and_ps(keep, _mm256_cmp_ps(_mm256_add_ps(distance, reach), _mm256_setzero_ps(), _CMP_GE_OQ));
+        }
+        int mask = _mm256_movemask_ps(keep);
+        unsigned int lanes = std::min(8u, count - i);
+        for (unsigned int lane = 0; lane < lanes; lane++)
+            visible[i + lane] = (unsigned char)((mask >> lane) & 1);
+    }
+#elif FRUSTUM_CULLER_WIDTH == 4
+    for (unsigned int i = 0; i < count; i += 4)
+    {
+        __m128 cx = _mm_loadu_ps(&centerX[i]), cy = _mm_loadu_ps(&centerY[i]), cz = _mm_loadu_ps(&centerZ[i]);
+        __m128 ex = _mm_loadu_ps(&extentX[i]), ey = _mm_loadu_ps(&extentY[i]), ez = _mm_loadu_ps(&extentZ[i]);
+        __m128 r = _mm_loadu_ps(&radius[i]);
+        __m128 keep = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; p++)
+        {
+            const glm::vec4& plane = planes[p];
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), cx), _mm_mul_ps(_mm_set1_ps(plane.y), cy)),
+                                         _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), cz), _mm_set1_ps(plane.w)));
+            __m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::fabs(plane.x)), ex), _mm_mul_ps(_mm_set1_ps(std::fabs(plane.y)), ey)),
+                                      _mm_mul_ps(_mm_set1_ps(std::fabs(plane.z)), ez));
+            reach = _mm_min_ps(reach, r);
+            keep = _mm_and_ps(keep, _mm_cmpge_ps(_mm_add_ps(distance, reach), _mm_setzero_ps()));
+        }
+        int mask = _mm_movemask_ps(keep);
+        unsigned int lanes = std::min(4u, count - i);
+        for (unsigned int lane = 0; lane < lanes; lane++)
+            visible[i + lane] = (unsigned char)((mask >> lane) & 1);
+    }
+#else
+    for (unsigned int i = 0; i < count; i++)
+    {
+        bool keep = true;
+        for (int p = 0; p < 6 && keep; p++)
+        {
+            const glm::vec4& plane = planes[p];
+            float distance = plane.x * centerX[i] + plane.y * centerY[i] + plane.z * centerZ[i] + plane.w;
+            float reach = std::fabs(plane.x) * extentX[i] + std::fabs(plane.y) * extentY[i] + std::fabs(plane.z) * extentZ[i];
+            keep = distance + std::min(reach, radius[i]) >= 0.0f;
+        }
+        visible[i] = keep ? 1 : 0;
+    }
+#endif
+
+    for (unsigned int i = 0; i < count; i++)
+        inside += visible[i];
+    stats.tested = count;
+    stats.visible = inside;
+    stats.culled = count - inside;
+    stats.occluded = 0;
+    stats.cullMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+}
+
+void FrustumCuller::Hide(unsigned int index)
+{
+    if (!visible[index])
+        return;
+    visible[index] = 0;
+    stats.visible--;
+    stats.occluded++;
+}
+
+void FrustumCuller::GetBounds(unsigned int index, glm::vec3& boundsMin, glm::vec3& boundsMax) const
+{
+    glm::vec3 center(centerX[index], centerY[index], centerZ[index]);
+    glm::vec3 extent(extentX[index], extentY[index], extentZ[index]);
+    boundsMin = center - extent;
+    boundsMax = center + extent;
+}
@@ -0,0 +1,55 @@
+#ifndef FRUSTUM_CULLER_H
+#define FRUSTUM_CULLER_H
+
+#include <glm/glm.hpp>
+
+#include <misc/camera.h>
+
+#include <vector>
+using namespace std;
+
+// World space bounds of every drawable, kept as structure-of-arrays so Cull tests eight of them per
+// instruction with AVX2, four with SSE2, or one at a time where neither is available. A bound is a box given
+// by its centre and half extents, together with the radius of a sphere around the same centre; each plane
+// rejects it with whichever of the two reaches less far towards that plane.
+class FrustumCuller
+{
+public:
+    struct Stats {
+        unsigned int tested = 0;
+        unsigned int visible = 0;
+        unsigned int culled = 0;
+        unsigned int occluded = 0;  // hidden after Cull by an occlusion test
+        float cullMs = 0.0f;
+    };
+
+    FrustumCuller();
+
+    // registers a bound and returns its index; bounds stay visible until the first Cull
+    unsigned int Add(const glm::vec3& boundsMin, const glm::vec3& boundsMax, float radius);
+    // moves a bound, e.g. for a mesh that is animated
+    void Set(unsigned int index, const glm::vec3& boundsMin, const glm::vec3& boundsMax, float radius);
+
+    // tests every bound against the frustum
+    void Cull(const Frustum& frustum);
+    // marks a bound that passed Cull as hidden anyway, e.g. because something in front covers it
+    void Hide(unsigned int index);
+
+    bool IsVisible(unsigned int index) const { return visible[index] != 0; }
+    // one byte per bound from first on, nonzero for the ones inside; valid until the next Add
+    const unsigned char* GetVisibility(unsigned int first) const { return visible.data() + first; }
+    unsigned int GetCount() const { return count; }
+    void GetBounds(unsigned int index, glm::vec3& boundsMin, glm::vec3& boundsMax) const;
+    const Stats& GetStats() const { return stats; }
+
+private:
+    // padded to a multiple of the widest SIMD width; the padding never reaches visible
+    vector<float> centerX, centerY, centerZ;
+    vector<float> extentX, extentY, extentZ;
+    vector<float> radius;
+    vector<unsigned char> visible;
+    unsigned int count;
+    Stats stats;
+};
+
+#endif
@@ -0,0 +1,227 @@
+// geometry_arena.cpp
+#include "geometry_arena.h"
+
+#include <misc/gl_state.h>
+
+#include <iostream>
+
+GeometryArena::GeometryArena()
+    : coloredMeshes(0), largestMesh(0), meshCount(0), VAO(0), VBO(0), EBO(0), colorVBO(0), indirectBuffer(0),
+      indexType(GL_UNSIGNED_INT), useIndirect(false), built(false)
+{
+}
+
+GeometryArena::~GeometryArena()
+{
+    if (VAO)
+        GLState::DeleteVertexArray(VAO);
+    if (VBO)
+        GLState::DeleteBuffer(VBO);
+    if (EBO)
+        GLState::DeleteBuffer(EBO);
+    if (colorVBO)
+        GLState::DeleteBuffer(colorVBO);
+    if (indirectBuffer)
+        GLState::DeleteBuffer(indirectBuffer);
+}
+
+unsigned int GeometryArena::Add(const vector<Mesh>& meshes, vector<bool>& packed)
+{
+    Batch batch;
+    batch.slots.resize(meshes.size());
+    packed.assign(meshes.size(), false);
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        const Mesh& mesh = meshes[i];
+        if (built || !mesh.qtangents.empty() || !mesh.bones.empty() || mesh.indices.empty())
+            continue;
+
+        Group* group = nullptr;
+        for (Group& candidate : batch.groups)
+            if (candidate.material == mesh.material)
+                group = &candidate;
+        if (!group)
+        {
+            batch.groups.push_back(Group());
+            group = &batch.groups.back();
+            group->material = mesh.material;
+        }
+
+        // indices stay local to the mesh; baseVertex moves them to its place in the shared vertex buffer
+        group->counts.push_back((GLsizei)mesh.indices.size());
+        group->firstIndices.push_back((GLuint)indices.size());
+        group->baseVertices.push_back((GLint)vertices.size());
+        group->meshes.push_back((unsigned int)i);
+        batch.slots[i].group = (unsigned int)(group - batch.groups.data());
+        batch.slots[i].draw = (unsigned int)(group->counts.size() - 1);
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+        if (mesh.colors.size() == mesh.vertices.size())
+        {
+            colors.insert(colors.end(), mesh.colors.begin(), mesh.colors.end());
+            coloredMeshes++;
+        }
+        else
+            colors.insert(colors.end(), mesh.vertices.size(), glm::u8vec4(255));
+        largestMesh = std::max(largestMesh, mesh.vertices.size());
+        meshCount++;
+        packed[i] = true;
+    }
+    batches.push_back(batch);
+    return (unsigned int)(batches.size() - 1);
+}
+
+void GeometryArena::Build()
+{
+    if (built)
+        return;
+    built = true;
+    if (vertices.empty())
+        return;
+
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
+
+    GLState::BindVertexArray(VAO);
+    GLState::BindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+    SetVertexAttribPointers();
+    if (coloredMeshes)
+    {
+        glGenBuffers(1, &colorVBO);
+        GLState::BindBuffer(GL_ARRAY_BUFFER, colorVBO);
+        glBufferData(GL_ARRAY_BUFFER, colors.size() * sizeof(glm::u8vec4), colors.data(), GL_STATIC_DRAW);
+        SetColorAttribPointer();
+    }
+
+    // with per-draw base vertices the indices only have to address the largest single mesh
+    GLState::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    size_t indexSize;
+    if (largestMesh <= 65536)
+    {
+        vector<unsigned short> shortIndices(indices.begin(), indices.end());
+        indexType = GL_UNSIGNED_SHORT;
+        indexSize = sizeof(unsigned short);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * indexSize, shortIndices.data(), GL_STATIC_DRAW);
+    }
+    else
+    {
+        indexType = GL_UNSIGNED_INT;
+        indexSize = sizeof(unsigned int);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * indexSize, indices.data(), GL_STATIC_DRAW);
+    }
+
+    // draw parameters for both submission paths
+    useIndirect = GLAD_GL_ARB_multi_draw_indirect != 0;
+    vector<DrawElementsIndirectCommand> commands;
+    for (Batch& batch : batches)
+    {
+        for (Group& group : batch.groups)
+        {
+            group.indirectOffset = (GLintptr)(commands.size() * sizeof(DrawElementsIndirectCommand));
+            for (size_t i = 0; i < group.counts.size(); i++)
+            {
+                group.offsets.push_back((const void*)(group.firstIndices[i] * indexSize));
+                DrawElementsIndirectCommand command = { (GLuint)group.counts[i], 1, group.firstIndices[i], group.baseVertices[i], 0 };
+                commands.push_back(command);
+            }
+        }
+    }
+    if (useIndirect)
+    {
+        glGenBuffers(1, &indirectBuffer);
+        GLState::BindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STATIC_DRAW);
+    }
+
+    std::cout << "Geometry arena: " << meshCount << " meshes in " << GetDrawCount() << " draws ("
+              << (useIndirect ? "glMultiDrawElementsIndirect" : "glMultiDrawElementsBaseVertex") << "), "
+              << vertices.size() << " vertices, " << indices.size() << " indices, " << coloredMeshes << " with baked colours" << std::endl;
+
+    // the GPU copy is all that is needed from here on
+    vector<Vertex>().swap(vertices);
+    vector<unsigned int>().swap(indices);
+    vector<glm::u8vec4>().swap(colors);
+}
+
+void GeometryArena::Draw(unsigned int batch, Shader& shader, const unsigned char* visible) const
+{
+    if (!built || !VAO || batch >= batches.size())
+        return;
+
+    GLState::BindVertexArray(VAO);
+    if (useIndirect)
+        GLState::BindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+    for (const Group& group : batches[batch].groups)
+    {
+        // a partly culled group is compacted and drawn from client arrays; the indirect commands hold all its draws
+        size_t drawCount = group.counts.size();
+        if (visible)
+        {
+            visibleCounts.clear();
+            visibleOffsets.clear();
+            visibleBaseVertices.clear();
+            for (size_t i = 0; i < drawCount; i++)
+            {
+                if (!visible[group.meshes[i]])
+                    continue;
+                visibleCounts.push_back(group.counts[i]);
+                visibleOffsets.push_back(group.offsets[i]);
+                visibleBaseVertices.push_back(group.baseVertices[i]);
+            }
+            if (visibleCounts.empty())
+                continue;
+            if (visibleCounts.size() < drawCount)
+            {
+                MaterialLibrary::Get().Bind(group.material, shader);
+                glMultiDrawElementsBaseVertex(GL_TRIANGLES, visibleCounts.data(), indexType, visibleOffsets.data(),
+                                              (GLsizei)visibleCounts.size(), visibleBaseVertices.data());
+                continue;
+            }
+        }
+
+        MaterialLibrary::Get().Bind(group.material, shader);
+        if (useIndirect)
+            glMultiDrawElementsIndirect(GL_TRIANGLES, indexType, (const void*)group.indirectOffset, (GLsizei)group.counts.size(), 0);
+        else
+            glMultiDrawElementsBaseVertex(GL_TRIANGLES, group.counts.data(), indexType, group.offsets.data(),
+                                          (GLsizei)group.counts.size(), const_cast<GLint*>(group.baseVertices.data()));
+    }
+}
+
+void GeometryArena::DrawMeshes(unsigned int batch, Shader& shader, const unsigned int* meshes, size_t count) const
+{
+    if (!built || !VAO || batch >= batches.size())
+        return;
+
+    GLState::BindVertexArray(VAO);
+    const Batch& drawn = batches[batch];
+    size_t i = 0;
+    while (i < count)
+    {
+        unsigned int groupIndex = drawn.slots[meshes[i]].group;
+        const Group& group = drawn.groups[groupIndex];
+        visibleCounts.clear();
+        visibleOffsets.clear();
+        visibleBaseVertices.clear();
+        for (; i < count && drawn.slots[meshes[i]].group == groupIndex; i++)
+        {
+            unsigned int draw = drawn.slots[meshes[i]].draw;
+            visibleCounts.push_back(group.counts[draw]);
+            visibleOffsets.push_back(group.offsets[draw]);
+            visibleBaseVertices.push_back(group.baseVertices[draw]);
+        }
+        MaterialLibrary::Get().Bind(group.material, shader);
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, visibleCounts.data(), indexType, visibleOffsets.data(),
+                                      (GLsizei)visibleCounts.size(), visibleBaseVertices.data());
+    }
+}
+
+unsigned int GeometryArena::GetDrawCount() const
+{
+    unsigned int draws = 0;
+    for (const Batch& batch : batches)
+        draws += (unsigned int)batch.groups.size();
+    return draws;
+}
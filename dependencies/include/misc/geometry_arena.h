@@ -0,0 +1,87 @@
+#ifndef GEOMETRY_ARENA_H
+#define GEOMETRY_ARENA_H
+
+#include <glad/glad.h>
+
+#include <misc/mesh.h>
+#include <misc/shader_m.h>
+
+#include <vector>
+using namespace std;
+
+// One vertex buffer, one index buffer and one VAO shared by the static meshes of any number of models.
+// Meshes are grouped by their material, and every group is drawn with a single multi-draw call:
+// glMultiDrawElementsIndirect where GL_ARB_multi_draw_indirect is available, glMultiDrawElementsBaseVertex otherwise.
+class GeometryArena
+{
+public:
+    GeometryArena();
+    ~GeometryArena();
+
+    // copies the geometry of the meshes into the arena and returns the batch that draws them;
+    // meshes with tangent or bone streams are not packed, packed[i] says which ones were; baked colours are
+    // packed into a colour stream of their own, white for the meshes that have none
+    unsigned int Add(const vector<Mesh>& meshes, vector<bool>& packed);
+    // uploads everything added so far; call once after the last Add
+    void Build();
+    // draws one batch with the shader's current model matrix; visible, when given, has one byte per mesh
+    // passed to Add and leaves out the meshes whose byte is zero
+    void Draw(unsigned int batch, Shader& shader, const unsigned char* visible = nullptr) const;
+    // draws the listed meshes of one batch in the given order, all of which were packed; each stretch of meshes
+    // that share a material becomes one multi-draw
+    void DrawMeshes(unsigned int batch, Shader& shader, const unsigned int* meshes, size_t count) const;
+
+    bool IsBuilt() const { return built; }
+    unsigned int GetMeshCount() const { return meshCount; }
+    unsigned int GetDrawCount() const;
+    bool UsesIndirect() const { return useIndirect; }
+
+private:
+    // the draws of one batch that share a material
+    struct Group {
+        unsigned int material = 0;
+        vector<GLsizei> counts;
+        vector<GLuint> firstIndices;
+        vector<GLint> baseVertices;
+        vector<const void*> offsets;  // byte offsets into the index buffer, filled by Build
+        vector<unsigned int> meshes;  // index of each draw's mesh in the vector passed to Add
+        GLintptr indirectOffset = 0;
+    };
+    // where a packed mesh ended up
+    struct MeshSlot {
+        unsigned int group;
+        unsigned int draw;
+    };
+    struct Batch {
+        vector<Group> groups;
+        vector<MeshSlot> slots;  // per mesh passed to Add; only meaningful for the packed ones
+    };
+    // layout mandated for glMultiDrawElementsIndirect
+    struct DrawElementsIndirectCommand {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    vector<Batch> batches;
+    vector<Vertex> vertices;
+    vector<unsigned int> indices;
+    vector<glm::u8vec4> colors;  // parallel to vertices
+    unsigned int coloredMeshes;  // the colour stream is only uploaded when some mesh has one
+    size_t largestMesh;
+    unsigned int meshCount;
+
+    unsigned int VAO, VBO, EBO, colorVBO, indirectBuffer;
+    GLenum indexType;
+    bool useIndirect;
+    bool built;
+
+    // the draws gathered for one multi-draw, reused from draw to draw
+    mutable vector<GLsizei> visibleCounts;
+    mutable vector<const void*> visibleOffsets;
+    mutable vector<GLint> visibleBaseVertices;
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include <glad/glad.h>
+
+#include <initializer_list>
+
+// Shadow copy of the binding state the renderer touches every frame. Every bind goes through here
+// and calls that would not change anything are dropped before they reach the driver.
+// Code that binds objects directly has to put the old bindings back (the Dear ImGui backend does) or call Invalidate().
+class GLState
+{
+public:
+    static const unsigned int MAX_TEXTURE_UNITS = 16;
+
+    // issued and filtered state changes; reset by the caller once per frame
+    struct Counters
+    {
+        unsigned int issued = 0;
+        unsigned int filtered = 0;
+    };
+    static Counters& Stats()
+    {
+        static Counters counters;
+        return counters;
+    }
+
+    // ------------------------------------------------------------------------
+    static void UseProgram(GLuint program)
+    {
+        if (changed(cache().program, program))
+            glUseProgram(program);
+    }
+    // ------------------------------------------------------------------------
+    static void BindVertexArray(GLuint vao)
+    {
+        if (changed(cache().vertexArray, vao))
+        {
+            glBindVertexArray(vao);
+            // the element buffer binding belongs to the vertex array
+            cache().elementBuffer = UNKNOWN;
+        }
+    }
+    // ------------------------------------------------------------------------
+    static void BindBuffer(GLenum target, GLuint buffer)
+    {
+        GLuint* slot = bufferSlot(target);
+        if (!slot || changed(*slot, buffer))
+            glBindBuffer(target, buffer);
+    }
+    // binds a texture to a unit, selecting the unit only when the binding actually changes
+    // ------------------------------------------------------------------------
+    static void BindTexture(unsigned int unit, GLenum target, GLuint texture)
+    {
+        GLuint* slot = textureSlot(unit, target);
+        if (slot && !changed(*slot, texture))
+            return;
+        ActiveTexture(unit);
+        glBindTexture(target, texture);
+    }
+    // ------------------------------------------------------------------------
+    static void ActiveTexture(unsigned int unit)
+    {
+        if (changed(cache().activeTexture, unit))
+            glActiveTexture(GL_TEXTURE0 + unit);
+    }
+    // ------------------------------------------------------------------------
+    static void DepthFunc(GLenum func)
+    {
+        if (changed(cache().depthFunc, func))
+            glDepthFunc(func);
+    }
+
+    // deleting an object unbinds it, and its name may be handed out again
+    // ------------------------------------------------------------------------
+    static void DeleteTexture(GLuint texture)
+    {
+        for (unsigned int unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+            for (GLuint& bound : cache().textures[unit])
+                if (bound == texture)
+                    bound = 0;
+        glDeleteTextures(1, &texture);
+    }
+    // ------------------------------------------------------------------------
+    static void DeleteBuffer(GLuint buffer)
+    {
+        State& state = cache();
+        for (GLuint* bound : { &state.arrayBuffer, &state.elementBuffer, &state.uniformBuffer, &state.pixelUnpackBuffer, &state.drawIndirectBuffer })
+            if (*bound == buffer)
+                *bound = 0;
+        glDeleteBuffers(1, &buffer);
+    }
+    // ------------------------------------------------------------------------
+    static void DeleteVertexArray(GLuint vao)
+    {
+        if (cache().vertexArray == vao)
+        {
+            cache().vertexArray = 0;
+            cache().elementBuffer = UNKNOWN;
+        }
+        glDeleteVertexArrays(1, &vao);
+    }
+
+    // forgets everything, so the next call of each kind is issued unconditionally
+    // ------------------------------------------------------------------------
+    static void Invalidate()
+    {
+        cache() = State();
+    }
+
+private:
+    static const GLuint UNKNOWN = 0xFFFFFFFF;
+
+    struct State
+    {
+        GLuint program = UNKNOWN;
+        GLuint vertexArray = UNKNOWN;
+        GLuint arrayBuffer = UNKNOWN;
+        GLuint elementBuffer = UNKNOWN;
+        GLuint uniformBuffer = UNKNOWN;
+        GLuint pixelUnpackBuffer = UNKNOWN;
+        GLuint drawIndirectBuffer = UNKNOWN;
+        GLuint activeTexture = UNKNOWN;
+        GLuint depthFunc = UNKNOWN;
+        GLuint textures[MAX_TEXTURE_UNITS][2] = {};  // GL_TEXTURE_2D and GL_TEXTURE_CUBE_MAP per unit
+
+        State()
+        {
+            for (unsigned int unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+                textures[unit][0] = textures[unit][1] = UNKNOWN;
+        }
+    };
+    static State& cache()
+    {
+        static State state;
+        return state;
+    }
+
+    // records the new value; true if it differs from the cached one and the GL call has to be made
+    static bool changed(GLuint& cached, GLuint value)
+    {
+        if (cached == value)
+        {
+            Stats().filtered++;
+            return false;
+        }
+        cached = value;
+        Stats().issued++;
+        return true;
+    }
+
+    // untracked targets return nullptr and are always issued
+    static GLuint* bufferSlot(GLenum target)
+    {
+        switch (target)
+        {
+        case GL_ARRAY_BUFFER: return &cache().arrayBuffer;
+        case GL_ELEMENT_ARRAY_BUFFER: return &cache().elementBuffer;
+        case GL_UNIFORM_BUFFER: return &cache().uniformBuffer;
+        case GL_PIXEL_UNPACK_BUFFER: return &cache().pixelUnpackBuffer;
+        case GL_DRAW_INDIRECT_BUFFER: return &cache().drawIndirectBuffer;
+        default: Stats().issued++; return nullptr;
+        }
+    }
+    static GLuint* textureSlot(unsigned int unit, GLenum target)
+    {
+        if (unit < MAX_TEXTURE_UNITS && target == GL_TEXTURE_2D)
+            return &cache().textures[unit][0];
+        if (unit < MAX_TEXTURE_UNITS && target == GL_TEXTURE_CUBE_MAP)
+            return &cache().textures[unit][1];
+        Stats().issued++;
+        return nullptr;
+    }
+};
+#endif
@@ -0,0 +1,71 @@
+// material.cpp
+#include "material.h"
+
+#include <misc/gl_state.h>
+#include <misc/texture_streamer.h>
+
+#include <algorithm>
+#include <iostream>
+
+MaterialLibrary::MaterialLibrary()
+{
+    materials.push_back(Material());
+}
+
+unsigned int MaterialLibrary::Create(const vector<Texture>& textures)
+{
+    // the samplers are numbered per type in the order the textures come: texture_diffuse1, texture_diffuse2, ...
+    Material material;
+    vector<pair<string, unsigned int>> typeCounts;
+    for (const Texture& texture : textures)
+    {
+        auto count = std::find_if(typeCounts.begin(), typeCounts.end(),
+                                  [&texture](const pair<string, unsigned int>& entry) { return entry.first == texture.type; });
+        if (count == typeCounts.end())
+        {
+            typeCounts.push_back(make_pair(texture.type, 0u));
+            count = typeCounts.end() - 1;
+        }
+        string samplerName = texture.type + std::to_string(++count->second);
+
+        auto name = std::find(samplerNames.begin(), samplerNames.end(), samplerName);
+        if (name == samplerNames.end())
+        {
+            samplerNames.push_back(samplerName);
+            name = samplerNames.end() - 1;
+            if (samplerNames.size() > 16)
+                std::cout << "Materials: " << samplerName << " needs texture unit " << samplerNames.size() - 1
+                          << ", beyond the 16 every GL 4.1 implementation has" << std::endl;
+        }
+        material.textures.push_back(texture.id);
+        material.units.push_back((unsigned int)(name - samplerNames.begin()));
+    }
+
+    for (size_t i = 0; i < materials.size(); i++)
+        if (materials[i].textures == material.textures && materials[i].units == material.units)
+            return (unsigned int)i;
+    materials.push_back(material);
+    return (unsigned int)(materials.size() - 1);
+}
+
+void MaterialLibrary::Bind(unsigned int material, const Shader& shader)
+{
+    ProgramSamplers* samplers = nullptr;
+    for (ProgramSamplers& candidate : programs)
+        if (candidate.program == shader.ID)
+            samplers = &candidate;
+    if (!samplers)
+    {
+        programs.push_back({ shader.ID, 0 });
+        samplers = &programs.back();
+    }
+    // sampler names added since the program was last bound; a program that lacks one ignores it
+    for (unsigned int unit = samplers->samplersSet; unit < samplerNames.size(); unit++)
+        shader.setInt(samplerNames[unit], (int)unit);
+    samplers->samplersSet = (unsigned int)samplerNames.size();
+
+    // the texture, or its placeholder while it streams in; units that already hold it are left alone
+    const Material& bound = materials[material];
+    for (size_t i = 0; i < bound.textures.size(); i++)
+        GLState::BindTexture(bound.units[i], GL_TEXTURE_2D, TextureStreamer::Get().Resolve(bound.textures[i]));
+}
@@ -0,0 +1,61 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include <misc/shader_m.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+struct Texture {
+    unsigned int id;
+    string type;
+    string path;
+};
+
+// a material's textures, each with the texture unit its sampler reads
+struct Material {
+    vector<unsigned int> textures;  // GL names, resolved through the TextureStreamer while they stream in
+    vector<unsigned int> units;
+};
+
+// Process-wide table of materials, filled at load time on the GL thread. Every sampler name the loader uses
+// (texture_diffuse1, texture_specular1, ...) gets a texture unit of its own the first time a material needs it,
+// so a sampler reads the same unit in every material and a program's sampler uniforms only have to be set
+// once. Binding a material is then a handful of integer texture binds, filtered by GLState. Identical texture
+// sets share one material; material 0 has no textures.
+class MaterialLibrary
+{
+public:
+    static MaterialLibrary& Get()
+    {
+        static MaterialLibrary library;
+        return library;
+    }
+
+    // the material with these textures, in this order, created if there is none yet
+    unsigned int Create(const vector<Texture>& textures);
+    // binds the material's textures for shader; points the program's samplers at their units on first use
+    void Bind(unsigned int material, const Shader& shader);
+
+    const Material& GetMaterial(unsigned int material) const { return materials[material]; }
+    unsigned int GetCount() const { return (unsigned int)materials.size(); }
+    unsigned int GetUnitCount() const { return (unsigned int)samplerNames.size(); }
+
+private:
+    // how many of the sampler names a program has already been given their units for
+    struct ProgramSamplers {
+        unsigned int program;
+        unsigned int samplersSet;
+    };
+
+    vector<Material> materials;
+    vector<string> samplerNames;  // index = texture unit
+    vector<ProgramSamplers> programs;
+
+    MaterialLibrary();
+    MaterialLibrary(const MaterialLibrary&) = delete;
+    MaterialLibrary& operator=(const MaterialLibrary&) = delete;
+};
+
+#endif
@@ -5,52 +5,150 @@
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/quaternion.hpp>
 
-#include <misc/shader.h>
+#include <misc/shader_m.h>
+#include <misc/gl_state.h>
+#include <misc/material.h>
 
+#include <algorithm>
+#include <cmath>
 #include <string>
+#include <utility>
 #include <vector>
 using namespace std;
 
 #define MAX_BONE_INFLUENCE 4
 
+// compact vertex for static meshes: 20 bytes instead of the 88 of a full float vertex
 struct Vertex {
     // position
     glm::vec3 Position;
-    // normal
-    glm::vec3 Normal;
-    // texCoords
-    glm::vec2 TexCoords;
-    // tangent
-    glm::vec3 Tangent;
-    // bitangent
-    glm::vec3 Bitangent;
-	//bone indexes which will influence this vertex
-	int m_BoneIDs[MAX_BONE_INFLUENCE];
-	//weights from each bone
-	float m_Weights[MAX_BONE_INFLUENCE];
+    // normal, signed normalized 10:10:10:2 (GL_INT_2_10_10_10_REV)
+    GLuint Normal;
+    // texCoords, half floats
+    glm::u16vec2 TexCoords;
 };
 
-struct Texture {
-    unsigned int id;
-    string type;
-    string path;
+static_assert(sizeof(Vertex) == 20, "Vertex must stay tightly packed");
+
+// optional bone stream, only created for meshes that have bones
+struct VertexBones {
+	//bone indexes which will influence this vertex
+	glm::u8vec4 m_BoneIDs;
+	//weights from each bone, unsigned normalized
+	glm::u8vec4 m_Weights;
 };
 
+// packs a unit vector into signed normalized 10:10:10:2, x in the lowest bits
+inline GLuint PackNormal(const glm::vec3 &normal)
+{
+    glm::ivec3 v = glm::ivec3(glm::round(glm::clamp(normal, -1.0f, 1.0f) * 511.0f));
+    return (GLuint)(v.x & 0x3FF) | (GLuint)(v.y & 0x3FF) << 10 | (GLuint)(v.z & 0x3FF) << 20;
+}
+
+inline glm::u16vec2 PackTexCoords(const glm::vec2 &uv)
+{
+    return glm::u16vec2(glm::packHalf1x16(uv.x), glm::packHalf1x16(uv.y));
+}
+
+// encodes a tangent frame as one quaternion (QTangent); the sign of w carries the bitangent handedness
+inline glm::i16vec4 PackQTangent(const glm::vec3 &normal, const glm::vec3 &tangent, const glm::vec3 &bitangent)
+{
+    glm::vec3 n = glm::normalize(normal);
+    glm::vec3 t = glm::normalize(tangent - n * glm::dot(n, tangent));
+    glm::vec3 b = glm::cross(n, t);
+    bool reflected = glm::dot(b, bitangent) < 0.0f;
+
+    glm::quat q = glm::normalize(glm::quat_cast(glm::mat3(t, b, n)));
+    if (q.w < 0.0f)
+        q = -q;
+    // keep w away from zero so its sign survives quantization
+    const float bias = 1.0f / 32767.0f;
+    if (q.w < bias)
+    {
+        float scale = std::sqrt(1.0f - bias * bias);
+        q = glm::quat(bias, q.x * scale, q.y * scale, q.z * scale);
+    }
+    if (reflected)
+        q = -q;
+    return glm::i16vec4(glm::round(glm::vec4(q.x, q.y, q.z, q.w) * 32767.0f));
+}
+
+// axis-aligned bounds of the vertex positions
+inline void ComputeBounds(const vector<Vertex> &vertices, glm::vec3 &boundsMin, glm::vec3 &boundsMax)
+{
+    boundsMin = vertices.empty() ? glm::vec3(0.0f) : vertices[0].Position;
+    boundsMax = boundsMin;
+    for (const Vertex &vertex : vertices)
+    {
+        boundsMin = glm::min(boundsMin, vertex.Position);
+        boundsMax = glm::max(boundsMax, vertex.Position);
+    }
+}
+
+// sphere around the centre of the bounds that holds every vertex; usually tighter than the box's own
+inline float ComputeBoundingRadius(const vector<Vertex> &vertices, const glm::vec3 &boundsMin, const glm::vec3 &boundsMax)
+{
+    glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+    float radiusSquared = 0.0f;
+    for (const Vertex &vertex : vertices)
+    {
+        glm::vec3 offset = vertex.Position - center;
+        radiusSquared = std::max(radiusSquared, glm::dot(offset, offset));
+    }
+    return std::sqrt(radiusSquared);
+}
+
+// describes the Vertex layout for the VAO and array buffer currently bound
+inline void SetVertexAttribPointers()
+{
+    // vertex Positions
+    glEnableVertexAttribArray(0);	
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+    // vertex normals, unpacked to [-1, 1] by the vertex fetch
+    glEnableVertexAttribArray(1);	
+    glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
+    // vertex texture coords
+    glEnableVertexAttribArray(2);	
+    glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+}
+
+// describes the baked colour stream for the VAO and array buffer currently bound
+inline void SetColorAttribPointer()
+{
+    // RGBA8, unpacked to [0, 1] by the vertex fetch
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(glm::u8vec4), (void*)0);
+}
+
 class Mesh {
 public:
     // mesh Data
     vector<Vertex>       vertices;
     vector<unsigned int> indices;
-    vector<Texture>      textures;
+    unsigned int         material;   // in the MaterialLibrary
+    vector<glm::i16vec4> qtangents;  // empty unless a material needs tangents
+    vector<VertexBones>  bones;      // empty unless the source mesh has bones
+    vector<glm::u8vec4>  colors;     // baked palette colours, empty unless the model was imported with palette baking
+    glm::vec3 boundsMin = glm::vec3(0.0f);  // object space, filled in by the loader
+    glm::vec3 boundsMax = glm::vec3(0.0f);
+    float boundsRadius = 0.0f;              // bounding sphere around the centre of the box
     unsigned int VAO;
+    GLenum indexType = GL_UNSIGNED_INT;  // GL_UNSIGNED_SHORT on the GPU when every index fits
 
     // constructor
-    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, unsigned int material,
+         vector<glm::i16vec4> qtangents = vector<glm::i16vec4>(), vector<VertexBones> bones = vector<VertexBones>(),
+         vector<glm::u8vec4> colors = vector<glm::u8vec4>())
     {
-        this->vertices = vertices;
-        this->indices = indices;
-        this->textures = textures;
+        this->vertices = std::move(vertices);
+        this->indices = std::move(indices);
+        this->material = material;
+        this->qtangents = std::move(qtangents);
+        this->bones = std::move(bones);
+        this->colors = std::move(colors);
 
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
         setupMesh();
@@ -60,43 +158,32 @@ public:
     void Draw(Shader &shader) 
     {
         // bind appropriate textures
-        unsigned int diffuseNr  = 1;
-        unsigned int specularNr = 1;
-        unsigned int normalNr   = 1;
-        unsigned int heightNr   = 1;
-        for(unsigned int i = 0; i < textures.size(); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
-            // retrieve texture number (the N in diffuse_textureN)
-            string number;
-            string name = textures[i].type;
-            if(name == "texture_diffuse")
-                number = std::to_string(diffuseNr++);
-            else if(name == "texture_specular")
-                number = std::to_string(specularNr++); // transfer unsigned int to string
-            else if(name == "texture_normal")
-                number = std::to_string(normalNr++); // transfer unsigned int to string
-             else if(name == "texture_height")
-                number = std::to_string(heightNr++); // transfer unsigned int to string
-
-            // now set the sampler to the correct texture unit
-            glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
-            // and finally bind the texture
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
-        }
+        MaterialLibrary::Get().Bind(material, shader);
         
-        // draw mesh
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+        // draw mesh; bindings are left in place for the next draw, GLState knows about them
+        GLState::BindVertexArray(VAO);
+        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), indexType, 0);
+    }
 
-        // always good practice to set everything back to defaults once configured.
-        glActiveTexture(GL_TEXTURE0);
+    // frees the mesh's own buffers once its geometry lives in a shared GeometryArena; the CPU copy is kept
+    void ReleaseBuffers()
+    {
+        GLState::DeleteVertexArray(VAO);
+        GLState::DeleteBuffer(VBO);
+        GLState::DeleteBuffer(EBO);
+        if (tangentVBO)
+            GLState::DeleteBuffer(tangentVBO);
+        if (boneVBO)
+            GLState::DeleteBuffer(boneVBO);
+        if (colorVBO)
+            GLState::DeleteBuffer(colorVBO);
+        VAO = VBO = EBO = tangentVBO = boneVBO = colorVBO = 0;
     }
 
 private:
     // render data 
     unsigned int VBO, EBO;
+    unsigned int tangentVBO = 0, boneVBO = 0, colorVBO = 0;
 
     // initializes all the buffer objects/arrays
     void setupMesh()
@@ -106,41 +193,59 @@ private:
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
 
-        glBindVertexArray(VAO);
+        GLState::BindVertexArray(VAO);
         // load data into vertex buffers
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        GLState::BindBuffer(GL_ARRAY_BUFFER, VBO);
         // A great thing about structs is that their memory layout is sequential for all its items.
-        // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
-        // again translates to 3/2 floats which translates to a byte array.
+        // The effect is that we can simply pass a pointer to the struct and it translates perfectly to the
+        // packed attribute formats described below.
         glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);  
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        // 16-bit indices halve the index fetch for every mesh with fewer than 65536 vertices
+        GLState::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        if (vertices.size() <= 65536)
+        {
+            vector<unsigned short> shortIndices(indices.begin(), indices.end());
+            indexType = GL_UNSIGNED_SHORT;
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(unsigned short), shortIndices.data(), GL_STATIC_DRAW);
+        }
+        else
+        {
+            indexType = GL_UNSIGNED_INT;
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+        }
 
         // set the vertex attribute pointers
-        // vertex Positions
-        glEnableVertexAttribArray(0);	
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-        // vertex normals
-        glEnableVertexAttribArray(1);	
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
-        // vertex texture coords
-        glEnableVertexAttribArray(2);	
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
-        // vertex tangent
-        glEnableVertexAttribArray(3);
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Tangent));
-        // vertex bitangent
-        glEnableVertexAttribArray(4);
-        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
-		// ids
-		glEnableVertexAttribArray(5);
-		glVertexAttribIPointer(5, 4, GL_INT, sizeof(Vertex), (void*)offsetof(Vertex, m_BoneIDs));
-
-		// weights
-		glEnableVertexAttribArray(6);
-		glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_Weights));
-        glBindVertexArray(0);
+        SetVertexAttribPointers();
+        // tangent frame as a QTangent, in its own stream so meshes without normal maps don't pay for it
+        if (!qtangents.empty())
+        {
+            glGenBuffers(1, &tangentVBO);
+            GLState::BindBuffer(GL_ARRAY_BUFFER, tangentVBO);
+            glBufferData(GL_ARRAY_BUFFER, qtangents.size() * sizeof(glm::i16vec4), &qtangents[0], GL_STATIC_DRAW);
+            glEnableVertexAttribArray(3);
+            glVertexAttribPointer(3, 4, GL_SHORT, GL_TRUE, sizeof(glm::i16vec4), (void*)0);
+        }
+        if (!colors.empty())
+        {
+            glGenBuffers(1, &colorVBO);
+            GLState::BindBuffer(GL_ARRAY_BUFFER, colorVBO);
+            glBufferData(GL_ARRAY_BUFFER, colors.size() * sizeof(glm::u8vec4), &colors[0], GL_STATIC_DRAW);
+            SetColorAttribPointer();
+        }
+        if (!bones.empty())
+        {
+            glGenBuffers(1, &boneVBO);
+            GLState::BindBuffer(GL_ARRAY_BUFFER, boneVBO);
+            glBufferData(GL_ARRAY_BUFFER, bones.size() * sizeof(VertexBones), &bones[0], GL_STATIC_DRAW);
+            // ids
+            glEnableVertexAttribArray(5);
+            glVertexAttribIPointer(5, 4, GL_UNSIGNED_BYTE, sizeof(VertexBones), (void*)offsetof(VertexBones, m_BoneIDs));
+            // weights
+            glEnableVertexAttribArray(6);
+            glVertexAttribPointer(6, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(VertexBones), (void*)offsetof(VertexBones, m_Weights));
+        }
+        GLState::BindVertexArray(0);
     }
 };
 #endif
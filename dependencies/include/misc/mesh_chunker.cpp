@@ -0,0 +1,102 @@
+// mesh_chunker.cpp
+#include "mesh_chunker.h"
+
+#include <limits>
+
+// sorts the triangles into octants around the centre of their centroids' bounds, recursively
+static void subdivide(const vector<glm::vec3>& centroids, vector<unsigned int>& triangles, size_t maxTriangles,
+                      int depth, vector<vector<unsigned int>>& leaves)
+{
+    if (triangles.size() <= maxTriangles || depth == 0)
+    {
+        leaves.push_back(std::move(triangles));
+        return;
+    }
+
+    glm::vec3 boundsMin(std::numeric_limits<float>::max());
+    glm::vec3 boundsMax(-std::numeric_limits<float>::max());
+    for (unsigned int triangle : triangles)
+    {
+        boundsMin = glm::min(boundsMin, centroids[triangle]);
+        boundsMax = glm::max(boundsMax, centroids[triangle]);
+    }
+    glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+
+    vector<unsigned int> octants[8];
+    for (unsigned int triangle : triangles)
+    {
+        const glm::vec3& centroid = centroids[triangle];
+        int octant = (centroid.x > center.x ? 1 : 0) | (centroid.y > center.y ? 2 : 0) | (centroid.z > center.z ? 4 : 0);
+        octants[octant].push_back(triangle);
+    }
+    // every centroid in one spot: splitting again would not get anywhere
+    for (const vector<unsigned int>& octant : octants)
+    {
+        if (octant.size() == triangles.size())
+        {
+            leaves.push_back(std::move(triangles));
+            return;
+        }
+    }
+
+    vector<unsigned int>().swap(triangles);
+    for (vector<unsigned int>& octant : octants)
+        if (!octant.empty())
+            subdivide(centroids, octant, maxTriangles, depth - 1, leaves);
+}
+
+vector<MeshChunk> SplitMesh(const vector<Vertex>& vertices, const vector<unsigned int>& indices,
+                            const vector<glm::i16vec4>& qtangents, const vector<VertexBones>& bones,
+                            size_t maxTriangles, int maxDepth)
+{
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount <= maxTriangles || maxDepth <= 0)
+        return vector<MeshChunk>();
+
+    vector<glm::vec3> centroids(triangleCount);
+    vector<unsigned int> triangles(triangleCount);
+    for (size_t t = 0; t < triangleCount; t++)
+    {
+        centroids[t] = (vertices[indices[t * 3]].Position + vertices[indices[t * 3 + 1]].Position
+                        + vertices[indices[t * 3 + 2]].Position) / 3.0f;
+        triangles[t] = (unsigned int)t;
+    }
+
+    vector<vector<unsigned int>> leaves;
+    subdivide(centroids, triangles, maxTriangles, maxDepth, leaves);
+    if (leaves.size() < 2)
+        return vector<MeshChunk>();
+
+    // renumber each chunk's vertices in first-use order; remap is reset after every chunk
+    const unsigned int unused = std::numeric_limits<unsigned int>::max();
+    vector<unsigned int> remap(vertices.size(), unused);
+    vector<MeshChunk> chunks(leaves.size());
+    for (size_t c = 0; c < leaves.size(); c++)
+    {
+        // the octants keep the triangles in the optimizer's order
+        const vector<unsigned int>& leaf = leaves[c];
+        MeshChunk& chunk = chunks[c];
+        chunk.indices.reserve(leaf.size() * 3);
+        for (unsigned int triangle : leaf)
+        {
+            for (int corner = 0; corner < 3; corner++)
+            {
+                unsigned int vertex = indices[triangle * 3 + corner];
+                if (remap[vertex] == unused)
+                {
+                    remap[vertex] = (unsigned int)chunk.vertices.size();
+                    chunk.vertices.push_back(vertices[vertex]);
+                    if (!qtangents.empty())
+                        chunk.qtangents.push_back(qtangents[vertex]);
+                    if (!bones.empty())
+                        chunk.bones.push_back(bones[vertex]);
+                }
+                chunk.indices.push_back(remap[vertex]);
+            }
+        }
+        for (unsigned int triangle : leaf)
+            for (int corner = 0; corner < 3; corner++)
+                remap[indices[triangle * 3 + corner]] = unused;
+    }
+    return chunks;
+}
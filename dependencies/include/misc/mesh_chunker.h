@@ -0,0 +1,32 @@
+#ifndef MESH_CHUNKER_H
+#define MESH_CHUNKER_H
+
+#include <misc/mesh.h>
+
+#include <cstddef>
+#include <vector>
+using namespace std;
+
+// meshes with more triangles than this are split; it is also the size the octree subdivides down to
+#define MESH_CHUNK_TRIANGLES 1024
+// octree levels at most, so a mesh becomes no more than 8^depth chunks
+#define MESH_CHUNK_MAX_DEPTH 3
+
+// a spatially coherent piece of a larger mesh, with its own compact vertex numbering
+struct MeshChunk {
+    vector<Vertex>       vertices;
+    vector<unsigned int> indices;
+    vector<glm::i16vec4> qtangents;
+    vector<VertexBones>  bones;
+};
+
+// Load-time split of a large static mesh into chunks for per-region culling. Triangles are sorted into the
+// octants of the mesh's bounds by their centroid, recursively until an octant holds at most maxTriangles
+// or maxDepth is reached. Every chunk keeps its triangles in their original, already cache-optimized order
+// and gets only the vertices it uses, numbered by first use. Returns nothing when the mesh is small enough
+// to stay whole. The optional streams are either empty or have one entry per vertex.
+vector<MeshChunk> SplitMesh(const vector<Vertex>& vertices, const vector<unsigned int>& indices,
+                            const vector<glm::i16vec4>& qtangents, const vector<VertexBones>& bones,
+                            size_t maxTriangles = MESH_CHUNK_TRIANGLES, int maxDepth = MESH_CHUNK_MAX_DEPTH);
+
+#endif
@@ -0,0 +1,318 @@
+// mesh_optimizer.cpp
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+    // Forsyth's "Linear-Speed Vertex Cache Optimisation" with the weights from the paper
+    const int FORSYTH_CACHE_SIZE = 32;
+    const float FORSYTH_LAST_TRIANGLE_SCORE = 0.75f;
+    const float FORSYTH_CACHE_DECAY_POWER = 1.5f;
+    const float FORSYTH_VALENCE_BOOST_SCALE = 2.0f;
+    const float FORSYTH_VALENCE_BOOST_POWER = 0.5f;
+
+    float forsythVertexScore(int cachePosition, unsigned int remainingTriangles)
+    {
+        if (remainingTriangles == 0)
+            return -1.0f;
+
+        float score = 0.0f;
+        if (cachePosition >= 0)
+        {
+            // the three vertices of the last triangle get a fixed score so the next triangle doesn't just reuse its edge
+            if (cachePosition < 3)
+                score = FORSYTH_LAST_TRIANGLE_SCORE;
+            else
+                score = std::pow(1.0f - (float)(cachePosition - 3) / (FORSYTH_CACHE_SIZE - 3), FORSYTH_CACHE_DECAY_POWER);
+        }
+        // favour vertices with few triangles left, so lone triangles don't get stranded
+        score += FORSYTH_VALENCE_BOOST_SCALE * std::pow((float)remainingTriangles, -FORSYTH_VALENCE_BOOST_POWER);
+        return score;
+    }
+
+    // welds identical vertices: remap[i] is the first vertex with the same attributes as vertex i
+    void weldVertices(const vector<Vertex>& vertices, const vector<glm::i16vec4>& qtangents, const vector<VertexBones>& bones,
+                      vector<unsigned int>& remap)
+    {
+        const size_t count = vertices.size();
+        const size_t stride = sizeof(Vertex) + (qtangents.empty() ? 0 : sizeof(glm::i16vec4)) + (bones.empty() ? 0 : sizeof(VertexBones));
+
+        // every vertex with its streams as one contiguous key
+        vector<unsigned char> keys(count * stride);
+        for (size_t i = 0; i < count; i++)
+        {
+            unsigned char* key = &keys[i * stride];
+            std::memcpy(key, &vertices[i], sizeof(Vertex));
+            key += sizeof(Vertex);
+            if (!qtangents.empty())
+            {
+                std::memcpy(key, &qtangents[i], sizeof(glm::i16vec4));
+                key += sizeof(glm::i16vec4);
+            }
+            if (!bones.empty())
+                std::memcpy(key, &bones[i], sizeof(VertexBones));
+        }
+
+        vector<unsigned int> order(count);
+        for (size_t i = 0; i < count; i++)
+            order[i] = (unsigned int)i;
+        std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+            int difference = std::memcmp(&keys[a * stride], &keys[b * stride], stride);
+            return difference < 0 || (difference == 0 && a < b);
+        });
+
+        // each run of equal keys collapses onto its first vertex
+        remap.assign(count, 0);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (i > 0 && std::memcmp(&keys[order[i] * stride], &keys[order[i - 1] * stride], stride) == 0)
+                remap[order[i]] = remap[order[i - 1]];
+            else
+                remap[order[i]] = order[i];
+        }
+    }
+
+    void optimizeVertexCache(vector<unsigned int>& indices, size_t vertexCount)
+    {
+        const size_t triangleCount = indices.size() / 3;
+        if (triangleCount == 0)
+            return;
+
+        // vertex -> triangles adjacency
+        vector<unsigned int> remaining(vertexCount, 0);
+        for (unsigned int index : indices)
+            remaining[index]++;
+        vector<unsigned int> offsets(vertexCount + 1, 0);
+        for (size_t v = 0; v < vertexCount; v++)
+            offsets[v + 1] = offsets[v] + remaining[v];
+        vector<unsigned int> adjacency(indices.size());
+        vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t t = 0; t < triangleCount; t++)
+            for (int k = 0; k < 3; k++)
+                adjacency[fill[indices[t * 3 + k]]++] = (unsigned int)t;
+
+        vector<int> cachePosition(vertexCount, -1);
+        vector<float> vertexScore(vertexCount);
+        for (size_t v = 0; v < vertexCount; v++)
+            vertexScore[v] = forsythVertexScore(-1, remaining[v]);
+        vector<float> triangleScore(triangleCount);
+        for (size_t t = 0; t < triangleCount; t++)
+            triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+        vector<bool> emitted(triangleCount, false);
+
+        vector<unsigned int> result;
+        result.reserve(indices.size());
+        vector<unsigned int> cache, nextCache;
+        cache.reserve(FORSYTH_CACHE_SIZE + 3);
+        nextCache.reserve(FORSYTH_CACHE_SIZE + 3);
+
+        size_t bestTriangle = 0;
+        for (size_t t = 1; t < triangleCount; t++)
+            if (triangleScore[t] > triangleScore[bestTriangle])
+                bestTriangle = t;
+        size_t cursor = 0;
+
+        for (size_t emittedCount = 0; emittedCount < triangleCount; emittedCount++)
+        {
+            const unsigned int* triangle = &indices[bestTriangle * 3];
+            result.insert(result.end(), triangle, triangle + 3);
+            emitted[bestTriangle] = true;
+
+            // the new triangle goes to the front of the LRU cache
+            nextCache.assign(triangle, triangle + 3);
+            for (unsigned int v : cache)
+                if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+                    nextCache.push_back(v);
+            for (int k = 0; k < 3; k++)
+                remaining[triangle[k]]--;
+
+            // refresh the scores of everything in (or just pushed out of) the cache
+            for (size_t i = 0; i < nextCache.size(); i++)
+            {
+                unsigned int v = nextCache[i];
+                cachePosition[v] = i < (size_t)FORSYTH_CACHE_SIZE ? (int)i : -1;
+                vertexScore[v] = forsythVertexScore(cachePosition[v], remaining[v]);
+            }
+            if (nextCache.size() > (size_t)FORSYTH_CACHE_SIZE)
+                nextCache.resize(FORSYTH_CACHE_SIZE);
+            cache.swap(nextCache);
+
+            // the next triangle is the best one touching the cache
+            float bestScore = -1.0f;
+            for (unsigned int v : cache)
+            {
+                for (unsigned int a = offsets[v]; a < offsets[v + 1]; a++)
+                {
+                    unsigned int t = adjacency[a];
+                    if (emitted[t])
+                        continue;
+                    triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+                    if (triangleScore[t] > bestScore)
+                    {
+                        bestScore = triangleScore[t];
+                        bestTriangle = t;
+                    }
+                }
+            }
+            // nothing adjacent left: continue with the next triangle in input order
+            if (bestScore < 0.0f)
+            {
+                while (cursor < triangleCount && emitted[cursor])
+                    cursor++;
+                bestTriangle = cursor;
+            }
+        }
+        indices.swap(result);
+    }
+
+    // Splits the cache-ordered list where the simulated cache starts over (every vertex of a triangle misses), so moving
+    // whole clusters costs no cache efficiency, then draws clusters facing away from the mesh centre first.
+    void optimizeOverdraw(vector<unsigned int>& indices, const vector<Vertex>& vertices)
+    {
+        const size_t triangleCount = indices.size() / 3;
+        if (triangleCount < 2)
+            return;
+
+        vector<unsigned int> cacheTime(vertices.size(), 0);
+        unsigned int time = MESH_ANALYSIS_CACHE_SIZE + 1;
+        vector<size_t> clusterStarts;
+        for (size_t t = 0; t < triangleCount; t++)
+        {
+            int misses = 0;
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int v = indices[t * 3 + k];
+                if (time - cacheTime[v] > MESH_ANALYSIS_CACHE_SIZE)
+                {
+                    cacheTime[v] = time++;
+                    misses++;
+                }
+            }
+            if (t == 0 || misses == 3)
+                clusterStarts.push_back(t);
+        }
+        if (clusterStarts.size() < 2)
+            return;
+        clusterStarts.push_back(triangleCount);
+
+        struct Cluster {
+            size_t start, end;
+            glm::vec3 centroid;
+            glm::vec3 normal;
+            float area;
+            float sortKey;
+        };
+        vector<Cluster> clusters(clusterStarts.size() - 1);
+        glm::vec3 meshCentroid(0.0f);
+        float meshArea = 0.0f;
+        for (size_t c = 0; c < clusters.size(); c++)
+        {
+            Cluster& cluster = clusters[c];
+            cluster.start = clusterStarts[c];
+            cluster.end = clusterStarts[c + 1];
+            cluster.centroid = glm::vec3(0.0f);
+            cluster.normal = glm::vec3(0.0f);
+            cluster.area = 0.0f;
+            for (size_t t = cluster.start; t < cluster.end; t++)
+            {
+                const glm::vec3& p0 = vertices[indices[t * 3]].Position;
+                const glm::vec3& p1 = vertices[indices[t * 3 + 1]].Position;
+                const glm::vec3& p2 = vertices[indices[t * 3 + 2]].Position;
+                glm::vec3 cross = glm::cross(p1 - p0, p2 - p0);
+                float area = glm::length(cross);
+                cluster.centroid += (p0 + p1 + p2) * (area / 3.0f);
+                cluster.normal += cross;
+                cluster.area += area;
+            }
+            meshCentroid += cluster.centroid;
+            meshArea += cluster.area;
+            if (cluster.area > 0.0f)
+                cluster.centroid /= cluster.area;
+        }
+        if (meshArea > 0.0f)
+            meshCentroid /= meshArea;
+
+        for (Cluster& cluster : clusters)
+        {
+            float normalLength = glm::length(cluster.normal);
+            cluster.sortKey = normalLength > 0.0f ? glm::dot(cluster.centroid - meshCentroid, cluster.normal / normalLength) : 0.0f;
+        }
+        std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) {
+            return a.sortKey > b.sortKey;
+        });
+
+        vector<unsigned int> result;
+        result.reserve(indices.size());
+        for (const Cluster& cluster : clusters)
+            result.insert(result.end(), indices.begin() + cluster.start * 3, indices.begin() + cluster.end * 3);
+        indices.swap(result);
+    }
+
+    template <typename T>
+    void remapStream(vector<T>& stream, const vector<unsigned int>& remap, size_t newCount)
+    {
+        if (stream.empty())
+            return;
+        vector<T> result(newCount);
+        for (size_t i = 0; i < stream.size(); i++)
+            if (remap[i] != ~0u)
+                result[remap[i]] = stream[i];
+        stream.swap(result);
+    }
+}
+
+MeshCacheStats AnalyzeVertexCache(const vector<unsigned int>& indices, size_t vertexCount, unsigned int cacheSize)
+{
+    MeshCacheStats stats;
+    stats.triangles = indices.size() / 3;
+    stats.vertices = vertexCount;
+
+    vector<unsigned int> cacheTime(vertexCount, 0);
+    unsigned int time = cacheSize + 1;
+    for (unsigned int index : indices)
+    {
+        if (time - cacheTime[index] > cacheSize)
+        {
+            cacheTime[index] = time++;
+            stats.misses++;
+        }
+    }
+    return stats;
+}
+
+void OptimizeMesh(vector<Vertex>& vertices, vector<unsigned int>& indices,
+                  vector<glm::i16vec4>& qtangents, vector<VertexBones>& bones,
+                  MeshOptimizationReport* report)
+{
+    if (report)
+        report->before.Add(AnalyzeVertexCache(indices, vertices.size()));
+
+    // 1. weld
+    vector<unsigned int> weld;
+    weldVertices(vertices, qtangents, bones, weld);
+    for (unsigned int& index : indices)
+        index = weld[index];
+
+    // 2. and 3. triangle order
+    optimizeVertexCache(indices, vertices.size());
+    optimizeOverdraw(indices, vertices);
+
+    // 4. vertex order; welded-away and unreferenced vertices are dropped here
+    vector<unsigned int> remap(vertices.size(), ~0u);
+    unsigned int next = 0;
+    for (unsigned int& index : indices)
+    {
+        if (remap[index] == ~0u)
+            remap[index] = next++;
+        index = remap[index];
+    }
+    remapStream(vertices, remap, next);
+    remapStream(qtangents, remap, next);
+    remapStream(bones, remap, next);
+
+    if (report)
+        report->after.Add(AnalyzeVertexCache(indices, vertices.size()));
+}
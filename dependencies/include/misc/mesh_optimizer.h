@@ -0,0 +1,50 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <misc/mesh.h>
+
+#include <cstddef>
+#include <vector>
+using namespace std;
+
+// post-transform vertex cache simulated when measuring ACMR/ATVR
+#define MESH_ANALYSIS_CACHE_SIZE 16
+
+// cache misses of one or more index buffers, measured with a FIFO cache simulation
+struct MeshCacheStats {
+    size_t triangles = 0;
+    size_t vertices = 0;
+    size_t misses = 0;
+
+    // average cache miss ratio: transformed vertices per triangle (0.5 is ideal for a regular grid, 3 is worst)
+    double ACMR() const { return triangles ? (double)misses / triangles : 0.0; }
+    // average transform to vertex ratio: how often each vertex is transformed (1 is ideal)
+    double ATVR() const { return vertices ? (double)misses / vertices : 0.0; }
+
+    void Add(const MeshCacheStats& other)
+    {
+        triangles += other.triangles;
+        vertices += other.vertices;
+        misses += other.misses;
+    }
+};
+
+// before/after numbers of the optimization pass, accumulated over the meshes of a model
+struct MeshOptimizationReport {
+    MeshCacheStats before;
+    MeshCacheStats after;
+};
+
+MeshCacheStats AnalyzeVertexCache(const vector<unsigned int>& indices, size_t vertexCount, unsigned int cacheSize = MESH_ANALYSIS_CACHE_SIZE);
+
+// Load-time optimization of a triangle list, run once per mesh after it has been extracted from Assimp:
+//  1. welds vertices whose packed attributes (and optional tangent/bone streams) are identical,
+//  2. reorders triangles for the post-transform vertex cache (Forsyth),
+//  3. reorders clusters of triangles so outward-facing ones are drawn first, which reduces overdraw,
+//  4. renumbers vertices in first-use order so vertex fetch walks memory linearly.
+// The optional streams are either empty or have one entry per vertex and are remapped along with the vertices.
+void OptimizeMesh(vector<Vertex>& vertices, vector<unsigned int>& indices,
+                  vector<glm::i16vec4>& qtangents, vector<VertexBones>& bones,
+                  MeshOptimizationReport* report = nullptr);
+
+#endif
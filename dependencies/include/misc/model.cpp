@@ -1,154 +1,697 @@
 // Model.cpp
 #include "model.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+// post-processing applied on import; part of the model cache key
+static const unsigned int MODEL_IMPORT_FLAGS = aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace;
+
+// palette baking: only images this small are taken for palettes, and a triangle is a flat lookup when every
+// texel its texture coordinates span has the colour of its first corner, give or take PALETTE_TOLERANCE per channel
+static const int MAX_PALETTE_TEXELS = 128 * 128;
+static const int PALETTE_TOLERANCE = 2;
+
+static float millisecondsSince(std::chrono::high_resolution_clock::time_point begin)
+{
+    return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+}
+
+// The texel a packed texture coordinate falls in, before wrapping; FlipUVs already put v = 0 on the first row
+static glm::ivec2 paletteTexel(const DecodedImage& image, glm::u16vec2 texCoords)
+{
+    glm::vec2 uv(glm::unpackHalf1x16(texCoords.x), glm::unpackHalf1x16(texCoords.y));
+    return glm::ivec2((int)std::floor(uv.x * image.width), (int)std::floor(uv.y * image.height));
+}
+
+// The colour of a texel, wrapped like GL_REPEAT and widened to RGBA
+static glm::u8vec4 paletteColor(const DecodedImage& image, int x, int y)
+{
+    x = (x % image.width + image.width) % image.width;
+    y = (y % image.height + image.height) % image.height;
+    const unsigned char* texel = image.pixels + ((size_t)y * image.width + x) * image.components;
+    switch (image.components)
+    {
+    case 1: return glm::u8vec4(texel[0], texel[0], texel[0], 255);
+    case 2: return glm::u8vec4(texel[0], texel[0], texel[0], texel[1]);
+    case 3: return glm::u8vec4(texel[0], texel[1], texel[2], 255);
+    default: return glm::u8vec4(texel[0], texel[1], texel[2], texel[3]);
+    }
+}
+
+static bool similarColors(glm::u8vec4 a, glm::u8vec4 b)
+{
+    glm::ivec4 difference = glm::abs(glm::ivec4(a) - glm::ivec4(b));
+    return std::max(std::max(difference.x, difference.y), std::max(difference.z, difference.w)) <= PALETTE_TOLERANCE;
+}
+
 // Define the TextureFromFile function
 unsigned int TextureFromFile(const char* path, const string& directory, bool gamma)
 {
     string filename = string(path);
     filename = directory + '/' + filename;
 
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
-
-    int width, height, nrComponents;
-    unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-    if (data)
+    TextureCache& cache = TextureCache::Get();
+    unsigned int handle = cache.Request(filename);
+    unsigned int textureID = cache.Acquire(handle);
+    if (cache.Claim(handle))
     {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
+        TextureStreamer::Get().EnqueueFile(textureID, TextureStreamer::Texture2D, 0, filename, [handle](size_t bytes) {
+            TextureCache::Get().AddUploadedBytes(handle, bytes);
+        });
+    }
+    return textureID;
+}
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+// state shared by the tasks of one Assimp import
+struct Model::ImportJob
+{
+    string path;
+    string cachePath;
+    uint64_t sourceHash = 0;
+    std::chrono::high_resolution_clock::time_point begin;
+    Assimp::Importer importer;
+    vector<aiMesh*> sceneMeshes;
+    vector<MeshData> meshData;                 // one slot per scene mesh, filled by its task
+    vector<MeshOptimizationReport> reports;
+    std::atomic<unsigned int> remaining{ 0 };  // mesh tasks still running
+};
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// Model constructor
+Model::Model(string const& path, bool gamma, bool bakePalettes)
+    : gammaCorrection(gamma), boundsMin(0.0f), boundsMax(0.0f), loadedFromCache(false), paletteBaking(bakePalettes),
+      vertexColored(false), arena(nullptr), arenaBatch(0),
+      culler(nullptr), firstBound(0), queue(nullptr), queueSource(0), queuedItemsDrawn(0)
+{
+    AssetLoader loader;
+    directory = path.substr(0, path.find_last_of('/'));
+    loader.Run([this, path, &loader] { loadModel(path, loader); });
+    loader.Finish();
+}
 
-        stbi_image_free(data);
+// Model constructor that shares the loader's threads with other assets
+Model::Model(string const& path, AssetLoader& loader, bool gamma, bool bakePalettes)
+    : gammaCorrection(gamma), boundsMin(0.0f), boundsMax(0.0f), loadedFromCache(false), paletteBaking(bakePalettes),
+      vertexColored(false), arena(nullptr), arenaBatch(0),
+      culler(nullptr), firstBound(0), queue(nullptr), queueSource(0), queuedItemsDrawn(0)
+{
+    // retrieve the directory path of the filepath
+    directory = path.substr(0, path.find_last_of('/'));
+    loader.Run([this, path, &loader] { loadModel(path, loader); });
+}
+
+// Drops the references to the shared textures
+Model::~Model()
+{
+    for (unsigned int handle : textureHandles)
+        TextureCache::Get().Release(handle);
+}
+
+// Draws the model, and thus all its meshes
+void Model::Draw(Shader& shader)
+{
+    const unsigned char* visible = culler ? culler->GetVisibility(firstBound) : nullptr;
+    if (arena)
+        arena->Draw(arenaBatch, shader, visible);
+    for (unsigned int i = 0; i < meshes.size(); i++)
+        if ((!arena || !inArena[i]) && (!visible || visible[i]))
+            meshes[i].Draw(shader);
+}
+
+// Hands the static meshes over to the arena; their own buffers are no longer needed
+void Model::UseArena(GeometryArena& arena)
+{
+    this->arena = &arena;
+    arenaBatch = arena.Add(meshes, inArena);
+    for (unsigned int i = 0; i < meshes.size(); i++)
+        if (inArena[i])
+            meshes[i].ReleaseBuffers();
+}
+
+void Model::UseQueue(RenderQueue& queue)
+{
+    this->queue = &queue;
+    queueSource = queue.AddSource([this](const RenderCommand* commands, size_t count) { drawQueued(commands, count); });
+}
+
+// One command per mesh; the item points at the mesh and at this Submit's shader and transform
+void Model::Submit(unsigned int pass, Shader& shader, const glm::mat4& transform, const glm::vec3& eye)
+{
+    if (!queue)
+        return;
+    unsigned int state = (unsigned int)queuedStates.size();
+    queuedStates.push_back({ &shader, transform });
+    const unsigned char* visible = culler ? culler->GetVisibility(firstBound) : nullptr;
+    for (unsigned int i = 0; i < meshes.size(); i++)
+    {
+        if (visible && !visible[i])
+            continue;
+        const Mesh& mesh = meshes[i];
+        glm::vec3 center = glm::vec3(transform * glm::vec4((mesh.boundsMin + mesh.boundsMax) * 0.5f, 1.0f));
+        queue->Submit(RenderQueue::MakeKey(pass, shader.ID, mesh.material, glm::length(center - eye)), queueSource,
+                      (unsigned int)queuedItems.size());
+        queuedItems.push_back({ i, state });
     }
-    else
+    // nothing visible, so drawQueued will not come back to clear the state
+    if (queuedItems.empty() || queuedItems.back().state != state)
+        queuedStates.pop_back();
+}
+
+// The packed meshes of a run go to the arena together; the ones with their own VAO are drawn one by one as they come
+void Model::drawQueued(const RenderCommand* commands, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
     {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
+        unsigned int state = queuedItems[commands[i].item].state;
+        Shader& shader = *queuedStates[state].shader;
+        shader.use();
+        shader.setMat4("model", queuedStates[state].transform);
+        queuedArenaMeshes.clear();
+        for (; i < count && queuedItems[commands[i].item].state == state; i++)
+        {
+            unsigned int mesh = queuedItems[commands[i].item].mesh;
+            if (arena && inArena[mesh])
+                queuedArenaMeshes.push_back(mesh);
+            else
+                meshes[mesh].Draw(shader);
+        }
+        if (!queuedArenaMeshes.empty())
+            arena->DrawMeshes(arenaBatch, shader, queuedArenaMeshes.data(), queuedArenaMeshes.size());
     }
 
-    return textureID;
+    // the queue draws every command once per Flush, so the items are done with once all have come back
+    queuedItemsDrawn += count;
+    if (queuedItemsDrawn >= queuedItems.size())
+    {
+        queuedStates.clear();
+        queuedItems.clear();
+        queuedItemsDrawn = 0;
+    }
 }
 
-// Model constructor
-Model::Model(string const& path, bool gamma) : gammaCorrection(gamma)
+// Registers one bound per mesh, in mesh order
+void Model::UseCuller(FrustumCuller& culler, const glm::mat4& transform)
 {
-    loadModel(path);
+    this->culler = &culler;
+    firstBound = culler.GetCount();
+    for (const Mesh& mesh : meshes)
+        culler.Add(mesh.boundsMin, mesh.boundsMax, mesh.boundsRadius);
+    SetCullTransform(transform);
 }
 
-// Draws the model, and thus all its meshes
-void Model::Draw(Shader& shader)
+// Transforms the object space bounds: the box is re-fitted around the rotated box (Arvo), the sphere is scaled
+// by the largest axis scale
+void Model::SetCullTransform(const glm::mat4& transform)
 {
+    if (!culler)
+        return;
+    glm::mat3 linear(transform);
+    glm::mat3 absolute(glm::abs(linear[0]), glm::abs(linear[1]), glm::abs(linear[2]));
+    float scale = std::max(glm::length(linear[0]), std::max(glm::length(linear[1]), glm::length(linear[2])));
     for (unsigned int i = 0; i < meshes.size(); i++)
-        meshes[i].Draw(shader);
+    {
+        const Mesh& mesh = meshes[i];
+        glm::vec3 center = glm::vec3(transform * glm::vec4((mesh.boundsMin + mesh.boundsMax) * 0.5f, 1.0f));
+        glm::vec3 extent = absolute * ((mesh.boundsMax - mesh.boundsMin) * 0.5f);
+        culler->Set(firstBound + i, center - extent, center + extent, mesh.boundsRadius * scale);
+    }
 }
 
-// Loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
-void Model::loadModel(string const& path)
+// Expands the indexed meshes; the CPU copies are kept even for meshes that live in the arena
+void Model::CollectTriangles(vector<glm::vec3>& positions) const
 {
+    for (const Mesh& mesh : meshes)
+        for (unsigned int index : mesh.indices)
+            positions.push_back(mesh.vertices[index].Position);
+}
+
+// Loads a model with supported ASSIMP extensions from file. Runs on a loader thread: every aiMesh is processed
+// by its own task, textures are decoded alongside, and the GL thread only creates the buffers and textures.
+// The processed meshes are cached next to the source file and read back from there while the source is unchanged.
+void Model::loadModel(string const& path, AssetLoader& loader)
+{
+    auto loadBegin = std::chrono::high_resolution_clock::now();
+
+    // the cache key covers the source and, for OBJ files, the material library next to it
+    string cachePath = path + MODEL_CACHE_EXTENSION;
+    uint64_t sourceHash = 0;
+    {
+        MappedFile source(path);
+        if (source.IsOpen())
+            sourceHash = HashBytes(source.Data(), source.Size());
+        MappedFile materials(path.substr(0, path.find_last_of('.')) + ".mtl");
+        if (materials.IsOpen())
+            sourceHash = HashBytes(materials.Data(), materials.Size(), sourceHash);
+    }
+
+    auto meshData = std::make_shared<vector<MeshData>>();
+    float cachedImportMs = 0.0f;
+    if (sourceHash && loadFromCache(cachePath, sourceHash, *meshData, cachedImportMs))
+    {
+        float readMs = millisecondsSince(loadBegin);
+        loader.AddTime(LoadStage::Import, readMs);
+        loadedFromCache = true;
+        std::ostringstream message;
+        message << "Model cache " << path << ": hit, read in " << readMs << " ms (Assimp import took "
+                << cachedImportMs << " ms, " << cachedImportMs - readMs << " ms saved)";
+        loader.Log(message.str());
+
+        vector<TextureRef> textures;
+        for (const MeshData& data : *meshData)
+            if (data.colors.empty())
+                textures.insert(textures.end(), data.textures.begin(), data.textures.end());
+        decodeTextures(textures, loader);
+        loader.Upload([this, meshData] { uploadMeshes(*meshData); });
+        return;
+    }
+
+    auto job = std::make_shared<ImportJob>();
+    job->path = path;
+    job->cachePath = cachePath;
+    job->sourceHash = sourceHash;
+    job->begin = loadBegin;
+
     // read file via ASSIMP
-    Assimp::Importer importer;
-    const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+    const aiScene* scene = job->importer.ReadFile(path, MODEL_IMPORT_FLAGS);
+    loader.AddTime(LoadStage::Import, loadBegin);
 
     // check for errors
     if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
     {
-        std::cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << std::endl;
+        loader.Log(string("ERROR::ASSIMP:: ") + job->importer.GetErrorString());
         return;
     }
 
-    // retrieve the directory path of the filepath
-    directory = path.substr(0, path.find_last_of('/'));
+    // walk ASSIMP's root node recursively
+    collectMeshes(scene->mRootNode, scene, job->sceneMeshes);
+
+    // the textures are known from the materials alone, so decoding starts before the meshes are processed;
+    // with palette baking it waits for finishImport, which knows the palettes that are no longer sampled
+    vector<TextureRef> textures;
+    vector<bool> materialSeen(scene->mNumMaterials, false);
+    for (aiMesh* mesh : job->sceneMeshes)
+    {
+        if (materialSeen[mesh->mMaterialIndex])
+            continue;
+        materialSeen[mesh->mMaterialIndex] = true;
+        vector<TextureRef> materialTextures = collectMaterialTextures(scene->mMaterials[mesh->mMaterialIndex]);
+        textures.insert(textures.end(), materialTextures.begin(), materialTextures.end());
+    }
+    if (!paletteBaking)
+        decodeTextures(textures, loader);
 
-    // process ASSIMP's root node recursively
-    processNode(scene->mRootNode, scene);
+    size_t meshCount = job->sceneMeshes.size();
+    job->meshData.resize(meshCount);
+    job->reports.resize(meshCount);
+    job->remaining = (unsigned int)meshCount;
+    if (meshCount == 0)
+    {
+        finishImport(*job, loader);
+        return;
+    }
+    for (size_t i = 0; i < meshCount; i++)
+    {
+        loader.Run([this, job, i, &loader] {
+            auto processBegin = std::chrono::high_resolution_clock::now();
+            job->meshData[i] = processMesh(job->sceneMeshes[i], job->importer.GetScene(), job->reports[i]);
+            loader.AddTime(LoadStage::Process, processBegin);
+            if (--job->remaining == 0)
+                finishImport(*job, loader);
+        });
+    }
 }
 
-// Processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-void Model::processNode(aiNode* node, const aiScene* scene)
+// Runs after the last mesh of an import has been processed, on that mesh's loader thread
+void Model::finishImport(ImportJob& job, AssetLoader& loader)
 {
-    // process each mesh located at the current node
-    for (unsigned int i = 0; i < node->mNumMeshes; i++)
+    job.importer.FreeScene();
+
+    for (size_t i = 0; i < job.reports.size(); i++)
+    {
+        optimizationReport.before.Add(job.reports[i].before);
+        optimizationReport.after.Add(job.reports[i].after);
+    }
+    size_t sourceMeshes = job.meshData.size();
+    size_t chunks = splitLargeMeshes(job.meshData);
+    for (size_t i = 0; i < job.meshData.size(); i++)
+    {
+        boundsMin = i == 0 ? job.meshData[i].boundsMin : glm::min(boundsMin, job.meshData[i].boundsMin);
+        boundsMax = i == 0 ? job.meshData[i].boundsMax : glm::max(boundsMax, job.meshData[i].boundsMax);
+    }
+
+    const MeshCacheStats& before = optimizationReport.before;
+    const MeshCacheStats& after = optimizationReport.after;
+    std::ostringstream message;
+    message << "Mesh optimization " << job.path << ": " << before.vertices << " -> " << after.vertices << " vertices, "
+            << "ACMR " << before.ACMR() << " -> " << after.ACMR() << ", ATVR " << before.ATVR() << " -> " << after.ATVR();
+    loader.Log(message.str());
+
+    if (chunks)
+    {
+        message.str("");
+        message << "Mesh chunking " << job.path << ": " << sourceMeshes << " -> " << job.meshData.size() << " meshes ("
+                << chunks << " chunks)";
+        loader.Log(message.str());
+    }
+
+    // baked after chunking, so the chunker never sees a colour stream
+    if (paletteBaking)
+    {
+        auto bakeBegin = std::chrono::high_resolution_clock::now();
+        string rejection;
+        bool baked = bakePaletteColors(job.meshData, rejection);
+        loader.AddTime(LoadStage::Process, bakeBegin);
+        message.str("");
+        message << "Palette baking " << job.path << ": ";
+        if (baked)
+            message << job.meshData.size() << " meshes take their colour from the vertices";
+        else
+            message << "kept the textures, " << rejection;
+        loader.Log(message.str());
+
+        vector<TextureRef> textures;
+        for (const MeshData& data : job.meshData)
+            if (data.colors.empty())
+                textures.insert(textures.end(), data.textures.begin(), data.textures.end());
+        decodeTextures(textures, loader);
+    }
+
+    float importMs = millisecondsSince(job.begin);
+    message.str("");
+    message << "Model cache " << job.path << ": miss, imported in " << importMs << " ms";
+    loader.Log(message.str());
+    if (job.sourceHash)
+        saveToCache(job.cachePath, job.sourceHash, job.meshData, importMs);
+
+    auto meshData = std::make_shared<vector<MeshData>>(std::move(job.meshData));
+    loader.Upload([this, meshData] { uploadMeshes(*meshData); });
+}
+
+// Splits the meshes in place, keeping the authored order: the chunks of a mesh take its slot, one after another
+size_t Model::splitLargeMeshes(vector<MeshData>& meshData)
+{
+    vector<MeshData> split;
+    size_t chunkCount = 0;
+    for (MeshData& data : meshData)
+    {
+        // skinned meshes move as a whole, so there is nothing to gain from cutting them up
+        vector<MeshChunk> chunks;
+        if (data.bones.empty())
+            chunks = SplitMesh(data.vertices, data.indices, data.qtangents, data.bones);
+        if (chunks.empty())
+        {
+            split.push_back(std::move(data));
+            continue;
+        }
+        for (MeshChunk& chunk : chunks)
+        {
+            MeshData piece;
+            piece.vertices = std::move(chunk.vertices);
+            piece.indices = std::move(chunk.indices);
+            piece.qtangents = std::move(chunk.qtangents);
+            piece.bones = std::move(chunk.bones);
+            piece.textures = data.textures;
+            ComputeBounds(piece.vertices, piece.boundsMin, piece.boundsMax);
+            piece.boundsRadius = ComputeBoundingRadius(piece.vertices, piece.boundsMin, piece.boundsMax);
+            split.push_back(std::move(piece));
+        }
+        chunkCount += chunks.size();
+    }
+    meshData = std::move(split);
+    return chunkCount;
+}
+
+// All meshes or none: a model is drawn with one program, so a single mesh that needs its texture keeps every mesh
+// textured. Shared vertices agree, as a vertex has one texture coordinate and so one texel. Runs on a loader thread.
+bool Model::bakePaletteColors(vector<MeshData>& meshData, string& rejection)
+{
+    if (meshData.empty())
     {
-        aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-        meshes.push_back(processMesh(mesh, scene));
+        rejection = "there are no meshes";
+        return false;
     }
 
+    unordered_map<string, unique_ptr<DecodedImage>> palettes;
+    vector<vector<glm::u8vec4>> colors(meshData.size());
+    for (size_t i = 0; i < meshData.size(); i++)
+    {
+        const MeshData& data = meshData[i];
+        if (data.textures.size() != 1 || data.textures[0].type != "texture_diffuse")
+        {
+            rejection = "mesh " + std::to_string(i) + " has other textures than a single diffuse map";
+            return false;
+        }
+
+        unique_ptr<DecodedImage>& palette = palettes[data.textures[0].path];
+        if (!palette)
+            palette.reset(new DecodedImage(directory + '/' + data.textures[0].path));
+        const DecodedImage& image = *palette;
+        if (!image.pixels)
+        {
+            rejection = data.textures[0].path + " could not be decoded";
+            return false;
+        }
+        if (image.width * image.height > MAX_PALETTE_TEXELS)
+        {
+            rejection = data.textures[0].path + " is too large for a palette";
+            return false;
+        }
+
+        // every texel a triangle covers must have one colour, or the texture adds detail a vertex cannot hold
+        for (size_t t = 0; t + 2 < data.indices.size(); t += 3)
+        {
+            glm::ivec2 corners[3];
+            for (int c = 0; c < 3; c++)
+                corners[c] = paletteTexel(image, data.vertices[data.indices[t + c]].TexCoords);
+            glm::ivec2 low = glm::min(corners[0], glm::min(corners[1], corners[2]));
+            glm::ivec2 high = glm::max(corners[0], glm::max(corners[1], corners[2]));
+            bool flat = high.x - low.x < image.width && high.y - low.y < image.height;
+            glm::u8vec4 reference = paletteColor(image, corners[0].x, corners[0].y);
+            for (int y = low.y; flat && y <= high.y; y++)
+                for (int x = low.x; flat && x <= high.x; x++)
+                    flat = similarColors(paletteColor(image, x, y), reference);
+            if (!flat)
+            {
+                rejection = "mesh " + std::to_string(i) + " spans several colours of " + data.textures[0].path + " within a triangle";
+                return false;
+            }
+        }
+
+        colors[i].reserve(data.vertices.size());
+        for (const Vertex& vertex : data.vertices)
+        {
+            glm::ivec2 texel = paletteTexel(image, vertex.TexCoords);
+            colors[i].push_back(paletteColor(image, texel.x, texel.y));
+        }
+    }
+
+    for (size_t i = 0; i < meshData.size(); i++)
+        meshData[i].colors = std::move(colors[i]);
+    return true;
+}
+
+// A missing palette hashes as empty; the textures of meshes that were not baked are left out
+uint64_t Model::hashPalettes(const vector<MeshData>& meshData) const
+{
+    vector<string> hashed;
+    uint64_t hash = 0;
+    for (const MeshData& data : meshData)
+    {
+        if (data.colors.empty())
+            continue;
+        for (const TextureRef& texture : data.textures)
+        {
+            if (std::find(hashed.begin(), hashed.end(), texture.path) != hashed.end())
+                continue;
+            MappedFile palette(directory + '/' + texture.path);
+            hash = hashed.empty() ? HashBytes(palette.Data(), palette.Size()) : HashBytes(palette.Data(), palette.Size(), hash);
+            hashed.push_back(texture.path);
+        }
+    }
+    return hash;
+}
+
+// Reads the meshes, their texture references and bounds from the cache; the file is mapped and the blocks are
+// copied from the mapping into the meshes' vectors
+bool Model::loadFromCache(const string& cachePath, uint64_t sourceHash, vector<MeshData>& meshData, float& importMs)
+{
+    MappedFile file(cachePath);
+    if (!file.IsOpen())
+        return false;
+
+    ModelCacheReader reader(file.Data(), file.Size());
+    const ModelCacheHeader* header = reader.Take<ModelCacheHeader>();
+    if (!header || std::memcmp(header->magic, "GKMC", 4) != 0 || header->version != MODEL_CACHE_VERSION
+        || header->sourceHash != sourceHash || header->importFlags != MODEL_IMPORT_FLAGS
+        || header->bakePalettes != (paletteBaking ? 1u : 0u))
+        return false;
+
+    vector<MeshData> loaded(header->meshCount);
+    for (MeshData& data : loaded)
+    {
+        const ModelCacheMesh* record = reader.Take<ModelCacheMesh>();
+        if (!record)
+            break;
+
+        for (uint32_t t = 0; t < record->textureCount && !reader.Failed(); t++)
+        {
+            const uint32_t* lengths = reader.Take<uint32_t>(2);
+            if (!lengths)
+                break;
+            TextureRef texture;
+            texture.type = reader.TakeString(lengths[0]);
+            texture.path = reader.TakeString(lengths[1]);
+            data.textures.push_back(texture);
+        }
+
+        const Vertex* vertices = reader.Take<Vertex>(record->vertexCount);
+        const unsigned int* indices = reader.Take<unsigned int>(record->indexCount);
+        const glm::i16vec4* qtangents = reader.Take<glm::i16vec4>(record->qtangentCount);
+        const VertexBones* bones = reader.Take<VertexBones>(record->boneCount);
+        const glm::u8vec4* colors = reader.Take<glm::u8vec4>(record->colorCount);
+        if (reader.Failed())
+            break;
+
+        data.vertices.assign(vertices, vertices + record->vertexCount);
+        data.indices.assign(indices, indices + record->indexCount);
+        data.qtangents.assign(qtangents, qtangents + record->qtangentCount);
+        data.bones.assign(bones, bones + record->boneCount);
+        data.colors.assign(colors, colors + record->colorCount);
+        data.boundsMin = record->boundsMin;
+        data.boundsMax = record->boundsMax;
+        data.boundsRadius = record->boundsRadius;
+    }
+
+    if (reader.Failed())
+    {
+        std::cout << "Model cache " << cachePath << " is damaged, importing again" << std::endl;
+        return false;
+    }
+
+    // the baked colours are only as current as the palettes they came from
+    if (hashPalettes(loaded) != header->paletteHash)
+        return false;
+
+    meshData = std::move(loaded);
+    boundsMin = header->boundsMin;
+    boundsMax = header->boundsMax;
+    importMs = header->importMs;
+    return true;
+}
+
+// Writes the processed meshes in the layout described in model_cache.h
+void Model::saveToCache(const string& cachePath, uint64_t sourceHash, const vector<MeshData>& meshData, float importMs)
+{
+    ModelCacheWriter writer;
+    ModelCacheHeader header = {};
+    std::memcpy(header.magic, "GKMC", 4);
+    header.version = MODEL_CACHE_VERSION;
+    header.sourceHash = sourceHash;
+    header.importFlags = MODEL_IMPORT_FLAGS;
+    header.meshCount = (uint32_t)meshData.size();
+    header.boundsMin = boundsMin;
+    header.boundsMax = boundsMax;
+    header.importMs = importMs;
+    header.bakePalettes = paletteBaking ? 1u : 0u;
+    header.paletteHash = hashPalettes(meshData);
+    writer.Put(&header);
+
+    for (const MeshData& data : meshData)
+    {
+        ModelCacheMesh record = {};
+        record.vertexCount = (uint32_t)data.vertices.size();
+        record.indexCount = (uint32_t)data.indices.size();
+        record.qtangentCount = (uint32_t)data.qtangents.size();
+        record.boneCount = (uint32_t)data.bones.size();
+        record.textureCount = (uint32_t)data.textures.size();
+        record.colorCount = (uint32_t)data.colors.size();
+        record.boundsMin = data.boundsMin;
+        record.boundsMax = data.boundsMax;
+        record.boundsRadius = data.boundsRadius;
+        writer.Put(&record);
+
+        for (const TextureRef& texture : data.textures)
+        {
+            uint32_t lengths[2] = { (uint32_t)texture.type.size(), (uint32_t)texture.path.size() };
+            writer.Put(lengths, 2);
+            writer.PutString(texture.type);
+            writer.PutString(texture.path);
+        }
+        writer.Put(data.vertices.data(), data.vertices.size());
+        writer.Put(data.indices.data(), data.indices.size());
+        writer.Put(data.qtangents.data(), data.qtangents.size());
+        writer.Put(data.bones.data(), data.bones.size());
+        writer.Put(data.colors.data(), data.colors.size());
+    }
+    writer.Save(cachePath);
+}
+
+// Collects the meshes of a node in a recursive fashion, then repeats this for its children nodes (if any).
+void Model::collectMeshes(aiNode* node, const aiScene* scene, vector<aiMesh*>& sceneMeshes)
+{
+    // each mesh located at the current node
+    for (unsigned int i = 0; i < node->mNumMeshes; i++)
+        sceneMeshes.push_back(scene->mMeshes[node->mMeshes[i]]);
+
     // recursively process each of the children nodes
     for (unsigned int i = 0; i < node->mNumChildren; i++)
     {
-        processNode(node->mChildren[i], scene);
+        collectMeshes(node->mChildren[i], scene, sceneMeshes);
     }
 }
 
-// Processes an individual mesh and extracts the vertex data, indices, and textures.
-Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene)
+// Processes an individual mesh and extracts the vertex data, indices, and texture references. Runs on a loader thread.
+MeshData Model::processMesh(aiMesh* mesh, const aiScene* scene, MeshOptimizationReport& report)
 {
-    vector<Vertex> vertices;
-    vector<unsigned int> indices;
-    vector<Texture> textures;
+    MeshData data;
+    vector<Vertex>& vertices = data.vertices;
+    vector<unsigned int>& indices = data.indices;
+    vector<glm::i16vec4>& qtangents = data.qtangents;
+    vector<VertexBones>& bones = data.bones;
+
+    // tangent frames are only kept when the material has a normal map to use them with
+    aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+    bool needsTangents = mesh->HasTangentsAndBitangents() && mesh->HasNormals()
+        && (material->GetTextureCount(aiTextureType_HEIGHT) > 0 || material->GetTextureCount(aiTextureType_NORMALS) > 0);
 
     // walk through each of the mesh's vertices
     for (unsigned int i = 0; i < mesh->mNumVertices; i++)
     {
         Vertex vertex;
-        glm::vec3 vector;
 
         // positions
-        vector.x = mesh->mVertices[i].x;
-        vector.y = mesh->mVertices[i].y;
-        vector.z = mesh->mVertices[i].z;
-        vertex.Position = vector;
+        vertex.Position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
 
         // normals
+        glm::vec3 normal(0.0f);
         if (mesh->HasNormals())
-        {
-            vector.x = mesh->mNormals[i].x;
-            vector.y = mesh->mNormals[i].y;
-            vector.z = mesh->mNormals[i].z;
-            vertex.Normal = vector;
-        }
+            normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+        vertex.Normal = PackNormal(normal);
 
         // texture coordinates
         if (mesh->mTextureCoords[0])
-        {
-            glm::vec2 vec;
-            vec.x = mesh->mTextureCoords[0][i].x;
-            vec.y = mesh->mTextureCoords[0][i].y;
-            vertex.TexCoords = vec;
-
-            // tangent
-            vector.x = mesh->mTangents[i].x;
-            vector.y = mesh->mTangents[i].y;
-            vector.z = mesh->mTangents[i].z;
-            vertex.Tangent = vector;
-
-            // bitangent
-            vector.x = mesh->mBitangents[i].x;
-            vector.y = mesh->mBitangents[i].y;
-            vector.z = mesh->mBitangents[i].z;
-            vertex.Bitangent = vector;
-        }
+            vertex.TexCoords = PackTexCoords(glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y));
         else
+            vertex.TexCoords = PackTexCoords(glm::vec2(0.0f, 0.0f));
+
+        // tangent and bitangent, folded into one quaternion
+        if (needsTangents)
         {
-            vertex.TexCoords = glm::vec2(0.0f, 0.0f);
+            glm::vec3 tangent(mesh->mTangents[i].x, mesh->mTangents[i].y, mesh->mTangents[i].z);
+            glm::vec3 bitangent(mesh->mBitangents[i].x, mesh->mBitangents[i].y, mesh->mBitangents[i].z);
+            qtangents.push_back(PackQTangent(normal, tangent, bitangent));
         }
 
         vertices.push_back(vertex);
     }
 
+    // bone influences, only for skinned meshes
+    if (mesh->HasBones())
+        bones = extractBoneWeights(mesh);
+
     // walk through each of the mesh's faces (a face is a mesh its triangle) and retrieve the corresponding vertex indices.
     for (unsigned int i = 0; i < mesh->mNumFaces; i++)
     {
@@ -157,56 +700,159 @@ Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene)
             indices.push_back(face.mIndices[j]);
     }
 
-    // process materials
-    aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+    // weld and reorder for the vertex cache, overdraw and vertex fetch
+    OptimizeMesh(vertices, indices, qtangents, bones, &report);
+    ComputeBounds(vertices, data.boundsMin, data.boundsMax);
+    data.boundsRadius = ComputeBoundingRadius(vertices, data.boundsMin, data.boundsMax);
+
+    // the material's textures; they are decoded by their own tasks
+    data.textures = collectMaterialTextures(material);
+    return data;
+}
+
+// Collects up to MAX_BONE_INFLUENCE strongest bones per vertex and quantizes their normalized weights.
+vector<VertexBones> Model::extractBoneWeights(aiMesh* mesh)
+{
+    vector<glm::ivec4> ids(mesh->mNumVertices, glm::ivec4(0));
+    vector<glm::vec4> weights(mesh->mNumVertices, glm::vec4(0.0f));
+    unsigned int boneCount = std::min(mesh->mNumBones, 256u);
+    for (unsigned int boneIndex = 0; boneIndex < boneCount; boneIndex++)
+    {
+        const aiBone* bone = mesh->mBones[boneIndex];
+        for (unsigned int j = 0; j < bone->mNumWeights; j++)
+        {
+            unsigned int vertexId = bone->mWeights[j].mVertexId;
+            float weight = bone->mWeights[j].mWeight;
+            if (vertexId >= mesh->mNumVertices)
+                continue;
+            // replace the weakest influence if this one is stronger
+            int weakest = 0;
+            for (int k = 1; k < MAX_BONE_INFLUENCE; k++)
+                if (weights[vertexId][k] < weights[vertexId][weakest])
+                    weakest = k;
+            if (weight > weights[vertexId][weakest])
+            {
+                weights[vertexId][weakest] = weight;
+                ids[vertexId][weakest] = (int)boneIndex;
+            }
+        }
+    }
+
+    vector<VertexBones> bones(mesh->mNumVertices);
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+    {
+        float sum = weights[i].x + weights[i].y + weights[i].z + weights[i].w;
+        glm::vec4 normalized = sum > 0.0f ? weights[i] / sum : glm::vec4(0.0f);
+        bones[i].m_BoneIDs = glm::u8vec4(ids[i]);
+        bones[i].m_Weights = glm::u8vec4(glm::round(normalized * 255.0f));
+    }
+    return bones;
+}
+
+// Lists the textures of a material that the shaders sample
+vector<TextureRef> Model::collectMaterialTextures(aiMaterial* material)
+{
+    vector<TextureRef> textures;
 
     // 1. diffuse maps
-    vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
+    vector<TextureRef> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
     textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
 
     // 2. specular maps
-    vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
+    vector<TextureRef> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
     textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
 
     // 3. normal maps
-    vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
+    vector<TextureRef> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
     textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
 
     // 4. height maps
-    vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
+    vector<TextureRef> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
     textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 
-    // return a mesh object created from the extracted mesh data
-    return Mesh(vertices, indices, textures);
+    return textures;
 }
 
-// Checks all material textures of a given type and loads the textures if they're not loaded yet.
-vector<Texture> Model::loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName)
+// Lists all material textures of a given type.
+vector<TextureRef> Model::loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName)
 {
-    vector<Texture> textures;
+    vector<TextureRef> textures;
     for (unsigned int i = 0; i < mat->GetTextureCount(type); i++)
     {
         aiString str;
         mat->GetTexture(type, i, &str);
-        bool skip = false;
-        for (unsigned int j = 0; j < textures_loaded.size(); j++)
-        {
-            if (std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
-            {
-                textures.push_back(textures_loaded[j]);
-                skip = true;
-                break;
-            }
-        }
-        if (!skip)
-        {
-            Texture texture;
-            texture.id = TextureFromFile(str.C_Str(), this->directory);
-            texture.type = typeName;
-            texture.path = str.C_Str();
-            textures.push_back(texture);
-            textures_loaded.push_back(texture);
-        }
+        TextureRef texture;
+        texture.type = typeName;
+        texture.path = str.C_Str();
+        textures.push_back(texture);
     }
     return textures;
 }
+
+// Starts one decode task per distinct texture path; textures another model or file already provides are skipped
+void Model::decodeTextures(const vector<TextureRef>& textures, AssetLoader& loader)
+{
+    vector<string> scheduled;
+    for (const TextureRef& texture : textures)
+    {
+        if (std::find(scheduled.begin(), scheduled.end(), texture.path) != scheduled.end())
+            continue;
+        scheduled.push_back(texture.path);
+
+        string filename = directory + '/' + texture.path;
+        loader.Run([filename, &loader] {
+            TextureCache& cache = TextureCache::Get();
+            unsigned int handle = cache.Request(filename);
+            if (!cache.Claim(handle))
+                return;
+            auto decodeBegin = std::chrono::high_resolution_clock::now();
+            shared_ptr<TextureContainer> container = OpenTextureContainer(filename, false);
+            loader.AddTime(LoadStage::Decode, decodeBegin);
+            // the texels stream in over the next frames; meshes draw a placeholder until then
+            loader.Upload([handle, container] {
+                TextureStreamer::Get().Enqueue(TextureCache::Get().Name(handle), TextureStreamer::Texture2D, 0, container, [handle](size_t bytes) {
+                    TextureCache::Get().AddUploadedBytes(handle, bytes);
+                });
+            });
+        });
+    }
+}
+
+// Creates the meshes from their processed data; runs on the GL thread
+void Model::uploadMeshes(vector<MeshData>& meshData)
+{
+    for (MeshData& data : meshData)
+    {
+        // a baked mesh samples nothing and draws with the empty material
+        vector<Texture> textures;
+        if (data.colors.empty())
+            for (const TextureRef& texture : data.textures)
+                textures.push_back(loadTexture(texture.path, texture.type));
+
+        meshes.push_back(Mesh(std::move(data.vertices), std::move(data.indices), MaterialLibrary::Get().Create(textures),
+                              std::move(data.qtangents), std::move(data.bones), std::move(data.colors)));
+        meshes.back().boundsMin = data.boundsMin;
+        meshes.back().boundsMax = data.boundsMax;
+        meshes.back().boundsRadius = data.boundsRadius;
+    }
+    vertexColored = !meshes.empty() && std::all_of(meshes.begin(), meshes.end(), [](const Mesh& mesh) { return !mesh.colors.empty(); });
+}
+
+// Returns the texture for path, taking a reference in the TextureCache unless it is already in textures_loaded.
+// Its pixels arrive separately, from whichever decode task claimed it.
+Texture Model::loadTexture(const string& path, const string& typeName)
+{
+    auto found = textureIndex.find(path);
+    if (found != textureIndex.end())
+        return textures_loaded[found->second];
+
+    unsigned int handle = TextureCache::Get().Request(directory + '/' + path);
+    Texture texture;
+    texture.id = TextureCache::Get().Acquire(handle);
+    texture.type = typeName;
+    texture.path = path;
+    textureIndex[path] = textures_loaded.size();
+    textures_loaded.push_back(texture);
+    textureHandles.push_back(handle);
+    return texture;
+}
@@ -10,45 +10,178 @@
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
+#include <misc/asset_loader.h>
+#include <misc/frustum_culler.h>
+#include <misc/geometry_arena.h>
 #include <misc/mesh.h>
-#include <misc/shader.h>
+#include <misc/mesh_chunker.h>
+#include <misc/mesh_optimizer.h>
+#include <misc/model_cache.h>
+#include <misc/render_queue.h>
+#include <misc/shader_m.h>
+#include <misc/texture_cache.h>
+#include <misc/texture_streamer.h>
 
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
 
 using namespace std;
 
-// Declare the function instead of defining it
+// Declare the function instead of defining it; the caller owns one TextureCache reference to the result.
+// The image's .gktx container is used when it is up to date, and written when it is not
 unsigned int TextureFromFile(const char* path, const string& directory, bool gamma = false);
 
+// a material texture a mesh refers to, before it has a GL texture object
+struct TextureRef {
+    string type;
+    string path;
+};
+
+// CPU side of a mesh: built on a loader thread, turned into a Mesh on the GL thread
+struct MeshData {
+    vector<Vertex>       vertices;
+    vector<unsigned int> indices;
+    vector<glm::i16vec4> qtangents;
+    vector<VertexBones>  bones;
+    vector<glm::u8vec4>  colors;     // baked palette colours; the textures are then kept only to key the cache
+    vector<TextureRef>   textures;
+    glm::vec3 boundsMin = glm::vec3(0.0f);
+    glm::vec3 boundsMax = glm::vec3(0.0f);
+    float boundsRadius = 0.0f;
+};
+
 class Model
 {
 public:
     // model data 
-    vector<Texture> textures_loaded;	// stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
+    vector<Texture> textures_loaded;	// the textures this model uses, each holding one TextureCache reference
     vector<Mesh>    meshes;
     string directory;
     bool gammaCorrection;
+    MeshOptimizationReport optimizationReport;  // vertex cache statistics before and after OptimizeMesh
+    glm::vec3 boundsMin, boundsMax;             // object space bounds of all meshes
+    bool loadedFromCache;                       // true if Assimp was skipped because the model cache was current
 
-    // constructor, expects a filepath to a 3D model.
-    Model(string const& path, bool gamma = false);
+    // constructor, expects a filepath to a 3D model. With bakePalettes, a model whose meshes only look up
+    // flat colours in a small diffuse palette gets those colours as a vertex stream instead of the texture.
+    Model(string const& path, bool gamma = false, bool bakePalettes = false);
 
-    // draws the model, and thus all its meshes
+    // starts loading on the loader's worker threads; the model is complete once loader.Finish() has returned
+    // and must stay where it is until then.
+    Model(string const& path, AssetLoader& loader, bool gamma = false, bool bakePalettes = false);
+
+    // drops the model's references to its textures
+    ~Model();
+    Model(const Model&) = delete;
+    Model& operator=(const Model&) = delete;
+
+    // draws the model, and thus all its meshes, leaving out those the culler last found outside the frustum
     void Draw(Shader& shader);
 
+    // moves the static meshes into a shared arena, so they are drawn with one multi-draw per material;
+    // the arena can be shared between models and has to be built before the next Draw
+    void UseArena(GeometryArena& arena);
+
+    // registers the bounds of every mesh with the culler, placed with the given model matrix
+    void UseCuller(FrustumCuller& culler, const glm::mat4& transform = glm::mat4(1.0f));
+    // moves the registered bounds along with a model that is drawn with a changing model matrix
+    void SetCullTransform(const glm::mat4& transform);
+    // the culler's index for the first mesh; mesh i has GetFirstBound() + i
+    unsigned int GetFirstBound() const { return firstBound; }
+
+    // registers the model as a source of the queue; call once, before the first Submit
+    void UseQueue(RenderQueue& queue);
+    // queues each mesh the culler left visible as its own command, keyed by pass, program, material and
+    // distance from eye; the queue has the model draw them with shader and transform when it is flushed.
+    // A model can be submitted several times before a Flush, e.g. for other passes or as another instance
+    void Submit(unsigned int pass, Shader& shader, const glm::mat4& transform, const glm::vec3& eye);
+
+    // true if the palette was baked into every mesh, which then needs the VERTEX_COLORS shader variant
+    bool HasVertexColors() const { return vertexColored; }
+
+    // appends the object space triangles of every mesh, three positions each, e.g. to build a BVH over
+    void CollectTriangles(vector<glm::vec3>& positions) const;
+
 private:
-    // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
-    void loadModel(string const& path);
+    bool paletteBaking;
+    bool vertexColored;
+    GeometryArena* arena;
+    unsigned int arenaBatch;
+    FrustumCuller* culler;
+    unsigned int firstBound;  // the culler's index for the first mesh; the others follow in order
+    vector<bool> inArena;  // per mesh; the others keep their own VAO and are drawn one by one
+    RenderQueue* queue;
+    unsigned int queueSource;
+    // what one Submit draws with
+    struct QueuedState {
+        Shader* shader;
+        glm::mat4 transform;
+    };
+    // a queued command's item indexes queuedItems, which says which mesh to draw with which state
+    struct QueuedItem {
+        unsigned int mesh;
+        unsigned int state;
+    };
+    vector<QueuedState> queuedStates;
+    vector<QueuedItem> queuedItems;          // both emptied once every queued item has been drawn
+    size_t queuedItemsDrawn;
+    vector<unsigned int> queuedArenaMeshes;  // a run's packed meshes, reused from run to run
+    unordered_map<string, size_t> textureIndex;  // path as written in the material -> textures_loaded
+    vector<unsigned int> textureHandles;          // TextureCache handles, parallel to textures_loaded
+
+    struct ImportJob;
+
+    // loads a model with supported ASSIMP extensions from file; runs on a loader thread and queues the GL work.
+    void loadModel(string const& path, AssetLoader& loader);
+
+    // reads the meshes from a memory-mapped model cache; false if it is missing, stale or damaged.
+    bool loadFromCache(const string& cachePath, uint64_t sourceHash, vector<MeshData>& meshData, float& importMs);
+
+    // writes the processed meshes next to the source asset, so later runs can skip Assimp.
+    void saveToCache(const string& cachePath, uint64_t sourceHash, const vector<MeshData>& meshData, float importMs);
+
+    // called by the last mesh task of an import: chunks, reports, writes the cache and queues the upload.
+    void finishImport(ImportJob& job, AssetLoader& loader);
+
+    // replaces every large static mesh by its spatial chunks, which share its textures; returns the chunks made.
+    size_t splitLargeMeshes(vector<MeshData>& meshData);
+
+    // bakes the palette colour every mesh samples into its vertices, or leaves all meshes textured and says why.
+    bool bakePaletteColors(vector<MeshData>& meshData, string& rejection);
+
+    // hashes the palette images of the baked meshes, so an edited palette invalidates the model cache.
+    uint64_t hashPalettes(const vector<MeshData>& meshData) const;
+
+    // draws a run of queued meshes, nearest first, switching state where consecutive items came from different Submits.
+    void drawQueued(const RenderCommand* commands, size_t count);
+
+    // collects the meshes of a node and its children (if any), in the order they are drawn.
+    void collectMeshes(aiNode* node, const aiScene* scene, vector<aiMesh*>& sceneMeshes);
+
+    // processes an individual mesh and extracts the vertex data, indices, and texture references.
+    MeshData processMesh(aiMesh* mesh, const aiScene* scene, MeshOptimizationReport& report);
+
+    // gathers the bone influences of a skinned mesh into a compact per-vertex stream.
+    vector<VertexBones> extractBoneWeights(aiMesh* mesh);
+
+    // lists the textures of a material that the shaders sample.
+    vector<TextureRef> collectMaterialTextures(aiMaterial* material);
+
+    // lists all material textures of a given type.
+    vector<TextureRef> loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName);
 
-    // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-    void processNode(aiNode* node, const aiScene* scene);
+    // starts one decode task per distinct texture; the pixels are uploaded on the GL thread.
+    void decodeTextures(const vector<TextureRef>& textures, AssetLoader& loader);
 
-    // processes an individual mesh and extracts the vertex data, indices, and textures.
-    Mesh processMesh(aiMesh* mesh, const aiScene* scene);
+    // GL thread: creates the meshes from their processed data.
+    void uploadMeshes(vector<MeshData>& meshData);
 
-    // checks all material textures of a given type and loads the textures if they're not loaded yet.
-    vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName);
+    // GL thread: returns the texture for path, taking a TextureCache reference unless it is already in textures_loaded.
+    Texture loadTexture(const string& path, const string& typeName);
 };
 
 #endif
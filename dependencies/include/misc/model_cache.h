@@ -0,0 +1,126 @@
+#ifndef MODEL_CACHE_H
+#define MODEL_CACHE_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+// bump whenever processMesh, OptimizeMesh, SplitMesh or the layouts below change, so stale caches are rebuilt
+#define MODEL_CACHE_VERSION 4
+// the cache lives next to the source asset, e.g. Jet.obj -> Jet.obj.gkmc
+#define MODEL_CACHE_EXTENSION ".gkmc"
+
+// File layout, every block 4-byte aligned:
+//   ModelCacheHeader
+//   per mesh: ModelCacheMesh, its texture references (two lengths, then the type and path characters),
+//             Vertex[vertexCount], uint32 indices[indexCount], glm::i16vec4[qtangentCount], VertexBones[boneCount],
+//             glm::u8vec4 colors[colorCount]
+struct ModelCacheHeader {
+    char magic[4];          // "GKMC"
+    uint32_t version;       // MODEL_CACHE_VERSION
+    uint64_t sourceHash;    // FNV-1a of the source file
+    uint32_t importFlags;   // aiPostProcessSteps the data was imported with
+    uint32_t meshCount;
+    glm::vec3 boundsMin;    // of the whole model
+    glm::vec3 boundsMax;
+    float importMs;         // how long the Assimp import took, to report the difference on later runs
+    uint32_t bakePalettes;  // 1 if the model was imported with palette baking
+    uint64_t paletteHash;   // FNV-1a of the palette images that were baked into vertex colours, 0 if none were
+};
+
+struct ModelCacheMesh {
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t qtangentCount;
+    uint32_t boneCount;
+    uint32_t textureCount;
+    uint32_t colorCount;
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    float boundsRadius;
+};
+
+// read-only view of a whole file, mapped into memory
+class MappedFile
+{
+public:
+    MappedFile(const string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool IsOpen() const { return data != nullptr; }
+    const unsigned char* Data() const { return data; }
+    size_t Size() const { return size; }
+
+private:
+    const unsigned char* data;
+    size_t size;
+    void* file;
+    void* mapping;
+};
+
+uint64_t HashBytes(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull);
+
+// bounds-checked walk over a mapped cache; pointers returned by Take point straight into the mapping
+class ModelCacheReader
+{
+public:
+    ModelCacheReader(const unsigned char* data, size_t size) : data(data), size(size), offset(0), failed(false) {}
+
+    template <typename T>
+    const T* Take(size_t count = 1)
+    {
+        size_t bytes = count * sizeof(T);
+        if (failed || bytes > size - offset)
+        {
+            failed = true;
+            return nullptr;
+        }
+        const T* result = reinterpret_cast<const T*>(data + offset);
+        // the padding after the last block may be cut off; offset must never pass size, or size - offset wraps
+        offset = std::min(size, offset + ((bytes + 3) & ~(size_t)3));
+        return result;
+    }
+    string TakeString(size_t length)
+    {
+        const char* chars = Take<char>(length);
+        return chars ? string(chars, length) : string();
+    }
+    bool Failed() const { return failed; }
+    bool AtEnd() const { return offset >= size; }
+
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t offset;
+    bool failed;
+};
+
+// builds a cache file in memory, padding every block to 4 bytes
+class ModelCacheWriter
+{
+public:
+    template <typename T>
+    void Put(const T* values, size_t count = 1)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(values);
+        buffer.insert(buffer.end(), bytes, bytes + count * sizeof(T));
+        buffer.resize((buffer.size() + 3) & ~(size_t)3, 0);
+    }
+    void PutString(const string& value) { Put(value.data(), value.size()); }
+    // the header is written first and patched once the totals are known
+    ModelCacheHeader* Header() { return reinterpret_cast<ModelCacheHeader*>(buffer.data()); }
+
+    bool Save(const string& path) const;
+
+private:
+    vector<unsigned char> buffer;
+};
+
+#endif
@@ -0,0 +1,88 @@
+// render_queue.cpp
+#include "render_queue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static const int DEPTH_SHIFT = 0;
+static const int MATERIAL_SHIFT = DEPTH_SHIFT + RENDER_KEY_DEPTH_BITS;
+static const int PROGRAM_SHIFT = MATERIAL_SHIFT + RENDER_KEY_MATERIAL_BITS;
+static const int PASS_SHIFT = PROGRAM_SHIFT + RENDER_KEY_PROGRAM_BITS;
+// everything above the depth: commands that agree on it are drawn in one run
+static const uint64_t STATE_MASK = ~uint64_t(0) << MATERIAL_SHIFT;
+
+unsigned int RenderQueue::AddSource(DrawFunction draw)
+{
+    sources.push_back(std::move(draw));
+    return (unsigned int)(sources.size() - 1);
+}
+
+uint64_t RenderQueue::MakeKey(unsigned int pass, unsigned int program, unsigned int material, float depth)
+{
+    // a non-negative float orders like its bit pattern
+    uint32_t depthBits = 0;
+    if (depth > 0.0f)
+        std::memcpy(&depthBits, &depth, sizeof(depthBits));
+    return (uint64_t(pass & ((1u << RENDER_KEY_PASS_BITS) - 1)) << PASS_SHIFT)
+        | (uint64_t(program & ((1u << RENDER_KEY_PROGRAM_BITS) - 1)) << PROGRAM_SHIFT)
+        | (uint64_t(material & ((1u << RENDER_KEY_MATERIAL_BITS) - 1)) << MATERIAL_SHIFT)
+        | (uint64_t(depthBits) << DEPTH_SHIFT);
+}
+
+void RenderQueue::Submit(uint64_t key, unsigned int source, unsigned int item)
+{
+    RenderCommand command = { key, source, item };
+    commands.push_back(command);
+}
+
+void RenderQueue::Flush()
+{
+    auto begin = std::chrono::high_resolution_clock::now();
+    sort();
+    stats.commands = (unsigned int)commands.size();
+    stats.sortMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+
+    stats.runs = 0;
+    size_t first = 0;
+    while (first < commands.size())
+    {
+        size_t last = first + 1;
+        while (last < commands.size() && commands[last].source == commands[first].source
+               && (commands[last].key & STATE_MASK) == (commands[first].key & STATE_MASK))
+            last++;
+        sources[commands[first].source](&commands[first], last - first);
+        stats.runs++;
+        first = last;
+    }
+    commands.clear();
+}
+
+// LSD radix sort on the key, a byte per pass; it is stable, so equal keys keep their submission order
+void RenderQueue::sort()
+{
+    size_t count = commands.size();
+    if (count < 2)
+        return;
+    scratch.resize(count);
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        size_t histogram[256] = {};
+        for (const RenderCommand& command : commands)
+            histogram[(command.key >> shift) & 0xff]++;
+        // every key has the same byte here, nothing would move
+        if (histogram[(commands[0].key >> shift) & 0xff] == count)
+            continue;
+
+        size_t offset = 0;
+        for (size_t& bucket : histogram)
+        {
+            size_t size = bucket;
+            bucket = offset;
+            offset += size;
+        }
+        for (const RenderCommand& command : commands)
+            scratch[histogram[(command.key >> shift) & 0xff]++] = command;
+        commands.swap(scratch);
+    }
+}
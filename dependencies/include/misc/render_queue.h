@@ -0,0 +1,61 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+using namespace std;
+
+// sort key layout, most significant first: pass, program, material, depth
+#define RENDER_KEY_PASS_BITS 4
+#define RENDER_KEY_PROGRAM_BITS 12
+#define RENDER_KEY_MATERIAL_BITS 16
+#define RENDER_KEY_DEPTH_BITS 32
+
+// one draw: the packed sort key plus which source draws it and what the source calls the item
+struct RenderCommand {
+    uint64_t key;
+    unsigned int source;
+    unsigned int item;
+};
+
+// Collects a frame's draws as sort keys and draws them in key order. Passes come first, so late buckets such
+// as the sky and overlays only need a higher pass number; within a pass draws are grouped by program, then by
+// material, and within one program and material they go nearest first, which keeps early depth rejection
+// effective while the program and texture changes collapse. The commands are sorted with an LSD radix sort,
+// skipping the digits in which every key agrees. A source is whatever submitted the commands: it is called
+// once for every run of its commands that share pass, program and material, so it can batch the run.
+class RenderQueue
+{
+public:
+    // draws a run of the source's commands, nearest first
+    typedef function<void(const RenderCommand* commands, size_t count)> DrawFunction;
+
+    struct Stats {
+        unsigned int commands = 0;
+        unsigned int runs = 0;     // source calls made by the last Flush
+        float sortMs = 0.0f;
+    };
+
+    // registers a source; its id goes into the commands it submits
+    unsigned int AddSource(DrawFunction draw);
+
+    // packs a key; program and material are truncated to their bits, depth is a non-negative view distance
+    static uint64_t MakeKey(unsigned int pass, unsigned int program, unsigned int material, float depth);
+
+    void Submit(uint64_t key, unsigned int source, unsigned int item = 0);
+    // sorts and draws everything submitted since the last Flush, then empties the queue
+    void Flush();
+
+    const Stats& GetStats() const { return stats; }
+
+private:
+    vector<DrawFunction> sources;
+    vector<RenderCommand> commands;
+    vector<RenderCommand> scratch;
+    Stats stats;
+
+    void sort();
+};
+
+#endif
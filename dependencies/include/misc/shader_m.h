@@ -3,19 +3,213 @@
 
 #include <glad/glad.h>
 #include <glm/glm.hpp>
+#include <misc/gl_state.h>
 
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 
+// linked program binaries are kept here, one file per set of stage sources
+#define SHADER_CACHE_DIR "shader_cache"
+
 class Shader
 {
 public:
     unsigned int ID;
-    // constructor generates the shader on the fly
+    // constructor generates the shader on the fly; defines are inserted right after the #version line of every stage
+    // ------------------------------------------------------------------------
+    Shader(const char* vertexPath, const char* fragmentPath, const char* tessControlPath = nullptr, const char* tessEvalPath = nullptr,
+           const std::string &defines = "")
+    {
+        submit(vertexPath, fragmentPath, tessControlPath, tessEvalPath, defines);
+        finish();
+    }
+
+    // two-phase creation: Submit hands the sources to the driver and returns without asking for any
+    // status, finish() collects the result later. Submit every program first and do other loading work
+    // in between; with GL_KHR_parallel_shader_compile the driver compiles them on its own threads.
+    // ------------------------------------------------------------------------
+    static Shader Submit(const char* vertexPath, const char* fragmentPath, const char* tessControlPath = nullptr, const char* tessEvalPath = nullptr,
+                         const std::string &defines = "")
+    {
+        Shader shader;
+        shader.submit(vertexPath, fragmentPath, tessControlPath, tessEvalPath, defines);
+        return shader;
+    }
+
+    // true once compiling and linking have completed, so finish() will not block
+    // ------------------------------------------------------------------------
+    bool isReady() const
+    {
+        if (pendingStages.empty() || !GLAD_GL_KHR_parallel_shader_compile)
+            return true;
+        GLint done = GL_FALSE;
+        glGetProgramiv(ID, GL_COMPLETION_STATUS_KHR, &done);
+        return done == GL_TRUE;
+    }
+
+    // waits for a submitted program, reports compile and link errors and caches its uniforms;
+    // the program must not be used before this has been called
+    // ------------------------------------------------------------------------
+    void finish()
+    {
+        if (pendingStages.empty())
+            return;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (const auto& stage : pendingStages)
+            checkCompileErrors(stage.first, stage.second);
+        checkCompileErrors(ID, "PROGRAM");
+        cacheUniformLocations();
+        for (const auto& stage : pendingStages)
+            glDeleteShader(stage.first);
+        pendingStages.clear();
+
+        // time the CPU actually spent waiting on the compiler, not the loading done in between
+        submitMs += std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        saveProgramBinary(cachePath, submitMs);
+    }
+
+    // activate the shader
+    // ------------------------------------------------------------------------
+    void use() const
+    { 
+        GLState::UseProgram(ID);
+    }
+    // utility uniform functions
+    // the location of every active uniform is cached at link time and the last uploaded value is shadowed,
+    // so setting a uniform by name costs a hash lookup and the GL call is skipped when nothing changed.
+    // ------------------------------------------------------------------------
+    void setBool(const std::string &name, bool value) const
+    {         
+        setInt(name, (int)value);
+    }
+    // ------------------------------------------------------------------------
+    void setInt(const std::string &name, int value) const
+    { 
+        GLint location = changedUniformLocation(name, &value, sizeof(value));
+        if (location >= 0)
+            glUniform1i(location, value);
+    }
+    // ------------------------------------------------------------------------
+    void setFloat(const std::string &name, float value) const
+    { 
+        GLint location = changedUniformLocation(name, &value, sizeof(value));
+        if (location >= 0)
+            glUniform1f(location, value);
+    }
+    // ------------------------------------------------------------------------
+    void setVec2(const std::string &name, const glm::vec2 &value) const
+    { 
+        GLint location = changedUniformLocation(name, &value[0], sizeof(value));
+        if (location >= 0)
+            glUniform2fv(location, 1, &value[0]);
+    }
+    void setVec2(const std::string &name, float x, float y) const
+    { 
+        setVec2(name, glm::vec2(x, y));
+    }
+    // ------------------------------------------------------------------------
+    void setVec3(const std::string &name, const glm::vec3 &value) const
+    { 
+        GLint location = changedUniformLocation(name, &value[0], sizeof(value));
+        if (location >= 0)
+            glUniform3fv(location, 1, &value[0]);
+    }
+    void setVec3(const std::string &name, float x, float y, float z) const
+    { 
+        setVec3(name, glm::vec3(x, y, z));
+    }
+    // ------------------------------------------------------------------------
+    void setVec4(const std::string &name, const glm::vec4 &value) const
+    { 
+        GLint location = changedUniformLocation(name, &value[0], sizeof(value));
+        if (location >= 0)
+            glUniform4fv(location, 1, &value[0]);
+    }
+    void setVec4(const std::string &name, float x, float y, float z, float w) const
+    { 
+        setVec4(name, glm::vec4(x, y, z, w));
+    }
+    // ------------------------------------------------------------------------
+    void setMat2(const std::string &name, const glm::mat2 &mat) const
+    {
+        GLint location = changedUniformLocation(name, &mat[0][0], sizeof(mat));
+        if (location >= 0)
+            glUniformMatrix2fv(location, 1, GL_FALSE, &mat[0][0]);
+    }
+    // ------------------------------------------------------------------------
+    void setMat3(const std::string &name, const glm::mat3 &mat) const
+    {
+        GLint location = changedUniformLocation(name, &mat[0][0], sizeof(mat));
+        if (location >= 0)
+            glUniformMatrix3fv(location, 1, GL_FALSE, &mat[0][0]);
+    }
+    // ------------------------------------------------------------------------
+    void setMat4(const std::string &name, const glm::mat4 &mat) const
+    {
+        GLint location = changedUniformLocation(name, &mat[0][0], sizeof(mat));
+        if (location >= 0)
+            glUniformMatrix4fv(location, 1, GL_FALSE, &mat[0][0]);
+    }
+
+    // connects a uniform block to a buffer binding point; blocks the program does not use are ignored
+    // ------------------------------------------------------------------------
+    void bindUniformBlock(const std::string &name, unsigned int binding) const
+    {
+        GLuint index = glGetUniformBlockIndex(ID, name.c_str());
+        if (index != GL_INVALID_INDEX)
+            glUniformBlockBinding(ID, index, binding);
+    }
+
+    // uniform traffic counters shared by all programs; reset by the caller once per frame
+    // ------------------------------------------------------------------------
+    struct UniformStats
+    {
+        unsigned int lookups = 0;         // glGetUniformLocation calls
+        unsigned int uploads = 0;         // glUniform* calls issued
+        unsigned int uploadsSkipped = 0;  // setter calls dropped because the value was unchanged
+    };
+    static UniformStats& Stats()
+    {
+        static UniformStats stats;
+        return stats;
+    }
+
+    // program binary cache counters, accumulated over the lifetime of the process
+    // ------------------------------------------------------------------------
+    struct ProgramCacheStats
+    {
+        unsigned int hits = 0;    // programs restored with glProgramBinary
+        unsigned int misses = 0;  // programs compiled from source
+        float msSaved = 0.0f;     // recorded compile time minus binary load time, summed over hits
+    };
+    static ProgramCacheStats& ProgramCache()
+    {
+        static ProgramCacheStats stats;
+        return stats;
+    }
+
+private:
+    // stages still attached to a submitted program, with the type used for error messages
+    std::vector<std::pair<unsigned int, std::string>> pendingStages;
+    std::string cachePath;
+    float submitMs = 0.0f;
+
+    Shader() : ID(0) {}
+
+    // reads the stage sources and starts compiling and linking them
     // ------------------------------------------------------------------------
-    Shader(const char* vertexPath, const char* fragmentPath, const char* tessControlPath = nullptr, const char* tessEvalPath = nullptr)
+    void submit(const char* vertexPath, const char* fragmentPath, const char* tessControlPath, const char* tessEvalPath,
+                const std::string &defines)
     {
         // 1. Retrieve the shader source codes from file paths
         std::string vertexCode;
@@ -42,8 +236,8 @@ public:
             fShaderStream << fShaderFile.rdbuf();
             vShaderFile.close();
             fShaderFile.close();
-            vertexCode = vShaderStream.str();
-            fragmentCode = fShaderStream.str();
+            vertexCode = injectDefines(vShaderStream.str(), defines);
+            fragmentCode = injectDefines(fShaderStream.str(), defines);
 
             if (tessControlPath)
             {
@@ -51,7 +245,7 @@ public:
                 std::stringstream tcShaderStream;
                 tcShaderStream << tcShaderFile.rdbuf();
                 tcShaderFile.close();
-                tessControlCode = tcShaderStream.str();
+                tessControlCode = injectDefines(tcShaderStream.str(), defines);
             }
 
             if (tessEvalPath)
@@ -60,7 +254,7 @@ public:
                 std::stringstream teShaderStream;
                 teShaderStream << teShaderFile.rdbuf();
                 teShaderFile.close();
-                tessEvalCode = teShaderStream.str();
+                tessEvalCode = injectDefines(teShaderStream.str(), defines);
             }
         }
         catch (std::ifstream::failure& e)
@@ -68,6 +262,23 @@ public:
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
         }
 
+        // 2. Reuse a previously linked binary for exactly these sources if the driver accepts it
+        auto start = std::chrono::high_resolution_clock::now();
+        cachePath = programCachePath(vertexCode + fragmentCode + tessControlCode + tessEvalCode);
+        float storedCompileMs = 0.0f;
+        if (loadProgramBinary(cachePath, storedCompileMs))
+        {
+            float loadMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            ProgramCache().hits++;
+            if (storedCompileMs > loadMs)
+                ProgramCache().msSaved += storedCompileMs - loadMs;
+            cacheUniformLocations();
+            return;
+        }
+        ProgramCache().misses++;
+
+        // 3. Compile and link from source; errors are collected in finish()
+        enableParallelCompile();
         const char* vShaderCode = vertexCode.c_str();
         const char* fShaderCode = fragmentCode.c_str();
         const char* tcShaderCode = tessControlPath ? tessControlCode.c_str() : nullptr;
@@ -78,26 +289,26 @@ public:
         vertex = glCreateShader(GL_VERTEX_SHADER);
         glShaderSource(vertex, 1, &vShaderCode, NULL);
         glCompileShader(vertex);
-        checkCompileErrors(vertex, "VERTEX");
+        pendingStages.push_back(std::make_pair(vertex, "VERTEX"));
 
         fragment = glCreateShader(GL_FRAGMENT_SHADER);
         glShaderSource(fragment, 1, &fShaderCode, NULL);
         glCompileShader(fragment);
-        checkCompileErrors(fragment, "FRAGMENT");
+        pendingStages.push_back(std::make_pair(fragment, "FRAGMENT"));
 
         if (tessControlPath)
         {
             tessControl = glCreateShader(GL_TESS_CONTROL_SHADER);
             glShaderSource(tessControl, 1, &tcShaderCode, NULL);
             glCompileShader(tessControl);
-            checkCompileErrors(tessControl, "TESS_CONTROL");
+            pendingStages.push_back(std::make_pair(tessControl, "TESS_CONTROL"));
         }
         if (tessEvalPath)
         {
             tessEval = glCreateShader(GL_TESS_EVALUATION_SHADER);
             glShaderSource(tessEval, 1, &teShaderCode, NULL);
             glCompileShader(tessEval);
-            checkCompileErrors(tessEval, "TESS_EVALUATION");
+            pendingStages.push_back(std::make_pair(tessEval, "TESS_EVALUATION"));
         }
 
         ID = glCreateProgram();
@@ -105,81 +316,208 @@ public:
         glAttachShader(ID, fragment);
         if (tessControlPath) glAttachShader(ID, tessControl);
         if (tessEvalPath) glAttachShader(ID, tessEval);
+        if (programBinarySupported())
+            glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
 
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
-        if (tessControlPath) glDeleteShader(tessControl);
-        if (tessEvalPath) glDeleteShader(tessEval);
+        submitMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
     }
 
-    // activate the shader
-    // ------------------------------------------------------------------------
-    void use() const
-    { 
-        glUseProgram(ID); 
-    }
-    // utility uniform functions
-    // ------------------------------------------------------------------------
-    void setBool(const std::string &name, bool value) const
-    {         
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value); 
-    }
     // ------------------------------------------------------------------------
-    void setInt(const std::string &name, int value) const
-    { 
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value); 
-    }
-    // ------------------------------------------------------------------------
-    void setFloat(const std::string &name, float value) const
-    { 
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value); 
+    static std::string injectDefines(const std::string &code, const std::string &defines)
+    {
+        if (defines.empty())
+            return code;
+        size_t lineEnd = code.find('\n');
+        if (code.compare(0, 8, "#version") != 0 || lineEnd == std::string::npos)
+            return defines + code;
+        return code.substr(0, lineEnd + 1) + defines + code.substr(lineEnd + 1);
     }
+
+    // lets the driver use as many compiler threads as it likes; asked once per process
     // ------------------------------------------------------------------------
-    void setVec2(const std::string &name, const glm::vec2 &value) const
-    { 
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); 
-    }
-    void setVec2(const std::string &name, float x, float y) const
-    { 
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y); 
+    static void enableParallelCompile()
+    {
+        static bool enabled = false;
+        if (enabled || !GLAD_GL_KHR_parallel_shader_compile)
+            return;
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        enabled = true;
     }
+
+    // a cached uniform location and a shadow copy of the value last uploaded to it
+    struct UniformSlot
+    {
+        GLint location = -1;
+        bool hasValue = false;
+        unsigned char value[sizeof(glm::mat4)];
+    };
+    mutable std::unordered_map<std::string, UniformSlot> uniforms;
+
+    // enumerates the active default-block uniforms once after linking so setters never ask the driver
     // ------------------------------------------------------------------------
-    void setVec3(const std::string &name, const glm::vec3 &value) const
-    { 
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); 
-    }
-    void setVec3(const std::string &name, float x, float y, float z) const
-    { 
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z); 
+    void cacheUniformLocations()
+    {
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::vector<GLchar> nameBuffer(maxLength > 0 ? maxLength : 1);
+        for (GLint i = 0; i < count; i++)
+        {
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type = 0;
+            glGetActiveUniform(ID, (GLuint)i, maxLength, &length, &size, &type, nameBuffer.data());
+            std::string name(nameBuffer.data(), length);
+
+            // arrays are reported as "name[0]"; register every element under its own name
+            std::string baseName = name;
+            if (size > 1 && baseName.size() > 3 && baseName.compare(baseName.size() - 3, 3, "[0]") == 0)
+                baseName.erase(baseName.size() - 3);
+            for (GLint element = 0; element < size; element++)
+            {
+                std::string elementName = size > 1 ? baseName + "[" + std::to_string(element) + "]" : name;
+                Stats().lookups++;
+                GLint location = glGetUniformLocation(ID, elementName.c_str());
+                if (location < 0)
+                    continue; // members of uniform blocks have no location
+                uniforms[elementName].location = location;
+            }
+        }
     }
+
+    // resolves a uniform by name and records the new value; returns its location if it has to be uploaded, -1 otherwise
     // ------------------------------------------------------------------------
-    void setVec4(const std::string &name, const glm::vec4 &value) const
-    { 
-        glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); 
+    GLint changedUniformLocation(const std::string &name, const void* value, size_t size) const
+    {
+        auto it = uniforms.find(name);
+        if (it == uniforms.end())
+        {
+            // not active in this program: remember that, so the driver is asked only once
+            Stats().lookups++;
+            UniformSlot slot;
+            slot.location = glGetUniformLocation(ID, name.c_str());
+            it = uniforms.emplace(name, slot).first;
+        }
+        UniformSlot& slot = it->second;
+        if (slot.location < 0)
+            return -1;
+        if (slot.hasValue && std::memcmp(slot.value, value, size) == 0)
+        {
+            Stats().uploadsSkipped++;
+            return -1;
+        }
+        std::memcpy(slot.value, value, size);
+        slot.hasValue = true;
+        Stats().uploads++;
+        return slot.location;
     }
-    void setVec4(const std::string &name, float x, float y, float z, float w) const
-    { 
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w); 
+
+    // header written in front of every cached binary
+    struct ProgramBinaryHeader
+    {
+        char magic[4];
+        unsigned int version;
+        GLenum format;
+        GLint length;
+        float compileMs;
+    };
+    static const unsigned int PROGRAM_BINARY_VERSION = 1;
+
+    static bool programBinarySupported()
+    {
+        if (!GLAD_GL_ARB_get_program_binary)
+            return false;
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        return formats > 0;
     }
+
+    // the file name is an FNV-1a hash of the sources and the driver identity, so editing a shader
+    // or updating the driver simply produces a different file
     // ------------------------------------------------------------------------
-    void setMat2(const std::string &name, const glm::mat2 &mat) const
+    static std::string programCachePath(const std::string &sources)
     {
-        glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        std::string key = sources;
+        const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+        for (GLenum name : driverStrings)
+        {
+            const GLubyte* value = glGetString(name);
+            if (value)
+                key += (const char*)value;
+        }
+        std::uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : key)
+        {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        char fileName[32];
+        std::snprintf(fileName, sizeof(fileName), "%016llx.bin", (unsigned long long)hash);
+        return std::string(SHADER_CACHE_DIR) + "/" + fileName;
     }
+
+    // creates the program from a cached binary; returns false (leaving no program behind) on any mismatch
     // ------------------------------------------------------------------------
-    void setMat3(const std::string &name, const glm::mat3 &mat) const
+    bool loadProgramBinary(const std::string &path, float &compileMs)
     {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        if (!programBinarySupported())
+            return false;
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+        ProgramBinaryHeader header;
+        if (!file.read((char*)&header, sizeof(header)) || std::memcmp(header.magic, "GKPB", 4) != 0
+            || header.version != PROGRAM_BINARY_VERSION || header.length <= 0)
+            return false;
+        std::vector<char> binary(header.length);
+        if (!file.read(binary.data(), header.length))
+            return false;
+
+        ID = glCreateProgram();
+        glProgramBinary(ID, header.format, binary.data(), header.length);
+        GLint success = 0;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            // the driver rejected the format or the blob; it is overwritten after recompiling
+            std::cout << "Shader cache: stale binary " << path << ", recompiling" << std::endl;
+            glDeleteProgram(ID);
+            ID = 0;
+            return false;
+        }
+        compileMs = header.compileMs;
+        return true;
     }
+
     // ------------------------------------------------------------------------
-    void setMat4(const std::string &name, const glm::mat4 &mat) const
+    void saveProgramBinary(const std::string &path, float compileMs) const
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        if (!programBinarySupported())
+            return;
+        GLint success = 0, length = 0;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (!success || length <= 0)
+            return;
+        ProgramBinaryHeader header = { { 'G', 'K', 'P', 'B' }, PROGRAM_BINARY_VERSION, 0, 0, compileMs };
+        std::vector<char> binary(length);
+        glGetProgramBinary(ID, length, &header.length, &header.format, binary.data());
+        if (header.length <= 0)
+            return;
+
+        std::error_code error;
+        std::filesystem::create_directories(SHADER_CACHE_DIR, error);
+        std::ofstream file(path, std::ios::binary);
+        if (!file)
+        {
+            std::cout << "Shader cache: cannot write " << path << std::endl;
+            return;
+        }
+        file.write((const char*)&header, sizeof(header));
+        file.write(binary.data(), header.length);
     }
 
-private:
     // utility function for checking shader compilation/linking errors.
     // ------------------------------------------------------------------------
     void checkCompileErrors(GLuint shader, std::string type)
@@ -0,0 +1,362 @@
+// software_occlusion.cpp
+#include "software_occlusion.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOFTWARE_OCCLUSION_SSE2 1
+#endif
+
+static const int TILES_X = OCCLUSION_BUFFER_WIDTH / OCCLUSION_TILE_SIZE;
+static const int TILES_Y = OCCLUSION_BUFFER_HEIGHT / OCCLUSION_TILE_SIZE;
+static const int SUBTILES_X = OCCLUSION_BUFFER_WIDTH / OCCLUSION_SUBTILE_WIDTH;
+static const int SUBTILES_Y = OCCLUSION_BUFFER_HEIGHT / OCCLUSION_SUBTILE_HEIGHT;
+static const uint32_t FULL_MASK = 0xffffffffu;
+static const float INF = std::numeric_limits<float>::infinity();
+
+SoftwareOcclusion::SoftwareOcclusion(unsigned int threadCount)
+    : pool(threadCount), viewProjection(1.0f),
+      layerDepth(SUBTILES_X * SUBTILES_Y, 0.0f), workingDepth(SUBTILES_X * SUBTILES_Y, INF),
+      workingMask(SUBTILES_X * SUBTILES_Y, 0), tileDepth(TILES_X * TILES_Y, 0.0f)
+{
+    bins.resize(pool.GetThreadCount());
+    for (Bins& set : bins)
+        set.tiles.resize(TILES_X * TILES_Y);
+}
+
+vector<glm::vec3> SoftwareOcclusion::SelectOccluders(const vector<glm::vec3>& positions, size_t maxTriangles)
+{
+    size_t triangleCount = positions.size() / 3;
+    vector<float> area(triangleCount);
+    vector<unsigned int> order(triangleCount);
+    for (size_t t = 0; t < triangleCount; t++)
+    {
+        area[t] = glm::length(glm::cross(positions[t * 3 + 1] - positions[t * 3], positions[t * 3 + 2] - positions[t * 3]));
+        order[t] = (unsigned int)t;
+    }
+    if (triangleCount > maxTriangles)
+    {
+        std::nth_element(order.begin(), order.begin() + maxTriangles, order.end(),
+                         [&area](unsigned int a, unsigned int b) { return area[a] > area[b]; });
+        order.resize(maxTriangles);
+        std::sort(order.begin(), order.end());
+    }
+
+    vector<glm::vec3> selected;
+    selected.reserve(order.size() * 3);
+    for (unsigned int t : order)
+    {
+        if (area[t] <= 0.0f)
+            continue;
+        selected.push_back(positions[t * 3]);
+        selected.push_back(positions[t * 3 + 1]);
+        selected.push_back(positions[t * 3 + 2]);
+    }
+    return selected;
+}
+
+void SoftwareOcclusion::SetOccluders(const vector<glm::vec3>& positions)
+{
+    occluders = positions;
+}
+
+void SoftwareOcclusion::Render(const glm::mat4& viewProjection)
+{
+    auto begin = std::chrono::high_resolution_clock::now();
+    this->viewProjection = viewProjection;
+    std::fill(layerDepth.begin(), layerDepth.end(), 0.0f);
+    std::fill(workingDepth.begin(), workingDepth.end(), INF);
+    std::fill(workingMask.begin(), workingMask.end(), 0u);
+
+    // set-up and binning: every worker takes an equal share of the occluders
+    size_t triangleCount = occluders.size() / 3;
+    size_t share = (triangleCount + bins.size() - 1) / bins.size();
+    vector<future<void>> pending;
+    for (size_t i = 0; i < bins.size(); i++)
+    {
+        Bins* set = &bins[i];
+        size_t first = std::min(triangleCount, i * share);
+        size_t last = std::min(triangleCount, first + share);
+        pending.push_back(pool.Submit([this, set, first, last] { setupTriangles(*set, first, last); }));
+    }
+    for (future<void>& result : pending)
+        result.get();
+    pending.clear();
+
+    // raster: tiles are handed out round robin, so workers get a mix of busy and empty ones
+    unsigned int workers = (unsigned int)bins.size();
+    for (unsigned int worker = 0; worker < workers; worker++)
+    {
+        pending.push_back(pool.Submit([this, worker, workers] {
+            for (unsigned int tile = worker; tile < (unsigned int)(TILES_X * TILES_Y); tile += workers)
+                rasterizeTile(tile);
+        }));
+    }
+    for (future<void>& result : pending)
+        result.get();
+
+    stats = Stats();
+    for (const Bins& set : bins)
+        stats.occluders += (unsigned int)set.triangles.size();
+    stats.rasterMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+}
+
+void SoftwareOcclusion::setupTriangles(Bins& set, size_t first, size_t last) const
+{
+    set.triangles.clear();
+    for (vector<unsigned int>& tile : set.tiles)
+        tile.clear();
+
+    for (size_t t = first; t < last; t++)
+    {
+        glm::vec2 screen[3];
+        float depth[3];
+        bool inFront = true;
+        for (int corner = 0; corner < 3; corner++)
+        {
+            glm::vec4 clip = viewProjection * glm::vec4(occluders[t * 3 + corner], 1.0f);
+            // the GPU clips away whatever is in front of the near plane, so such a triangle hides nothing there;
+            // rather than clipping it, it is left out
+            if (clip.w <= 0.0f || clip.z < -clip.w)
+            {
+                inFront = false;
+                break;
+            }
+            float inverseW = 1.0f / clip.w;
+            screen[corner] = glm::vec2((clip.x * inverseW * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH,
+                                       (clip.y * inverseW * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT);
+            depth[corner] = inverseW;
+        }
+        if (!inFront)
+            continue;
+
+        // both sides of an occluder hide what is behind them; wind every triangle the same way
+        float area = (screen[1].x - screen[0].x) * (screen[2].y - screen[0].y) - (screen[2].x - screen[0].x) * (screen[1].y - screen[0].y);
+        if (std::fabs(area) < 1e-6f)
+            continue;
+        if (area < 0.0f)
+        {
+            std::swap(screen[1], screen[2]);
+            std::swap(depth[1], depth[2]);
+            area = -area;
+        }
+
+        // pixel centres are at +0.5
+        glm::vec2 lo = glm::min(screen[0], glm::min(screen[1], screen[2]));
+        glm::vec2 hi = glm::max(screen[0], glm::max(screen[1], screen[2]));
+        Triangle triangle;
+        triangle.minX = std::max(0, (int)std::ceil(lo.x - 0.5f));
+        triangle.minY = std::max(0, (int)std::ceil(lo.y - 0.5f));
+        triangle.maxX = std::min(OCCLUSION_BUFFER_WIDTH - 1, (int)std::floor(hi.x - 0.5f));
+        triangle.maxY = std::min(OCCLUSION_BUFFER_HEIGHT - 1, (int)std::floor(hi.y - 0.5f));
+        if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+            continue;
+
+        // edge i runs from vertex i to the next one and is positive on its inner side; it is also the
+        // barycentric weight of the vertex opposite, scaled by area
+        float weightA[3], weightB[3], weightC[3];
+        for (int edge = 0; edge < 3; edge++)
+        {
+            const glm::vec2& from = screen[edge];
+            const glm::vec2& to = screen[(edge + 1) % 3];
+            triangle.edgeA[edge] = from.y - to.y;
+            triangle.edgeB[edge] = to.x - from.x;
+            triangle.edgeC[edge] = -(triangle.edgeA[edge] * from.x + triangle.edgeB[edge] * from.y);
+            int opposite = (edge + 2) % 3;
+            weightA[opposite] = triangle.edgeA[edge];
+            weightB[opposite] = triangle.edgeB[edge];
+            weightC[opposite] = triangle.edgeC[edge];
+        }
+        float inverseArea = 1.0f / area;
+        triangle.depthA = (depth[0] * weightA[0] + depth[1] * weightA[1] + depth[2] * weightA[2]) * inverseArea;
+        triangle.depthB = (depth[0] * weightB[0] + depth[1] * weightB[1] + depth[2] * weightB[2]) * inverseArea;
+        triangle.depthC = (depth[0] * weightC[0] + depth[1] * weightC[1] + depth[2] * weightC[2]) * inverseArea;
+        triangle.depthMin = std::min(depth[0], std::min(depth[1], depth[2]));
+
+        unsigned int index = (unsigned int)set.triangles.size();
+        set.triangles.push_back(triangle);
+        for (int tileY = triangle.minY / OCCLUSION_TILE_SIZE; tileY <= triangle.maxY / OCCLUSION_TILE_SIZE; tileY++)
+            for (int tileX = triangle.minX / OCCLUSION_TILE_SIZE; tileX <= triangle.maxX / OCCLUSION_TILE_SIZE; tileX++)
+                set.tiles[tileY * TILES_X + tileX].push_back(index);
+    }
+}
+
+void SoftwareOcclusion::rasterizeTile(unsigned int tile)
+{
+    const int subtilesPerTileX = OCCLUSION_TILE_SIZE / OCCLUSION_SUBTILE_WIDTH;
+    const int subtilesPerTileY = OCCLUSION_TILE_SIZE / OCCLUSION_SUBTILE_HEIGHT;
+    int tileX = (int)tile % TILES_X, tileY = (int)tile / TILES_X;
+    int tileSubtileX = tileX * subtilesPerTileX, tileSubtileY = tileY * subtilesPerTileY;
+
+    // the workers' bins in order, so the result does not depend on timing
+    for (const Bins& set : bins)
+    {
+        for (unsigned int index : set.tiles[tile])
+        {
+            const Triangle& triangle = set.triangles[index];
+            int x0 = std::max(tileSubtileX, triangle.minX / OCCLUSION_SUBTILE_WIDTH);
+            int y0 = std::max(tileSubtileY, triangle.minY / OCCLUSION_SUBTILE_HEIGHT);
+            int x1 = std::min(tileSubtileX + subtilesPerTileX - 1, triangle.maxX / OCCLUSION_SUBTILE_WIDTH);
+            int y1 = std::min(tileSubtileY + subtilesPerTileY - 1, triangle.maxY / OCCLUSION_SUBTILE_HEIGHT);
+            rasterizeTriangle(triangle, x0, y0, x1, y1);
+        }
+    }
+
+    float farthest = INF;
+    for (int y = tileSubtileY; y < tileSubtileY + subtilesPerTileY; y++)
+        for (int x = tileSubtileX; x < tileSubtileX + subtilesPerTileX; x++)
+            farthest = std::min(farthest, layerDepth[y * SUBTILES_X + x]);
+    tileDepth[tile] = farthest;
+}
+
+void SoftwareOcclusion::rasterizeTriangle(const Triangle& triangle, int subtileX0, int subtileY0, int subtileX1, int subtileY1)
+{
+#if SOFTWARE_OCCLUSION_SSE2
+    const __m128 left = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 right = _mm_setr_ps(4.5f, 5.5f, 6.5f, 7.5f);
+    __m128 stepLeft[3], stepRight[3];
+    for (int edge = 0; edge < 3; edge++)
+    {
+        stepLeft[edge] = _mm_mul_ps(_mm_set1_ps(triangle.edgeA[edge]), left);
+        stepRight[edge] = _mm_mul_ps(_mm_set1_ps(triangle.edgeA[edge]), right);
+    }
+#endif
+
+    for (int subtileY = subtileY0; subtileY <= subtileY1; subtileY++)
+    {
+        for (int subtileX = subtileX0; subtileX <= subtileX1; subtileX++)
+        {
+            float x = (float)(subtileX * OCCLUSION_SUBTILE_WIDTH), y = (float)(subtileY * OCCLUSION_SUBTILE_HEIGHT);
+
+            // one bit per pixel, row after row; a centre exactly on an edge belongs to the triangle
+            uint32_t coverage = 0;
+            for (int row = 0; row < OCCLUSION_SUBTILE_HEIGHT; row++)
+            {
+                float rowY = y + row + 0.5f;
+#if SOFTWARE_OCCLUSION_SSE2
+                __m128 insideLeft = _mm_castsi128_ps(_mm_set1_epi32(-1)), insideRight = insideLeft;
+                for (int edge = 0; edge < 3; edge++)
+                {
+                    __m128 start = _mm_set1_ps(triangle.edgeA[edge] * x + triangle.edgeB[edge] * rowY + triangle.edgeC[edge]);
+                    insideLeft = _mm_and_ps(insideLeft, _mm_cmpge_ps(_mm_add_ps(start, stepLeft[edge]), _mm_setzero_ps()));
+                    insideRight = _mm_and_ps(insideRight, _mm_cmpge_ps(_mm_add_ps(start, stepRight[edge]), _mm_setzero_ps()));
+                }
+                uint32_t bits = (uint32_t)_mm_movemask_ps(insideLeft) | ((uint32_t)_mm_movemask_ps(insideRight) << 4);
+#else
+                uint32_t bits = 0;
+                for (int column = 0; column < OCCLUSION_SUBTILE_WIDTH; column++)
+                {
+                    float columnX = x + column + 0.5f;
+                    bool inside = true;
+                    for (int edge = 0; edge < 3; edge++)
+                        inside = inside && triangle.edgeA[edge] * columnX + triangle.edgeB[edge] * rowY + triangle.edgeC[edge] >= 0.0f;
+                    bits |= (inside ? 1u : 0u) << column;
+                }
+#endif
+                coverage |= bits << (row * OCCLUSION_SUBTILE_WIDTH);
+            }
+            if (coverage == 0)
+                continue;
+
+            // farthest the triangle gets within the subtile: the depth plane at its far corner, but never
+            // beyond the triangle's own farthest vertex
+            float cornerDepth = triangle.depthC
+                + std::min(triangle.depthA * x, triangle.depthA * (x + OCCLUSION_SUBTILE_WIDTH))
+                + std::min(triangle.depthB * y, triangle.depthB * (y + OCCLUSION_SUBTILE_HEIGHT));
+            float depth = std::max(cornerDepth, triangle.depthMin);
+
+            int subtile = subtileY * SUBTILES_X + subtileX;
+            float& layer = layerDepth[subtile];
+            float& working = workingDepth[subtile];
+            uint32_t& mask = workingMask[subtile];
+            if (depth <= layer)
+                continue;
+            // a triangle much nearer than the working layer starts a new one instead of dragging it back
+            // (the distance heuristic of the paper); a full coverage needs no merging either
+            if (coverage == FULL_MASK || 2.0f * working - depth - layer < 0.0f)
+            {
+                mask = coverage;
+                working = depth;
+            }
+            else
+            {
+                mask |= coverage;
+                working = std::min(working, depth);
+            }
+            if (mask == FULL_MASK)
+            {
+                layer = working;
+                working = INF;
+                mask = 0;
+            }
+        }
+    }
+}
+
+bool SoftwareOcclusion::IsOccluded(const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    auto begin = std::chrono::high_resolution_clock::now();
+    stats.tested++;
+    bool occluded = true;
+
+    // screen rectangle and nearest depth of the box; a box reaching past the near plane is never hidden
+    glm::vec2 lo(INF), hi(-INF);
+    float nearest = 0.0f;
+    for (int corner = 0; corner < 8 && occluded; corner++)
+    {
+        glm::vec3 position((corner & 1) ? boundsMax.x : boundsMin.x, (corner & 2) ? boundsMax.y : boundsMin.y,
+                           (corner & 4) ? boundsMax.z : boundsMin.z);
+        glm::vec4 clip = viewProjection * glm::vec4(position, 1.0f);
+        if (clip.w <= 0.0f || clip.z < -clip.w)
+        {
+            occluded = false;
+            break;
+        }
+        float inverseW = 1.0f / clip.w;
+        glm::vec2 screen((clip.x * inverseW * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH,
+                         (clip.y * inverseW * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT);
+        lo = glm::min(lo, screen);
+        hi = glm::max(hi, screen);
+        nearest = std::max(nearest, inverseW);
+    }
+
+    if (occluded)
+    {
+        // every pixel the rectangle touches; one off screen is for the frustum culler to decide
+        lo = glm::clamp(lo, glm::vec2(-1.0f), glm::vec2(OCCLUSION_BUFFER_WIDTH + 1, OCCLUSION_BUFFER_HEIGHT + 1));
+        hi = glm::clamp(hi, glm::vec2(-1.0f), glm::vec2(OCCLUSION_BUFFER_WIDTH + 1, OCCLUSION_BUFFER_HEIGHT + 1));
+        int minX = std::max(0, (int)std::floor(lo.x)), minY = std::max(0, (int)std::floor(lo.y));
+        int maxX = std::min(OCCLUSION_BUFFER_WIDTH - 1, (int)std::ceil(hi.x) - 1);
+        int maxY = std::min(OCCLUSION_BUFFER_HEIGHT - 1, (int)std::ceil(hi.y) - 1);
+        occluded = minX <= maxX && minY <= maxY;
+
+        int subtileX0 = minX / OCCLUSION_SUBTILE_WIDTH, subtileX1 = maxX / OCCLUSION_SUBTILE_WIDTH;
+        int subtileY0 = minY / OCCLUSION_SUBTILE_HEIGHT, subtileY1 = maxY / OCCLUSION_SUBTILE_HEIGHT;
+        for (int tileY = minY / OCCLUSION_TILE_SIZE; tileY <= maxY / OCCLUSION_TILE_SIZE && occluded; tileY++)
+        {
+            for (int tileX = minX / OCCLUSION_TILE_SIZE; tileX <= maxX / OCCLUSION_TILE_SIZE && occluded; tileX++)
+            {
+                // the whole tile is in front of the box
+                if (nearest < tileDepth[tileY * TILES_X + tileX])
+                    continue;
+                const int subtilesPerTileX = OCCLUSION_TILE_SIZE / OCCLUSION_SUBTILE_WIDTH;
+                const int subtilesPerTileY = OCCLUSION_TILE_SIZE / OCCLUSION_SUBTILE_HEIGHT;
+                int x0 = std::max(subtileX0, tileX * subtilesPerTileX), x1 = std::min(subtileX1, (tileX + 1) * subtilesPerTileX - 1);
+                int y0 = std::max(subtileY0, tileY * subtilesPerTileY), y1 = std::min(subtileY1, (tileY + 1) * subtilesPerTileY - 1);
+                for (int y = y0; y <= y1 && occluded; y++)
+                    for (int x = x0; x <= x1 && occluded; x++)
+                        occluded = nearest < layerDepth[y * SUBTILES_X + x];
+            }
+        }
+    }
+
+    if (occluded)
+        stats.occluded++;
+    stats.testMs += std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+    return occluded;
+}
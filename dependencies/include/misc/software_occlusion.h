@@ -0,0 +1,87 @@
+#ifndef SOFTWARE_OCCLUSION_H
+#define SOFTWARE_OCCLUSION_H
+
+#include <glm/glm.hpp>
+
+#include <misc/thread_pool.h>
+
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+// depth buffer size in pixels, a multiple of the tile size in both directions
+#define OCCLUSION_BUFFER_WIDTH 256
+#define OCCLUSION_BUFFER_HEIGHT 192
+// tiles are what the raster threads share out; each is made of 8x4 pixel subtiles, one coverage bit per pixel
+#define OCCLUSION_TILE_SIZE 32
+#define OCCLUSION_SUBTILE_WIDTH 8
+#define OCCLUSION_SUBTILE_HEIGHT 4
+
+// CPU occlusion culling in the style of masked software occlusion culling (Hasselgren et al.). Occluder triangles
+// are rasterized into a small buffer that keeps, per subtile, a conservative depth for all its pixels plus one
+// working layer: a coverage mask and the farthest depth of the triangles that set it. Once the mask is full the
+// working layer becomes the new conservative depth, so a subtile covered by several triangles still gets a
+// tight bound without a per-pixel depth. Depths are 1/w, so they interpolate linearly over the screen and a
+// larger value is nearer. Coverage is computed for a row of pixels at a time with SSE2 (one pixel at a time
+// without it). Each frame the triangles are set up and binned to tiles by every worker for its share of the
+// occluders, then the tiles are rasterized in parallel, which needs no locking as the tiles do not overlap.
+// A tile also keeps the farthest depth of its subtiles, so most tests are answered per tile.
+class SoftwareOcclusion
+{
+public:
+    struct Stats {
+        unsigned int occluders = 0;  // triangles in front of the near plane and on screen
+        unsigned int tested = 0;
+        unsigned int occluded = 0;
+        float rasterMs = 0.0f;
+        float testMs = 0.0f;         // all of this frame's IsOccluded calls
+    };
+
+    // threadCount 0 uses one per core
+    explicit SoftwareOcclusion(unsigned int threadCount = 0);
+
+    // the largest maxTriangles triangles, three world space positions each, in their original order; small
+    // triangles hide little, so they are left out of the occluders
+    static vector<glm::vec3> SelectOccluders(const vector<glm::vec3>& positions, size_t maxTriangles);
+    // world space occluder triangles, three positions each
+    void SetOccluders(const vector<glm::vec3>& positions);
+
+    // clears the buffer and rasterizes the occluders seen through viewProjection
+    void Render(const glm::mat4& viewProjection);
+    // true if the world space box is certainly hidden behind the occluders rasterized by the last Render
+    bool IsOccluded(const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+    unsigned int GetOccluderCount() const { return (unsigned int)(occluders.size() / 3); }
+    const Stats& GetStats() const { return stats; }
+
+private:
+    // a triangle ready to rasterize, wound so the inside is where all edges are positive
+    struct Triangle {
+        float edgeA[3], edgeB[3], edgeC[3];  // edge functions A*x + B*y + C
+        float depthA, depthB, depthC;        // 1/w as a plane over the screen
+        float depthMin;                      // farthest vertex
+        int minX, minY, maxX, maxY;          // pixels whose centres may be inside, clamped to the buffer
+    };
+    // one worker's set-up triangles and, per tile, the ones that touch it
+    struct Bins {
+        vector<Triangle> triangles;
+        vector<vector<unsigned int>> tiles;
+    };
+
+    ThreadPool pool;
+    vector<glm::vec3> occluders;
+    vector<Bins> bins;
+    glm::mat4 viewProjection;
+    // per subtile: conservative depth, working layer depth and working layer coverage
+    vector<float> layerDepth;
+    vector<float> workingDepth;
+    vector<uint32_t> workingMask;
+    vector<float> tileDepth;  // farthest layerDepth of the tile's subtiles
+    Stats stats;
+
+    void setupTriangles(Bins& bins, size_t first, size_t last) const;
+    void rasterizeTile(unsigned int tile);
+    void rasterizeTriangle(const Triangle& triangle, int subtileX0, int subtileY0, int subtileX1, int subtileY1);
+};
+
+#endif
@@ -0,0 +1,145 @@
+// texture_cache.cpp
+#include "texture_cache.h"
+
+#include <misc/gl_state.h>
+#include <misc/model_cache.h>
+#include <misc/texture_streamer.h>
+
+#include <filesystem>
+
+unsigned int TextureCache::Request(const string& path)
+{
+    string key = canonicalPath(path);
+    {
+        std::lock_guard<mutex> guard(lock);
+        auto found = byPath.find(key);
+        if (found != byPath.end())
+            return found->second;
+    }
+
+    // hashed outside the lock; a request for the same path that wins the race is used instead
+    uint64_t contentHash = 0;
+    {
+        MappedFile file(path);
+        if (file.IsOpen())
+            contentHash = HashBytes(file.Data(), file.Size());
+    }
+
+    std::lock_guard<mutex> guard(lock);
+    auto found = byPath.find(key);
+    if (found != byPath.end())
+        return found->second;
+    if (contentHash)
+    {
+        auto same = byContent.find(contentHash);
+        if (same != byContent.end())
+        {
+            duplicateFiles++;
+            byPath[key] = same->second;
+            return same->second;
+        }
+    }
+    return addEntry(key, contentHash);
+}
+
+unsigned int TextureCache::RequestCubemap(const vector<string>& faces)
+{
+    string key = "cubemap";
+    for (const string& face : faces)
+        key += '|' + canonicalPath(face);
+
+    std::lock_guard<mutex> guard(lock);
+    auto found = byPath.find(key);
+    if (found != byPath.end())
+        return found->second;
+    return addEntry(key, 0);
+}
+
+bool TextureCache::Claim(unsigned int handle)
+{
+    std::lock_guard<mutex> guard(lock);
+    Entry& entry = entries[handle];
+    if (entry.claimed)
+        return false;
+    entry.claimed = true;
+    return true;
+}
+
+unsigned int TextureCache::Name(unsigned int handle)
+{
+    std::lock_guard<mutex> guard(lock);
+    Entry& entry = entries[handle];
+    if (!entry.name)
+        glGenTextures(1, &entry.name);
+    return entry.name;
+}
+
+unsigned int TextureCache::Acquire(unsigned int handle)
+{
+    unsigned int name = Name(handle);
+    std::lock_guard<mutex> guard(lock);
+    Entry& entry = entries[handle];
+    if (entry.refs++ > 0)
+        entry.sharedRefs++;
+    return name;
+}
+
+void TextureCache::Release(unsigned int handle)
+{
+    std::lock_guard<mutex> guard(lock);
+    Entry& entry = entries[handle];
+    if (entry.refs == 0 || --entry.refs > 0)
+        return;
+    // the entry stays registered and is loaded again by the next claim
+    if (entry.name)
+    {
+        TextureStreamer::Get().Cancel(entry.name);
+        GLState::DeleteTexture(entry.name);
+    }
+    entry.name = 0;
+    entry.claimed = false;
+    entry.sharedRefs = 0;
+    entry.bytes = 0;
+}
+
+void TextureCache::AddUploadedBytes(unsigned int handle, size_t bytes)
+{
+    std::lock_guard<mutex> guard(lock);
+    entries[handle].bytes += bytes;
+}
+
+TextureCache::Stats TextureCache::GetStats()
+{
+    std::lock_guard<mutex> guard(lock);
+    Stats stats;
+    for (const Entry& entry : entries)
+    {
+        if (!entry.name)
+            continue;
+        stats.textures++;
+        stats.sharedRefs += entry.sharedRefs;
+        stats.bytesUploaded += entry.bytes;
+        stats.bytesSaved += entry.bytes * entry.sharedRefs;
+    }
+    stats.duplicateFiles = duplicateFiles;
+    return stats;
+}
+
+unsigned int TextureCache::addEntry(const string& key, uint64_t contentHash)
+{
+    unsigned int handle = (unsigned int)entries.size();
+    entries.push_back(Entry());
+    byPath[key] = handle;
+    if (contentHash)
+        byContent[contentHash] = handle;
+    return handle;
+}
+
+string TextureCache::canonicalPath(const string& path)
+{
+    std::error_code error;
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(path, error);
+    if (error)
+        canonical = std::filesystem::absolute(path, error).lexically_normal();
+    return canonical.generic_string();
+}
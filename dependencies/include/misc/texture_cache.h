@@ -0,0 +1,73 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <glad/glad.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// Process-wide, reference counted GL textures. Entries are found by canonical path and, for 2D textures,
+// by a hash of the file contents, so the same image stored under several paths is decoded and uploaded once.
+// Requests and claims may come from any thread; everything that touches GL belongs to the GL thread.
+class TextureCache
+{
+public:
+    struct Stats {
+        unsigned int textures = 0;       // live texture objects
+        unsigned int sharedRefs = 0;     // references served so far by a texture that was already resident
+        unsigned int duplicateFiles = 0; // paths whose contents matched another file
+        size_t bytesUploaded = 0;
+        size_t bytesSaved = 0;           // uploads avoided by sharing
+    };
+
+    static TextureCache& Get()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // finds or registers the 2D texture stored in the file and returns its handle
+    unsigned int Request(const string& path);
+    // the same for a cubemap built from six faces, keyed by their paths
+    unsigned int RequestCubemap(const vector<string>& faces);
+    // true for exactly one caller while the entry has no pixels; that caller decodes and uploads them
+    bool Claim(unsigned int handle);
+
+    // GL thread: the texture object of an entry, created on first use
+    unsigned int Name(unsigned int handle);
+    // GL thread: adds a reference and returns the texture object
+    unsigned int Acquire(unsigned int handle);
+    // GL thread: drops a reference; the texture is deleted with the last one
+    void Release(unsigned int handle);
+    // records the size of uploaded pixels, mip chain included
+    void AddUploadedBytes(unsigned int handle, size_t bytes);
+
+    Stats GetStats();
+
+private:
+    struct Entry {
+        GLuint name = 0;
+        unsigned int refs = 0;
+        unsigned int sharedRefs = 0;
+        bool claimed = false;
+        size_t bytes = 0;
+    };
+
+    TextureCache() = default;
+    unsigned int addEntry(const string& key, uint64_t contentHash);
+    static string canonicalPath(const string& path);
+
+    mutex lock;
+    deque<Entry> entries;                             // handles index this; entries are never removed
+    unordered_map<string, unsigned int> byPath;
+    unordered_map<uint64_t, unsigned int> byContent;
+    unsigned int duplicateFiles = 0;
+};
+
+#endif
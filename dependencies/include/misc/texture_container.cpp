@@ -0,0 +1,464 @@
+// texture_container.cpp
+#include "texture_container.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// bytes per 4x4 block, or per texel for uncompressed formats
+static size_t blockBytes(TextureFormat format)
+{
+    switch (format)
+    {
+    case TextureFormat::RGBA8: return 4;
+    case TextureFormat::BGR8: return 3;
+    case TextureFormat::BGRX8: return 4;
+    case TextureFormat::BC1: return 8;
+    default: return 16;
+    }
+}
+
+static bool isBlockCompressed(TextureFormat format)
+{
+    return format == TextureFormat::BC1 || format == TextureFormat::BC3 || format == TextureFormat::BC7;
+}
+
+// uncompressed rows are padded to the 4-byte GL_UNPACK_ALIGNMENT, as BMP rows are
+static size_t rowBytes(TextureFormat format, int width)
+{
+    if (!isBlockCompressed(format))
+        return ((size_t)width * blockBytes(format) + 3) & ~(size_t)3;
+    return (size_t)((width + 3) / 4) * blockBytes(format);
+}
+
+static size_t levelSize(TextureFormat format, int width, int height)
+{
+    if (!isBlockCompressed(format))
+        return rowBytes(format, width) * height;
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockBytes(format);
+}
+
+static uint16_t packColor565(const float* color)
+{
+    int r = std::min(31, std::max(0, (int)(color[0] * 31.0f / 255.0f + 0.5f)));
+    int g = std::min(63, std::max(0, (int)(color[1] * 63.0f / 255.0f + 0.5f)));
+    int b = std::min(31, std::max(0, (int)(color[2] * 31.0f / 255.0f + 0.5f)));
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void unpackColor565(uint16_t packed, int* color)
+{
+    int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+}
+
+// BC1 colour block: endpoints at the extremes of the texels along their principal axis, 2-bit indices
+static void encodeColorBlock(const unsigned char texels[16][4], unsigned char* out)
+{
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < 3; c++)
+            mean[c] += texels[i][c] / 16.0f;
+    float covariance[3][3] = {};
+    for (int i = 0; i < 16; i++)
+    {
+        float d[3] = { texels[i][0] - mean[0], texels[i][1] - mean[1], texels[i][2] - mean[2] };
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < 3; b++)
+                covariance[a][b] += d[a] * d[b];
+    }
+    // a few power iterations are enough to find the dominant direction
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int iteration = 0; iteration < 4; iteration++)
+    {
+        float next[3];
+        for (int a = 0; a < 3; a++)
+            next[a] = covariance[a][0] * axis[0] + covariance[a][1] * axis[1] + covariance[a][2] * axis[2];
+        float length = std::max(std::fabs(next[0]), std::max(std::fabs(next[1]), std::fabs(next[2])));
+        if (length < 1e-6f)
+            break;
+        for (int a = 0; a < 3; a++)
+            axis[a] = next[a] / length;
+    }
+    int lowest = 0, highest = 0;
+    float lowestDot = 1e30f, highestDot = -1e30f;
+    for (int i = 0; i < 16; i++)
+    {
+        float dot = texels[i][0] * axis[0] + texels[i][1] * axis[1] + texels[i][2] * axis[2];
+        if (dot < lowestDot) { lowestDot = dot; lowest = i; }
+        if (dot > highestDot) { highestDot = dot; highest = i; }
+    }
+    float high[3] = { (float)texels[highest][0], (float)texels[highest][1], (float)texels[highest][2] };
+    float low[3] = { (float)texels[lowest][0], (float)texels[lowest][1], (float)texels[lowest][2] };
+    uint16_t color0 = packColor565(high);
+    uint16_t color1 = packColor565(low);
+    // color0 > color1 selects the four colour mode
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    uint32_t indices = 0;
+    if (color0 != color1)
+    {
+        int palette[4][3];
+        unpackColor565(color0, palette[0]);
+        unpackColor565(color1, palette[1]);
+        for (int c = 0; c < 3; c++)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        for (int i = 0; i < 16; i++)
+        {
+            int best = 0, bestError = 1 << 30;
+            for (int p = 0; p < 4; p++)
+            {
+                int dr = texels[i][0] - palette[p][0], dg = texels[i][1] - palette[p][1], db = texels[i][2] - palette[p][2];
+                int error = dr * dr + dg * dg + db * db;
+                if (error < bestError) { bestError = error; best = p; }
+            }
+            indices |= (uint32_t)best << (2 * i);
+        }
+    }
+    out[0] = (unsigned char)(color0 & 0xFF);
+    out[1] = (unsigned char)(color0 >> 8);
+    out[2] = (unsigned char)(color1 & 0xFF);
+    out[3] = (unsigned char)(color1 >> 8);
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+// BC3 alpha block: the extremes as endpoints, six interpolated values between them, 3-bit indices
+static void encodeAlphaBlock(const unsigned char texels[16][4], unsigned char* out)
+{
+    int alpha0 = 0, alpha1 = 255;
+    for (int i = 0; i < 16; i++)
+    {
+        alpha0 = std::max(alpha0, (int)texels[i][3]);
+        alpha1 = std::min(alpha1, (int)texels[i][3]);
+    }
+    uint64_t indices = 0;
+    if (alpha0 != alpha1)
+    {
+        int palette[8] = { alpha0, alpha1 };
+        for (int i = 1; i < 7; i++)
+            palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+        for (int i = 0; i < 16; i++)
+        {
+            int best = 0, bestError = 256;
+            for (int p = 0; p < 8; p++)
+            {
+                int error = std::abs(texels[i][3] - palette[p]);
+                if (error < bestError) { bestError = error; best = p; }
+            }
+            indices |= (uint64_t)best << (3 * i);
+        }
+    }
+    out[0] = (unsigned char)alpha0;
+    out[1] = (unsigned char)alpha1;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+static void encodeLevel(TextureFormat format, const unsigned char* rgba, int width, int height, unsigned char* out)
+{
+    if (format == TextureFormat::RGBA8)
+    {
+        std::memcpy(out, rgba, (size_t)width * height * 4);
+        return;
+    }
+    unsigned char texels[16][4];
+    for (int blockY = 0; blockY < height; blockY += 4)
+    {
+        for (int blockX = 0; blockX < width; blockX += 4)
+        {
+            // blocks hanging over the edge repeat its texels
+            for (int i = 0; i < 16; i++)
+            {
+                int x = std::min(blockX + i % 4, width - 1);
+                int y = std::min(blockY + i / 4, height - 1);
+                std::memcpy(texels[i], rgba + ((size_t)y * width + x) * 4, 4);
+            }
+            if (format == TextureFormat::BC3)
+            {
+                encodeAlphaBlock(texels, out);
+                out += 8;
+            }
+            encodeColorBlock(texels, out);
+            out += 8;
+        }
+    }
+}
+
+// box filter; odd edges reuse their last texel
+static vector<unsigned char> downsample(const vector<unsigned char>& rgba, int width, int height, int nextWidth, int nextHeight)
+{
+    vector<unsigned char> next((size_t)nextWidth * nextHeight * 4);
+    for (int y = 0; y < nextHeight; y++)
+    {
+        int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+        for (int x = 0; x < nextWidth; x++)
+        {
+            int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+            for (int c = 0; c < 4; c++)
+            {
+                int sum = rgba[((size_t)y0 * width + x0) * 4 + c] + rgba[((size_t)y0 * width + x1) * 4 + c]
+                        + rgba[((size_t)y1 * width + x0) * 4 + c] + rgba[((size_t)y1 * width + x1) * 4 + c];
+                next[((size_t)y * nextWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+    return next;
+}
+
+shared_ptr<TextureContainer> TextureContainer::Load(const string& path, uint64_t sourceHash, bool* unsupported)
+{
+    auto file = std::make_unique<MappedFile>(path);
+    if (!file->IsOpen())
+        return nullptr;
+
+    ModelCacheReader reader(file->Data(), file->Size());
+    const TextureContainerHeader* header = reader.Take<TextureContainerHeader>();
+    if (!header || std::memcmp(header->magic, "GKTX", 4) != 0 || header->version != TEXTURE_CONTAINER_VERSION)
+        return nullptr;
+    if (sourceHash && header->sourceHash != sourceHash)
+        return nullptr;
+    if (header->format > (uint32_t)TextureFormat::BC7 || header->levelCount == 0 || header->levelCount > 16)
+        return nullptr;
+    TextureFormat format = (TextureFormat)header->format;
+    if (!IsSupported(format))
+    {
+        if (unsupported)
+            *unsupported = true;
+        return nullptr;
+    }
+    const TextureContainerLevel* table = reader.Take<TextureContainerLevel>(header->levelCount);
+    if (!table)
+        return nullptr;
+
+    auto container = std::make_shared<TextureContainer>();
+    container->format = format;
+    container->width = (int)header->width;
+    container->height = (int)header->height;
+    for (uint32_t i = 0; i < header->levelCount; i++)
+    {
+        const TextureContainerLevel& level = table[i];
+        if (level.width == 0 || level.height == 0 || level.size != levelSize(format, level.width, level.height)
+            || level.offset > file->Size() || level.size > file->Size() - level.offset)
+            return nullptr;
+        container->levels.push_back({ (int)level.width, (int)level.height, file->Data() + level.offset, level.size,
+                                      rowBytes(format, level.width) });
+    }
+    container->file = std::move(file);
+    return container;
+}
+
+shared_ptr<TextureContainer> TextureContainer::Build(const DecodedImage& image, bool cubemapFace)
+{
+    int width = image.width, height = image.height;
+    vector<unsigned char> rgba((size_t)width * height * 4);
+    bool opaque = true;
+    for (size_t i = 0; i < (size_t)width * height; i++)
+    {
+        const unsigned char* texel = image.pixels + i * image.components;
+        unsigned char* out = &rgba[i * 4];
+        bool grey = image.components < 3;
+        out[0] = texel[0];
+        out[1] = grey ? texel[0] : texel[1];
+        out[2] = grey ? texel[0] : texel[2];
+        out[3] = image.components == 2 ? texel[1] : image.components == 4 ? texel[3] : 255;
+        if (cubemapFace)
+            out[3] = 255;
+        opaque = opaque && out[3] == 255;
+    }
+
+    auto container = std::make_shared<TextureContainer>();
+    container->width = width;
+    container->height = height;
+    if (std::min(width, height) >= TEXTURE_CONTAINER_MIN_COMPRESSED_SIZE && IsSupported(TextureFormat::BC1))
+        container->format = opaque ? TextureFormat::BC1 : TextureFormat::BC3;
+
+    // the mip chain is filtered in RGBA8 and each level compressed on its own
+    vector<size_t> offsets;
+    vector<std::pair<int, int>> sizes;
+    for (;;)
+    {
+        size_t size = levelSize(container->format, width, height);
+        offsets.push_back(container->storage.size());
+        sizes.push_back({ width, height });
+        container->storage.resize(container->storage.size() + size);
+        encodeLevel(container->format, rgba.data(), width, height, &container->storage[offsets.back()]);
+        if (cubemapFace || (width == 1 && height == 1))
+            break;
+        int nextWidth = std::max(1, width / 2), nextHeight = std::max(1, height / 2);
+        rgba = downsample(rgba, width, height, nextWidth, nextHeight);
+        width = nextWidth;
+        height = nextHeight;
+    }
+    for (size_t i = 0; i < offsets.size(); i++)
+    {
+        size_t size = levelSize(container->format, sizes[i].first, sizes[i].second);
+        container->levels.push_back({ sizes[i].first, sizes[i].second, container->storage.data() + offsets[i], size,
+                                      rowBytes(container->format, sizes[i].first) });
+    }
+    return container;
+}
+
+bool TextureContainer::Save(const string& path, uint64_t sourceHash) const
+{
+    TextureContainerHeader header;
+    std::memcpy(header.magic, "GKTX", 4);
+    header.version = TEXTURE_CONTAINER_VERSION;
+    header.sourceHash = sourceHash;
+    header.format = (uint32_t)format;
+    header.width = (uint32_t)width;
+    header.height = (uint32_t)height;
+    header.levelCount = (uint32_t)levels.size();
+
+    vector<TextureContainerLevel> table;
+    uint32_t offset = (uint32_t)(sizeof(header) + levels.size() * sizeof(TextureContainerLevel));
+    for (const Level& level : levels)
+    {
+        table.push_back({ (uint32_t)level.width, (uint32_t)level.height, offset, (uint32_t)level.size });
+        offset += ((uint32_t)level.size + 3) & ~3u;
+    }
+
+    // written under a temporary name first, so an interrupted run never leaves a truncated container behind
+    string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(TextureContainerLevel));
+        const char padding[4] = {};
+        for (const Level& level : levels)
+        {
+            out.write(reinterpret_cast<const char*>(level.data), level.size);
+            out.write(padding, ((level.size + 3) & ~(size_t)3) - level.size);
+        }
+        if (!out)
+        {
+            std::cout << "Texture container: could not write " << temporary << std::endl;
+            return false;
+        }
+    }
+    std::remove(path.c_str());
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::cout << "Texture container: could not rename " << temporary << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+shared_ptr<TextureContainer> TextureContainer::MapRaw(const string& path)
+{
+    auto file = std::make_unique<MappedFile>(path);
+    if (!file->IsOpen() || file->Size() < 54 || std::memcmp(file->Data(), "BM", 2) != 0)
+        return nullptr;
+
+    // BITMAPFILEHEADER and BITMAPINFOHEADER fields, little endian and unaligned
+    auto read32 = [&file](size_t offset) {
+        const unsigned char* bytes = file->Data() + offset;
+        return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    };
+    uint32_t pixelOffset = read32(10);
+    uint32_t infoSize = read32(14);
+    int32_t width = (int32_t)read32(18);
+    int32_t height = (int32_t)read32(22);
+    uint32_t planesAndBits = read32(26);
+    uint32_t compression = read32(30);
+    int bitsPerPixel = (int)(planesAndBits >> 16);
+    // only uncompressed true colour; palettes, RLE and bit fields go through stb_image
+    if (infoSize < 40 || (planesAndBits & 0xFFFF) != 1 || (bitsPerPixel != 24 && bitsPerPixel != 32) || compression != 0)
+        return nullptr;
+    if (width <= 0 || height == 0 || height == INT32_MIN)
+        return nullptr;
+
+    auto container = std::make_shared<TextureContainer>();
+    container->format = bitsPerPixel == 24 ? TextureFormat::BGR8 : TextureFormat::BGRX8;
+    container->width = width;
+    container->height = height < 0 ? -height : height;
+    container->bottomUp = height > 0;
+    size_t stride = rowBytes(container->format, container->width);
+    size_t size = levelSize(container->format, container->width, container->height);
+    if (pixelOffset > file->Size() || size > file->Size() - pixelOffset)
+        return nullptr;
+    container->levels.push_back({ container->width, container->height, file->Data() + pixelOffset, size, stride });
+    container->file = std::move(file);
+    return container;
+}
+
+GLenum TextureContainer::GetInternalFormat() const
+{
+    switch (format)
+    {
+    case TextureFormat::BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    case TextureFormat::BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    case TextureFormat::BC7: return GL_COMPRESSED_RGBA_BPTC_UNORM_ARB;
+    case TextureFormat::BGR8:
+    case TextureFormat::BGRX8: return GL_RGB8;
+    default: return GL_RGBA8;
+    }
+}
+
+GLenum TextureContainer::GetPixelFormat() const
+{
+    switch (format)
+    {
+    case TextureFormat::BGR8: return GL_BGR;
+    case TextureFormat::BGRX8: return GL_BGRA;
+    default: return GL_RGBA;
+    }
+}
+
+bool TextureContainer::IsSupported(TextureFormat format)
+{
+    switch (format)
+    {
+    case TextureFormat::BC1:
+    case TextureFormat::BC3:
+        return GLAD_GL_EXT_texture_compression_s3tc != 0;
+    case TextureFormat::BC7:
+        // core since 4.2
+        return GLAD_GL_ARB_texture_compression_bptc != 0 || GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 2);
+    default:
+        return true;
+    }
+}
+
+shared_ptr<TextureContainer> OpenTextureContainer(const string& path, bool cubemapFace)
+{
+    // already GPU-ready: no decode, no copy, and no lossy compression of the sky gradients
+    shared_ptr<TextureContainer> raw = TextureContainer::MapRaw(path);
+    if (raw)
+        return raw;
+
+    uint64_t sourceHash = 0;
+    {
+        MappedFile source(path);
+        if (source.IsOpen())
+            sourceHash = HashBytes(source.Data(), source.Size());
+    }
+    string containerPath = path + TEXTURE_CONTAINER_EXTENSION;
+    bool unsupported = false;
+    shared_ptr<TextureContainer> container = TextureContainer::Load(containerPath, sourceHash, &unsupported);
+    if (container)
+        return container;
+
+    DecodedImage image(path);
+    if (!image.pixels)
+    {
+        std::cout << "Texture failed to load at path: " << path << std::endl;
+        return nullptr;
+    }
+    container = TextureContainer::Build(image, cubemapFace);
+    // a container this GL cannot sample is kept for machines that can
+    if (!unsupported)
+        container->Save(containerPath, sourceHash);
+    return container;
+}
@@ -0,0 +1,107 @@
+#ifndef TEXTURE_CONTAINER_H
+#define TEXTURE_CONTAINER_H
+
+#include <glad/glad.h>
+
+#include <misc/asset_loader.h>
+#include <misc/model_cache.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+// bump whenever the layout below or the encoders change, so stale containers are rebuilt
+#define TEXTURE_CONTAINER_VERSION 1
+// the container lives next to the source image, e.g. Palette.png -> Palette.png.gktx
+#define TEXTURE_CONTAINER_EXTENSION ".gktx"
+// smaller images stay RGBA8: palettes need their exact colours and block compression would save next to nothing
+#define TEXTURE_CONTAINER_MIN_COMPRESSED_SIZE 128
+
+// how the texels of every level are stored
+enum class TextureFormat : uint32_t {
+    RGBA8,  // uncompressed, the fallback
+    BC1,    // DXT1, 4 bits per texel, opaque
+    BC3,    // DXT5, 8 bits per texel, BC1 colour plus interpolated alpha
+    BC7,    // BPTC, 8 bits per texel; read when present, never written by Build
+    BGR8,   // uncompressed image files mapped as they are, see MapRaw; never stored in a container
+    BGRX8   // the same with 32-bit texels whose fourth byte is ignored
+};
+
+// File layout, every block 4-byte aligned:
+//   TextureContainerHeader
+//   TextureContainerLevel[levelCount], largest level first
+//   the texels of each level, BC formats as 4x4 blocks in row order
+struct TextureContainerHeader {
+    char magic[4];          // "GKTX"
+    uint32_t version;       // TEXTURE_CONTAINER_VERSION
+    uint64_t sourceHash;    // FNV-1a of the source image, 0 if built without one
+    uint32_t format;        // TextureFormat
+    uint32_t width;
+    uint32_t height;
+    uint32_t levelCount;
+};
+
+struct TextureContainerLevel {
+    uint32_t width;
+    uint32_t height;
+    uint32_t offset;        // from the start of the file
+    uint32_t size;
+};
+
+// GPU-ready texels with their whole mip chain, either mapped from a container file or built from a decoded image
+class TextureContainer
+{
+public:
+    struct Level {
+        int width;
+        int height;
+        const unsigned char* data;
+        size_t size;
+        size_t rowBytes;    // between block rows, padding included
+    };
+
+    // maps a container; null if it is missing, damaged, built from a different source or in a format the GL lacks
+    static shared_ptr<TextureContainer> Load(const string& path, uint64_t sourceHash, bool* unsupported = nullptr);
+    // block compresses the image and builds its mip chain; cubemap faces get a single level and no alpha
+    static shared_ptr<TextureContainer> Build(const DecodedImage& image, bool cubemapFace);
+    // maps an uncompressed 24 or 32-bit BMP and points the single level straight at its pixel rows; null for anything else
+    static shared_ptr<TextureContainer> MapRaw(const string& path);
+    bool Save(const string& path, uint64_t sourceHash) const;
+
+    TextureFormat GetFormat() const { return format; }
+    int GetWidth() const { return width; }
+    int GetHeight() const { return height; }
+    unsigned int GetLevelCount() const { return (unsigned int)levels.size(); }
+    const Level& GetLevel(unsigned int level) const { return levels[level]; }
+    // texels covered by one block row: 4 for BC, 1 for uncompressed formats
+    int GetBlockSize() const { return IsCompressed() ? 4 : 1; }
+    bool IsCompressed() const { return format == TextureFormat::BC1 || format == TextureFormat::BC3 || format == TextureFormat::BC7; }
+    GLenum GetInternalFormat() const;
+    // the client format of uncompressed texels; BGR orders are swizzled by the GL while it unpacks them
+    GLenum GetPixelFormat() const;
+    // GL_UNPACK_ALIGNMENT matching the row padding: BMP rows are padded to 4 bytes, all other rows are multiples of it
+    int GetRowAlignment() const { return 4; }
+    // rows stored bottom to top, as in most BMPs; the uploader reverses them
+    bool IsBottomUp() const { return bottomUp; }
+
+    static bool IsSupported(TextureFormat format);
+
+private:
+    TextureFormat format = TextureFormat::RGBA8;
+    int width = 0;
+    int height = 0;
+    bool bottomUp = false;
+    vector<Level> levels;
+    unique_ptr<MappedFile> file;    // loaded containers point into the mapping
+    vector<unsigned char> storage;  // built ones own their texels
+};
+
+// The texture for an image file. Raw BMPs are mapped and uploaded as they are; any other image uses its container
+// when that is up to date, otherwise it is decoded, built into a container and saved for the next run.
+// Null if the image cannot be read. Safe to call from any thread.
+shared_ptr<TextureContainer> OpenTextureContainer(const string& path, bool cubemapFace);
+
+#endif
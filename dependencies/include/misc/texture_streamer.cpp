@@ -0,0 +1,381 @@
+// texture_streamer.cpp
+#include "texture_streamer.h"
+
+#include <misc/gl_state.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// cubemap faces use only the top level
+static unsigned int levelsToUpload(const TextureContainer& container, TextureStreamer::Kind kind)
+{
+    return kind == TextureStreamer::CubemapFace ? 1 : container.GetLevelCount();
+}
+
+static size_t uploadedBytes(const shared_ptr<TextureContainer>& container, TextureStreamer::Kind kind)
+{
+    size_t bytes = 0;
+    if (container)
+        for (unsigned int level = 0; level < levelsToUpload(*container, kind); level++)
+            bytes += container->GetLevel(level).size;
+    return bytes;
+}
+
+TextureStreamer::~TextureStreamer()
+{
+    Stop();
+}
+
+void TextureStreamer::Start(function<void()> makeCurrent, function<void()> doneCurrent, size_t bytesPerFrame)
+{
+    if (uploader.joinable())
+        return;
+    this->bytesPerFrame = bytesPerFrame;
+    stopping = false;
+    uploader = thread([this, makeCurrent, doneCurrent] { uploadLoop(makeCurrent, doneCurrent); });
+}
+
+void TextureStreamer::Stop()
+{
+    if (!uploader.joinable())
+        return;
+    {
+        std::lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    uploader.join();
+}
+
+void TextureStreamer::Enqueue(GLuint texture, Kind kind, unsigned int face, shared_ptr<TextureContainer> container,
+                              function<void(size_t)> onUploaded)
+{
+    auto request = std::make_shared<Request>();
+    request->texture = texture;
+    request->kind = kind;
+    request->face = face;
+    request->container = container;
+    request->opened = true;
+    request->onUploaded = onUploaded;
+    push(request);
+}
+
+void TextureStreamer::EnqueueFile(GLuint texture, Kind kind, unsigned int face, const string& path,
+                                  function<void(size_t)> onUploaded)
+{
+    auto request = std::make_shared<Request>();
+    request->texture = texture;
+    request->kind = kind;
+    request->face = face;
+    request->path = path;
+    request->onUploaded = onUploaded;
+    push(request);
+}
+
+void TextureStreamer::Cancel(GLuint texture)
+{
+    if (pending.erase(texture) == 0)
+        return;
+    {
+        std::lock_guard<mutex> guard(lock);
+        for (auto request = queue.begin(); request != queue.end();)
+        {
+            if ((*request)->texture == texture)
+            {
+                (*request)->cancelled = true;
+                request = queue.erase(request);
+            }
+            else
+            {
+                request++;
+            }
+        }
+        waiting.insert(waiting.end(), finished.begin(), finished.end());
+        finished.clear();
+    }
+    for (size_t i = 0; i < waiting.size();)
+    {
+        if (waiting[i].texture == texture)
+        {
+            glDeleteSync(waiting[i].fence);
+            waiting.erase(waiting.begin() + i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+void TextureStreamer::Update()
+{
+    size_t uploaded;
+    {
+        std::lock_guard<mutex> guard(lock);
+        waiting.insert(waiting.end(), finished.begin(), finished.end());
+        finished.clear();
+        uploaded = bytesThisFrame;
+        bytesThisFrame = 0;
+        budget = bytesPerFrame;
+    }
+    wake.notify_one();
+
+    // without an upload thread the budget is spent here
+    if (!uploader.joinable())
+    {
+        size_t allowance = bytesPerFrame;
+        while (allowance > 0 && !queue.empty())
+        {
+            Request& request = *queue.front();
+            if (!request.opened)
+            {
+                request.container = OpenTextureContainer(request.path, request.kind == CubemapFace);
+                request.opened = true;
+            }
+            size_t before = allowance;
+            bool done = uploadSlice(request, allowance, true);
+            uploaded += before - allowance;
+            if (done)
+            {
+                publish({ request.texture, nullptr, uploadedBytes(request.container, request.kind), request.onUploaded });
+                queue.pop_front();
+            }
+        }
+        if (queue.empty() && renderPixelBuffer)
+        {
+            GLState::DeleteBuffer(renderPixelBuffer);
+            renderPixelBuffer = 0;
+        }
+    }
+    bytesLastFrame = uploaded;
+    bytesTotal += uploaded;
+
+    // textures from the upload thread are used only once the GPU has finished writing them
+    for (size_t i = 0; i < waiting.size();)
+    {
+        GLenum status = glClientWaitSync(waiting[i].fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+        {
+            glDeleteSync(waiting[i].fence);
+            publish(waiting[i]);
+            waiting.erase(waiting.begin() + i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+TextureStreamer::Stats TextureStreamer::GetStats() const
+{
+    Stats stats;
+    stats.pending = (unsigned int)pending.size();
+    stats.bytesLastFrame = bytesLastFrame;
+    stats.bytesTotal = bytesTotal;
+    return stats;
+}
+
+void TextureStreamer::uploadLoop(function<void()> makeCurrent, function<void()> doneCurrent)
+{
+    makeCurrent();
+    glGenBuffers(1, &pixelBuffer);
+
+    std::unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        wake.wait(guard, [this] { return stopping || (!queue.empty() && budget > 0); });
+        if (stopping)
+            break;
+        shared_ptr<Request> request = queue.front();
+        size_t allowance = budget;
+        guard.unlock();
+
+        if (!request->opened)
+        {
+            request->container = OpenTextureContainer(request->path, request->kind == CubemapFace);
+            request->opened = true;
+        }
+        size_t before = allowance;
+        bool done = uploadSlice(*request, allowance, false);
+        GLsync fence = done ? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : nullptr;
+        // the render context only sees the fence once it has been flushed
+        glFlush();
+
+        guard.lock();
+        size_t used = before - allowance;
+        budget -= std::min(budget, used);
+        bytesThisFrame += used;
+        if (request->cancelled)
+        {
+            // Cancel has already taken it off the queue
+            if (fence)
+                glDeleteSync(fence);
+        }
+        else if (done)
+        {
+            finished.push_back({ request->texture, fence, uploadedBytes(request->container, request->kind), request->onUploaded });
+            queue.pop_front();
+        }
+    }
+    guard.unlock();
+
+    glDeleteBuffers(1, &pixelBuffer);
+    pixelBuffer = 0;
+    doneCurrent();
+}
+
+bool TextureStreamer::uploadSlice(Request& request, size_t& budget, bool renderThread)
+{
+    // the failure has already been reported; the texture stays empty
+    if (!request.container)
+        return true;
+    const TextureContainer& container = *request.container;
+    const TextureContainer::Level& level = container.GetLevel(request.level);
+
+    GLenum bindTarget = request.kind == CubemapFace ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+    GLenum imageTarget = request.kind == CubemapFace ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + request.face : GL_TEXTURE_2D;
+    GLenum internalFormat = container.GetInternalFormat();
+    GLenum pixelFormat = container.GetPixelFormat();
+    int blockSize = container.GetBlockSize();
+    int blockRows = (level.height + blockSize - 1) / blockSize;
+    int rows = (int)std::min<size_t>(blockRows - request.blockRowsDone, std::max<size_t>(1, budget / level.rowBytes));
+    int y = request.blockRowsDone * blockSize;
+    int height = std::min(rows * blockSize, level.height - y);
+    size_t sliceBytes = rows * level.rowBytes;
+    // bottom-up images store the slice's rows in reverse, ending at this one
+    bool bottomUp = container.IsBottomUp();
+    const unsigned char* slice = level.data + (bottomUp ? blockRows - request.blockRowsDone - rows : request.blockRowsDone) * level.rowBytes;
+
+    // the render context goes through its binding cache, the upload context has its own bindings
+    if (renderThread)
+        GLState::BindTexture(0, bindTarget, request.texture);
+    else
+        glBindTexture(bindTarget, request.texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, container.GetRowAlignment());
+    if (request.blockRowsDone == 0)
+    {
+        if (container.IsCompressed())
+            glCompressedTexImage2D(imageTarget, request.level, internalFormat, level.width, level.height, 0, (GLsizei)level.size, nullptr);
+        else
+            glTexImage2D(imageTarget, request.level, internalFormat, level.width, level.height, 0, pixelFormat, GL_UNSIGNED_BYTE, nullptr);
+    }
+
+    if (renderThread && !bottomUp)
+    {
+        // straight from the container's memory, which for raw images is the mapped file itself
+        if (container.IsCompressed())
+            glCompressedTexSubImage2D(imageTarget, request.level, 0, y, level.width, height, internalFormat, (GLsizei)sliceBytes, slice);
+        else
+            glTexSubImage2D(imageTarget, request.level, 0, y, level.width, height, pixelFormat, GL_UNSIGNED_BYTE, slice);
+    }
+    else
+    {
+        // orphaned every slice, so the driver never waits for the previous transfer; this copy is the transfer itself,
+        // and reverses bottom-up rows on the way, so the slice still goes up in one call. The render thread only
+        // takes this path for bottom-up images and keeps a buffer of its own while they stream.
+        if (renderThread)
+        {
+            if (!renderPixelBuffer)
+                glGenBuffers(1, &renderPixelBuffer);
+            GLState::BindBuffer(GL_PIXEL_UNPACK_BUFFER, renderPixelBuffer);
+        }
+        else
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, sliceBytes, nullptr, GL_STREAM_DRAW);
+        unsigned char* mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, sliceBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (mapped)
+        {
+            if (bottomUp)
+                for (int row = 0; row < rows; row++)
+                    std::memcpy(mapped + row * level.rowBytes, slice + (rows - 1 - row) * level.rowBytes, level.rowBytes);
+            else
+                std::memcpy(mapped, slice, sliceBytes);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        if (container.IsCompressed())
+            glCompressedTexSubImage2D(imageTarget, request.level, 0, y, level.width, height, internalFormat, (GLsizei)sliceBytes, (void*)0);
+        else
+            glTexSubImage2D(imageTarget, request.level, 0, y, level.width, height, pixelFormat, GL_UNSIGNED_BYTE, (void*)0);
+        if (renderThread)
+            GLState::BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        else
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    budget -= std::min(budget, sliceBytes);
+    request.blockRowsDone += rows;
+    if (request.blockRowsDone < blockRows)
+        return false;
+    request.blockRowsDone = 0;
+    if (++request.level < levelsToUpload(container, request.kind))
+        return false;
+
+    // the mip chain comes with the container; only raw images still need one generated
+    GLint maxLevel = (GLint)levelsToUpload(container, request.kind) - 1;
+    if (request.kind == Texture2D && maxLevel == 0 && !container.IsCompressed())
+    {
+        glGenerateMipmap(GL_TEXTURE_2D);
+        maxLevel = (GLint)std::log2((float)std::max(level.width, level.height));
+    }
+    glTexParameteri(bindTarget, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(bindTarget, GL_TEXTURE_MAX_LEVEL, maxLevel);
+    glTexParameteri(bindTarget, GL_TEXTURE_MIN_FILTER, maxLevel > 0 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(bindTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    if (request.kind == Texture2D)
+    {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    }
+    else
+    {
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    }
+    return true;
+}
+
+// 1x1 grey stand-ins, drawn while the real pixels are on their way
+void TextureStreamer::createPlaceholders()
+{
+    if (placeholder2D)
+        return;
+    const unsigned char grey[4] = { 128, 128, 128, 255 };
+
+    glGenTextures(1, &placeholder2D);
+    GLState::BindTexture(0, GL_TEXTURE_2D, placeholder2D);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &placeholderCubemap);
+    GLState::BindTexture(0, GL_TEXTURE_CUBE_MAP, placeholderCubemap);
+    for (unsigned int face = 0; face < 6; face++)
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+void TextureStreamer::push(shared_ptr<Request> request)
+{
+    createPlaceholders();
+    Pending& entry = pending[request->texture];
+    entry.kind = request->kind;
+    entry.uploads++;
+    {
+        std::lock_guard<mutex> guard(lock);
+        queue.push_back(request);
+    }
+    wake.notify_one();
+}
+
+void TextureStreamer::publish(const Finished& texture)
+{
+    auto found = pending.find(texture.texture);
+    if (found != pending.end() && --found->second.uploads == 0)
+        pending.erase(found);
+    if (texture.onUploaded)
+        texture.onUploaded(texture.bytes);
+}
@@ -0,0 +1,137 @@
+#ifndef TEXTURE_STREAMER_H
+#define TEXTURE_STREAMER_H
+
+#include <glad/glad.h>
+
+#include <misc/texture_container.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// default number of texel bytes uploaded per frame
+#define TEXTURE_STREAMING_BUDGET (4 * 1024 * 1024)
+
+// Uploads texture containers in the background. With Start, a thread on a context that shares objects with the
+// render context copies each mip level into a pixel unpack buffer and from there into the texture, a few block
+// rows at a time within a per-frame byte budget, then fences the work. Update publishes textures whose fence has
+// signaled; until then Resolve hands out a placeholder. Without a shared context the same budgeted uploads
+// run on the render thread inside Update.
+// Everything except the upload thread itself is called from the render thread.
+class TextureStreamer
+{
+public:
+    enum Kind {
+        Texture2D,    // repeat wrapping and the container's mip chain, for model textures
+        CubemapFace   // one face of a clamped cubemap, top level only
+    };
+
+    struct Stats {
+        unsigned int pending = 0;         // textures still showing the placeholder
+        size_t bytesLastFrame = 0;
+        size_t bytesTotal = 0;
+    };
+
+    static TextureStreamer& Get()
+    {
+        static TextureStreamer streamer;
+        return streamer;
+    }
+
+    // starts the upload thread; makeCurrent/doneCurrent bind and unbind a context shared with the render context on it
+    void Start(function<void()> makeCurrent, function<void()> doneCurrent, size_t bytesPerFrame = TEXTURE_STREAMING_BUDGET);
+    // joins the upload thread, leaving anything still queued; call before the contexts go away
+    void Stop();
+
+    // queues a container for a texture object; onUploaded gets the byte count once it is published
+    void Enqueue(GLuint texture, Kind kind, unsigned int face, shared_ptr<TextureContainer> container,
+                 function<void(size_t)> onUploaded = nullptr);
+    // the same, opening the image's container on the upload thread
+    void EnqueueFile(GLuint texture, Kind kind, unsigned int face, const string& path,
+                     function<void(size_t)> onUploaded = nullptr);
+
+    // drops the uploads still queued for a texture that is about to be deleted
+    void Cancel(GLuint texture);
+
+    // once per frame: publishes finished textures and grants the next frame's budget
+    void Update();
+    // the texture to bind in place of texture: the placeholder while it is still streaming
+    GLuint Resolve(GLuint texture) const
+    {
+        if (pending.empty())
+            return texture;
+        auto found = pending.find(texture);
+        if (found == pending.end())
+            return texture;
+        return found->second.kind == CubemapFace ? placeholderCubemap : placeholder2D;
+    }
+
+    Stats GetStats() const;
+
+private:
+    struct Request {
+        GLuint texture;
+        Kind kind;
+        unsigned int face;
+        string path;
+        shared_ptr<TextureContainer> container;
+        bool opened = false;
+        function<void(size_t)> onUploaded;
+        unsigned int level = 0;
+        int blockRowsDone = 0;  // of the current level
+        bool cancelled = false;
+    };
+    struct Finished {
+        GLuint texture;
+        GLsync fence;  // null when uploaded on the render thread
+        size_t bytes;
+        function<void(size_t)> onUploaded;
+    };
+    struct Pending {
+        Kind kind;
+        unsigned int uploads;  // six for a cubemap
+    };
+
+    TextureStreamer() = default;
+    ~TextureStreamer();
+
+    void uploadLoop(function<void()> makeCurrent, function<void()> doneCurrent);
+    // uploads the next block rows of the request within budget; true once every level is in the texture
+    bool uploadSlice(Request& request, size_t& budget, bool renderThread);
+    void createPlaceholders();
+    void push(shared_ptr<Request> request);
+    void publish(const Finished& finished);
+
+    // render thread only
+    unordered_map<GLuint, Pending> pending;
+    vector<Finished> waiting;  // fenced, not yet signaled
+    GLuint placeholder2D = 0;
+    GLuint placeholderCubemap = 0;
+    GLuint renderPixelBuffer = 0;  // reverses bottom-up slices without an upload thread; freed once the queue drains
+    size_t bytesPerFrame = TEXTURE_STREAMING_BUDGET;
+    size_t bytesLastFrame = 0;
+    size_t bytesTotal = 0;
+
+    // shared with the upload thread
+    mutex lock;
+    condition_variable wake;
+    deque<shared_ptr<Request>> queue;
+    vector<Finished> finished;
+    size_t budget = 0;
+    size_t bytesThisFrame = 0;
+    bool stopping = false;
+    thread uploader;
+
+    // upload thread only
+    GLuint pixelBuffer = 0;
+};
+
+#endif
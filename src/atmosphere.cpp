@@ -0,0 +1,264 @@
+#include "atmosphere.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    // lengths in km
+    const float GROUND_RADIUS = 6360.0f;
+    const float ATMOSPHERE_RADIUS = 6460.0f;
+    const float CAMERA_HEIGHT = 0.2f;
+
+    // per km at sea level
+    const glm::vec3 RAYLEIGH_SCATTERING = glm::vec3(5.802e-3f, 13.558e-3f, 33.1e-3f);
+    const float RAYLEIGH_SCALE_HEIGHT = 8.0f;
+    const float MIE_SCATTERING = 3.996e-3f;
+    const float MIE_EXTINCTION = 4.44e-3f;
+    const float MIE_SCALE_HEIGHT = 1.2f;
+    const float MIE_ASYMMETRY = 0.8f;
+    // ozone only absorbs, in a layer peaking at 25 km
+    const glm::vec3 OZONE_ABSORPTION = glm::vec3(0.650e-3f, 1.881e-3f, 0.085e-3f);
+
+    const int TRANSMITTANCE_STEPS = 40;
+    const int SKY_VIEW_STEPS = 32;
+
+    // the sky-view table covers sun elevation sines from -0.2, deep into twilight, up to the zenith
+    const float SUN_SINE_MIN = -0.2f;
+    // sky.fs scales the table, which holds the radiance for a sun of unit illuminance
+    const float SUN_INTENSITY = 20.0f;
+    const glm::vec3 MOON_COLOR = glm::vec3(0.5f, 0.5f, 0.7f);
+    const float PI = 3.14159265f;
+
+    struct Medium {
+        glm::vec3 rayleighScattering;
+        float mieScattering;
+        glm::vec3 extinction;
+    };
+
+    Medium sampleMedium(float height) {
+        float rayleighDensity = std::exp(-height / RAYLEIGH_SCALE_HEIGHT);
+        float mieDensity = std::exp(-height / MIE_SCALE_HEIGHT);
+        float ozoneDensity = std::max(0.0f, 1.0f - std::fabs(height - 25.0f) / 15.0f);
+        Medium medium;
+        medium.rayleighScattering = RAYLEIGH_SCATTERING * rayleighDensity;
+        medium.mieScattering = MIE_SCATTERING * mieDensity;
+        medium.extinction = medium.rayleighScattering + glm::vec3(MIE_EXTINCTION * mieDensity) + OZONE_ABSORPTION * ozoneDensity;
+        return medium;
+    }
+
+    // distance from radius r along zenith cosine mu to the sphere of the given radius; negative if it is missed
+    float distanceToSphere(float r, float mu, float radius, bool nearSide) {
+        float discriminant = r * r * (mu * mu - 1.0f) + radius * radius;
+        if (discriminant < 0.0f)
+            return -1.0f;
+        float root = std::sqrt(discriminant);
+        return nearSide ? -r * mu - root : -r * mu + root;
+    }
+
+    bool hitsGround(float r, float mu) {
+        return mu < 0.0f && distanceToSphere(r, mu, GROUND_RADIUS, true) > 0.0f;
+    }
+
+    // Bruneton's parameterization: the distance to the top of the atmosphere rather than mu itself, so the
+    // rays grazing the horizon, where transmittance changes fastest, get most of the table
+    glm::vec2 transmittanceCoords(float r, float mu) {
+        float horizon = std::sqrt(ATMOSPHERE_RADIUS * ATMOSPHERE_RADIUS - GROUND_RADIUS * GROUND_RADIUS);
+        float rho = std::sqrt(std::max(r * r - GROUND_RADIUS * GROUND_RADIUS, 0.0f));
+        float distance = std::max(distanceToSphere(r, mu, ATMOSPHERE_RADIUS, false), 0.0f);
+        float distanceMin = ATMOSPHERE_RADIUS - r;
+        float distanceMax = rho + horizon;
+        return glm::vec2((distance - distanceMin) / (distanceMax - distanceMin), rho / horizon);
+    }
+
+    float rayleighPhase(float cosTheta) {
+        return 3.0f / (16.0f * PI) * (1.0f + cosTheta * cosTheta);
+    }
+
+    // Cornette-Shanks
+    float miePhase(float cosTheta) {
+        float g2 = MIE_ASYMMETRY * MIE_ASYMMETRY;
+        float denominator = 1.0f + g2 - 2.0f * MIE_ASYMMETRY * cosTheta;
+        return 3.0f / (8.0f * PI) * (1.0f - g2) * (1.0f + cosTheta * cosTheta)
+            / ((2.0f + g2) * denominator * std::sqrt(denominator));
+    }
+}
+
+Atmosphere::Atmosphere()
+    : timeOfDay(0.0f), transmittanceTexture(0), skyViewTexture(0),
+      transmittanceDone(false), slicesLeft(SKY_VIEW_LUT_DEPTH), cancelled(false) {
+    SetTimeOfDay(12.0f);
+    transmittance.resize(TRANSMITTANCE_LUT_WIDTH * TRANSMITTANCE_LUT_HEIGHT);
+    skyView.resize(SKY_VIEW_LUT_WIDTH * SKY_VIEW_LUT_HEIGHT * SKY_VIEW_LUT_DEPTH);
+
+    // the sky-view slices march through the transmittance table, so they are only queued once it is filled
+    // the tasks submit through the pool itself: the destructor's reset nulls workers before the pool joins
+    workers = std::make_unique<ThreadPool>();
+    ThreadPool* pool = workers.get();
+    pool->Submit([this, pool] {
+        computeTransmittance();
+        transmittanceDone = true;
+        if (cancelled)
+            return;
+        for (int slice = 0; slice < SKY_VIEW_LUT_DEPTH; slice++) {
+            pool->Submit([this, slice] {
+                if (!cancelled)
+                    computeSkyViewSlice(slice);
+                slicesLeft--;
+            });
+        }
+    });
+}
+
+Atmosphere::~Atmosphere() {
+    cancelled = true;
+    workers.reset();
+    GLState::DeleteTexture(transmittanceTexture);
+    GLState::DeleteTexture(skyViewTexture);
+}
+
+void Atmosphere::computeTransmittance() {
+    float horizon = std::sqrt(ATMOSPHERE_RADIUS * ATMOSPHERE_RADIUS - GROUND_RADIUS * GROUND_RADIUS);
+    for (int y = 0; y < TRANSMITTANCE_LUT_HEIGHT; y++) {
+        // inverse of transmittanceCoords at the texel centres
+        float rho = horizon * y / (TRANSMITTANCE_LUT_HEIGHT - 1);
+        float r = std::sqrt(rho * rho + GROUND_RADIUS * GROUND_RADIUS);
+        float distanceMin = ATMOSPHERE_RADIUS - r;
+        float distanceMax = rho + horizon;
+        for (int x = 0; x < TRANSMITTANCE_LUT_WIDTH; x++) {
+            float distance = distanceMin + (distanceMax - distanceMin) * x / (TRANSMITTANCE_LUT_WIDTH - 1);
+            float mu = distance == 0.0f ? 1.0f : (horizon * horizon - rho * rho - distance * distance) / (2.0f * r * distance);
+            mu = glm::clamp(mu, -1.0f, 1.0f);
+
+            glm::vec3 opticalDepth(0.0f);
+            float step = distance / TRANSMITTANCE_STEPS;
+            for (int i = 0; i < TRANSMITTANCE_STEPS; i++) {
+                float t = (i + 0.5f) * step;
+                float height = std::sqrt(r * r + t * t + 2.0f * r * mu * t) - GROUND_RADIUS;
+                opticalDepth += sampleMedium(height).extinction * step;
+            }
+            transmittance[y * TRANSMITTANCE_LUT_WIDTH + x] = glm::exp(-opticalDepth);
+        }
+    }
+}
+
+glm::vec3 Atmosphere::sampleTransmittance(float r, float mu) const {
+    if (hitsGround(r, mu))
+        return glm::vec3(0.0f);
+    glm::vec2 coords = glm::clamp(transmittanceCoords(r, mu), 0.0f, 1.0f);
+    float x = coords.x * (TRANSMITTANCE_LUT_WIDTH - 1);
+    float y = coords.y * (TRANSMITTANCE_LUT_HEIGHT - 1);
+    int x0 = std::min((int)x, TRANSMITTANCE_LUT_WIDTH - 2);
+    int y0 = std::min((int)y, TRANSMITTANCE_LUT_HEIGHT - 2);
+    float fx = x - x0, fy = y - y0;
+    const glm::vec3* row0 = &transmittance[y0 * TRANSMITTANCE_LUT_WIDTH + x0];
+    const glm::vec3* row1 = row0 + TRANSMITTANCE_LUT_WIDTH;
+    return glm::mix(glm::mix(row0[0], row0[1], fx), glm::mix(row1[0], row1[1], fx), fy);
+}
+
+void Atmosphere::computeSkyViewSlice(int slice) {
+    float sunSine = SUN_SINE_MIN + (1.0f - SUN_SINE_MIN) * slice / (SKY_VIEW_LUT_DEPTH - 1);
+    // the sun sits at azimuth 0; the sky is mirror symmetric about its vertical plane, so half the circle will do
+    glm::vec3 sun(std::sqrt(1.0f - sunSine * sunSine), sunSine, 0.0f);
+    glm::vec3 origin(0.0f, GROUND_RADIUS + CAMERA_HEIGHT, 0.0f);
+    glm::vec3* out = &skyView[slice * SKY_VIEW_LUT_WIDTH * SKY_VIEW_LUT_HEIGHT];
+
+    for (int y = 0; y < SKY_VIEW_LUT_HEIGHT; y++) {
+        // squared mapping around the horizon, matched by sky.fs
+        float v = 2.0f * y / (SKY_VIEW_LUT_HEIGHT - 1) - 1.0f;
+        float elevation = (v < 0.0f ? -v * v : v * v) * 0.5f * PI;
+        for (int x = 0; x < SKY_VIEW_LUT_WIDTH; x++) {
+            float azimuth = PI * x / (SKY_VIEW_LUT_WIDTH - 1);
+            glm::vec3 direction(std::cos(elevation) * std::cos(azimuth), std::sin(elevation),
+                                std::cos(elevation) * std::sin(azimuth));
+            float r = origin.y;
+            float mu = direction.y;
+            float length = hitsGround(r, mu) ? distanceToSphere(r, mu, GROUND_RADIUS, true)
+                                             : distanceToSphere(r, mu, ATMOSPHERE_RADIUS, false);
+            float cosTheta = glm::dot(direction, sun);
+            float phaseR = rayleighPhase(cosTheta);
+            float phaseM = miePhase(cosTheta);
+
+            glm::vec3 radiance(0.0f);
+            glm::vec3 throughput(1.0f);
+            float step = length / SKY_VIEW_STEPS;
+            for (int i = 0; i < SKY_VIEW_STEPS; i++) {
+                glm::vec3 position = origin + direction * ((i + 0.5f) * step);
+                float radius = glm::length(position);
+                Medium medium = sampleMedium(radius - GROUND_RADIUS);
+                glm::vec3 sunlight = sampleTransmittance(radius, glm::dot(position, sun) / radius);
+                glm::vec3 scattering = (medium.rayleighScattering * phaseR + glm::vec3(medium.mieScattering * phaseM)) * sunlight;
+                // scattering integrated analytically over the step, so long steps near the horizon do not overshoot
+                glm::vec3 stepTransmittance = glm::exp(-medium.extinction * step);
+                radiance += throughput * (scattering - scattering * stepTransmittance) / medium.extinction;
+                throughput *= stepTransmittance;
+            }
+            out[y * SKY_VIEW_LUT_WIDTH + x] = radiance;
+        }
+    }
+}
+
+void Atmosphere::Update() {
+    if (IsReady() || slicesLeft > 0)
+        return;
+    upload();
+    // every slice is in, so the threads would only idle next to the asset loader's for the rest of the run
+    workers.reset();
+}
+
+void Atmosphere::upload() {
+    glGenTextures(1, &transmittanceTexture);
+    GLState::BindTexture(0, GL_TEXTURE_2D, transmittanceTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, TRANSMITTANCE_LUT_WIDTH, TRANSMITTANCE_LUT_HEIGHT, 0, GL_RGB, GL_FLOAT,
+                 transmittance.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glGenTextures(1, &skyViewTexture);
+    GLState::BindTexture(1, GL_TEXTURE_3D, skyViewTexture);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB16F, SKY_VIEW_LUT_WIDTH, SKY_VIEW_LUT_HEIGHT, SKY_VIEW_LUT_DEPTH, 0, GL_RGB,
+                 GL_FLOAT, skyView.data());
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // the transmittance table stays for GetLightColor
+    std::vector<glm::vec3>().swap(skyView);
+}
+
+void Atmosphere::SetTimeOfDay(float hours) {
+    timeOfDay = std::fmod(std::fmod(hours, 24.0f) + 24.0f, 24.0f);
+    // the sun rises in -x and sets in +x along a path tilted towards +z
+    float angle = (timeOfDay - 6.0f) / 24.0f * 2.0f * PI;
+    sunDirection = glm::normalize(glm::vec3(-std::cos(angle), std::sin(angle) * 0.9f, std::sin(angle) * 0.44f));
+}
+
+glm::vec3 Atmosphere::GetLightDirection() const {
+    // the moon stands opposite the sun; both are faint around the switch, where the sun has just set
+    if (sunDirection.y > -0.05f)
+        return -sunDirection;
+    return sunDirection;
+}
+
+glm::vec3 Atmosphere::GetLightColor() const {
+    float day = glm::smoothstep(-0.05f, 0.1f, sunDirection.y);
+    float night = 1.0f - glm::smoothstep(-0.2f, -0.05f, sunDirection.y);
+    glm::vec3 sunlight(1.0f);
+    if (transmittanceDone)
+        sunlight = sampleTransmittance(GROUND_RADIUS + CAMERA_HEIGHT, std::max(sunDirection.y, 0.0f));
+    // transmittance at noon is about 0.9; the scale brings the midday sun back to the old day light
+    glm::vec3 color = sunlight * 1.1f * day + MOON_COLOR * night;
+    // some sky light is always left between sunset and dark
+    return glm::max(color, glm::vec3(0.05f));
+}
+
+void Atmosphere::Bind(const Shader& shader) const {
+    shader.setInt("transmittance", 0);
+    shader.setInt("skyView", 1);
+    shader.setVec3("sunDirection", sunDirection);
+    shader.setFloat("sunIntensity", SUN_INTENSITY);
+    GLState::BindTexture(0, GL_TEXTURE_2D, transmittanceTexture);
+    GLState::BindTexture(1, GL_TEXTURE_3D, skyViewTexture);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <misc/shader_m.h>
+#include <misc/gl_state.h>
+#include <misc/thread_pool.h>
+
+// lookup table sizes; sky.fs reads them back with textureSize
+const int TRANSMITTANCE_LUT_WIDTH = 256;   // zenith cosine
+const int TRANSMITTANCE_LUT_HEIGHT = 64;   // height above the ground
+const int SKY_VIEW_LUT_WIDTH = 128;        // view azimuth relative to the sun
+const int SKY_VIEW_LUT_HEIGHT = 64;        // view elevation, denser towards the horizon
+const int SKY_VIEW_LUT_DEPTH = 32;         // sun elevation
+
+// Earth-like single scattering atmosphere for the procedural sky. Two lookup tables are precomputed on worker
+// threads when it is constructed: the transmittance from any height towards the top of the atmosphere, and the
+// sky radiance seen from the ground for every view direction at a range of sun elevations. Update uploads
+// them once they are done; from then on sky.fs only samples them, so the time of day can change every frame.
+class Atmosphere {
+public:
+    Atmosphere();
+    ~Atmosphere();
+
+    // GL thread, once per frame: uploads the tables as soon as the workers have finished them
+    void Update();
+    bool IsReady() const { return skyViewTexture != 0; }
+
+    // hours in [0, 24): sunrise at 6, noon at 12, sunset at 18
+    void SetTimeOfDay(float hours);
+    float GetTimeOfDay() const { return timeOfDay; }
+    // unit vector towards the sun
+    glm::vec3 GetSunDirection() const { return sunDirection; }
+    // the directional light for the scene: sunlight dimmed by the air in front of it by day, moonlight by night
+    glm::vec3 GetLightDirection() const;
+    glm::vec3 GetLightColor() const;
+
+    // binds both tables and sets the sun uniforms of sky.fs
+    void Bind(const Shader& shader) const;
+
+private:
+    // transmittance at radius r (km from the planet's centre) towards zenith cosine mu, from the table
+    glm::vec3 sampleTransmittance(float r, float mu) const;
+    void computeTransmittance();
+    void computeSkyViewSlice(int slice);
+    void upload();
+
+    float timeOfDay;
+    glm::vec3 sunDirection;
+    GLuint transmittanceTexture;
+    GLuint skyViewTexture;
+
+    // written by the workers, read once the counters say they are complete
+    std::vector<glm::vec3> transmittance;
+    std::vector<glm::vec3> skyView;
+    std::atomic<bool> transmittanceDone;
+    std::atomic<int> slicesLeft;
+    std::atomic<bool> cancelled;
+    // last, so it is joined before the tables it writes go away
+    std::unique_ptr<ThreadPool> workers;
+};
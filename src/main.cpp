@@ -10,12 +10,21 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <misc/shader_m.h>
+#include <misc/gl_state.h>
 #include <misc/camera.h>
 #include <misc/model.h>
+#include <misc/bvh.h>
+#include <misc/software_occlusion.h>
+#include <misc/render_queue.h>
 
 #include <iostream>
+#include <chrono>
 #include "plane.h"
 #include "skybox.h"
+#include "atmosphere.h"
+#include "uniform_blocks.h"
+#include "shader_permutations.h"
+#include "occlusion_queries.h"
 
 enum CameraMode {
     FREE_CAMERA,
@@ -30,19 +39,43 @@ enum ShadingMode {
     GOURAUD_SHADING
 };
 
+// render queue passes, drawn in this order
+enum RenderPass {
+    SCENE_PASS,            // the scene, which occludes everything after it
+    OCCLUSION_QUERY_PASS,  // proxies of the jet and the Bezier surface against the scene's depth
+    OCCLUDEE_PASS,         // the jet and the Bezier surface, conditional on those queries
+    CHUNK_QUERY_PASS,      // proxies of the scene chunks, read back in later frames
+    SKY_PASS,
+    OVERLAY_PASS
+};
+
+enum OcclusionMode {
+    NO_OCCLUSION,
+    GPU_OCCLUSION_QUERIES,
+    CPU_OCCLUSION_RASTER
+};
+
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void processInput(GLFWwindow* window);
 void UpdateCameraPosition(CameraMode mode, Plane& plane);
 void SetupImGui(GLFWwindow* window);
-void RenderImGui(Skybox& skybox, std::vector<std::string>& dayFaces, std::vector<std::string>& nightFaces);
+void RenderImGui(Skybox& skybox, Atmosphere& atmosphere, const UniformBlocks& uniformBlocks, const GeometryArena& geometryArena,
+                 const FrustumCuller& culler, const OcclusionQueries& occlusion, const SoftwareOcclusion& softwareOcclusion,
+                 const RenderQueue& renderQueue, size_t shaderVariantCount);
 void InitializeBezierSurface(GLuint& bezierVAO, GLuint& bezierVBO);
-void RenderBezierSurface(GLuint bezierVAO, GLuint bezierVBO, Shader& bezierShader, float currentFrame, Camera& camera);
+void RenderBezierSurface(GLuint bezierVAO, GLuint bezierVBO, Shader& bezierShader, float currentFrame);
+glm::mat4 BezierSurfaceModel();
+void UnionBounds(const FrustumCuller& culler, unsigned int first, unsigned int count, glm::vec3& boundsMin, glm::vec3& boundsMax);
+LightingBlock BuildLightingBlock();
+ShaderVariant CurrentShaderVariant(bool vertexColors = false);
 
 bool cursorEnabled = false;
-enum SkyboxType { DAY, NIGHT };
+enum SkyboxType { DAY, NIGHT, PROCEDURAL };
 SkyboxType currentSkybox = DAY;
+float skyCrossfadeSeconds = 1.0f;
+float dayCycleSpeed = 0.0f; // in-game hours per second for the procedural sky
 
 // settings
 const unsigned int SCR_WIDTH = 800;
@@ -59,6 +92,19 @@ bool firstMouse = true;
 // timing
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
+float timeToFirstFrame = 0.0f;
+
+// BVH queries, shown in the control panel; -1 when the ray hits nothing
+float pickDistance = -1.0f;
+float planeClearance = -1.0f;
+double bvhRaysPerSecond = 0.0;
+
+// occlusion culling of the jet, the Bezier surface and the scene's chunks
+OcclusionMode occlusionMode = GPU_OCCLUSION_QUERIES;
+// largest scene triangles rasterized as occluders by the CPU
+const size_t MAX_OCCLUDER_TRIANGLES = 8192;
+// both models only look up flat colours in tiny palettes; baking them into the vertices drops the texture fetch
+const bool BAKE_PALETTES = true;
 
 const glm::vec3 BEHIND_PLANE_OFFSET = glm::vec3(0.0f, 2.0f, -5.0f);
 const glm::vec3 SCENE_CAMERA_POSITION = glm::vec3(0.0f, 25.0f, 25.0f);
@@ -94,6 +140,9 @@ glm::vec3 underPlaneSpotLightColor = glm::vec3(1.0f, 0.2f, 0.2f);
 float underPlaneSpotLightPitch = 0.0f;
 float underPlaneSpotLightRoll = 0.0f;
 
+// street lights 1 and 2, plane front light, under-plane light
+bool spotLightEnabled[SPOT_LIGHT_COUNT] = { true, true, true, true };
+
 bool animateControlPoints = false;
 bool showBezierSurface = false;
 float animationSpeed = 0.5f;
@@ -126,6 +175,8 @@ std::vector<std::string> nightFaces = {
 
 int main()
 {
+    auto startupBegin = std::chrono::high_resolution_clock::now();
+
     // glfw: initialize and configure
     // ------------------------------
     glfwInit();
@@ -159,33 +210,186 @@ int main()
     // configure global opengl state
     // -----------------------------
     glEnable(GL_DEPTH_TEST);
+    GLState::DepthFunc(GL_LEQUAL); // shared by the scene and the skybox
     SetupImGui(window);
+    // texture pixels are uploaded from a second thread on a hidden context sharing this one's objects
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* uploadWindow = glfwCreateWindow(1, 1, "", NULL, window);
+    if (uploadWindow != NULL)
+        TextureStreamer::Get().Start([uploadWindow] { glfwMakeContextCurrent(uploadWindow); }, [] { glfwMakeContextCurrent(NULL); });
+    else
+        std::cout << "Failed to create the texture upload context, streaming on the render thread" << std::endl;
 
     GLuint bezierVAO, bezierVBO;
     InitializeBezierSurface(bezierVAO, bezierVBO);
 
-    // Load shaders and models
-    Shader phongShader("src/shaders/phong.vs", "src/shaders/phong.fs");
-    Shader gouraudShader("src/shaders/gouraud.vs", "src/shaders/gouraud.fs");
-    Shader flatShader("src/shaders/flat.vs", "src/shaders/flat.fs");
-    Shader bezierShader("src/shaders/bezier.vs", "src/shaders/bezier.fs", "src/shaders/bezier.tcs", "src/shaders/bezier.tes");
-    Shader skyboxShader("src/shaders/skybox.vs", "src/shaders/skybox.fs");
-    Skybox skybox(dayFaces);
-    Model sceneModel("resources/objects/winter/source/scene/winterScene.obj");
-    Model planeModel("resources/objects/plane/source/Jet/Jet.obj");
+    // Load shaders and models; the driver compiles the programs while the assets are being read
+    // scene programs are specialized per frame, indexed by ShadingMode
+    ShaderPermutations sceneShaders[] = {
+        ShaderPermutations("src/shaders/flat.vs", "src/shaders/flat.fs"),
+        ShaderPermutations("src/shaders/phong.vs", "src/shaders/phong.fs"),
+        ShaderPermutations("src/shaders/gouraud.vs", "src/shaders/gouraud.fs")
+    };
+    for (ShaderPermutations& permutations : sceneShaders)
+        permutations.Prepare(CurrentShaderVariant(BAKE_PALETTES));
+    Shader bezierShader = Shader::Submit("src/shaders/bezier.vs", "src/shaders/bezier.fs", "src/shaders/bezier.tcs", "src/shaders/bezier.tes");
+    Shader skyboxShader = Shader::Submit("src/shaders/skybox.vs", "src/shaders/skybox.fs");
+    Shader skyShader = Shader::Submit("src/shaders/skybox.vs", "src/shaders/sky.fs");
+    Shader proxyShader = Shader::Submit("src/shaders/proxy.vs", "src/shaders/proxy.fs");
+    // the scattering tables are computed on their own workers alongside the asset loading
+    Atmosphere atmosphere;
+    // assets are imported and decoded on worker threads; this thread only uploads what they hand back
+    AssetLoader assetLoader;
+    // all skies stay resident, in SkyboxType order
+    Skybox skybox;
+    skybox.AddSkySet("Day", dayFaces, glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(1.0f, 1.0f, 0.9f), &assetLoader);
+    skybox.AddSkySet("Night", nightFaces, glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.5f, 0.5f, 0.7f), &assetLoader);
+    skybox.AddProceduralSky("Procedural", atmosphere, skyShader);
+    Model sceneModel("resources/objects/winter/source/scene/winterScene.obj", assetLoader, false, BAKE_PALETTES);
+    Model planeModel("resources/objects/plane/source/Jet/Jet.obj", assetLoader, false, BAKE_PALETTES);
     Plane plane(6.0f, 1.0f, planeModel);
+    assetLoader.Finish();
+    assetLoader.PrintTimings();
+    TextureCache::Stats textureStats = TextureCache::Get().GetStats();
+    std::cout << "Texture cache: " << textureStats.textures << " textures, " << textureStats.sharedRefs << " shared references, "
+              << textureStats.duplicateFiles << " duplicate files, " << textureStats.bytesUploaded / 1024 << " KB uploaded, "
+              << textureStats.bytesSaved / 1024 << " KB saved" << std::endl;
+    // both models share one vertex/index arena
+    GeometryArena geometryArena;
+    sceneModel.UseArena(geometryArena);
+    planeModel.UseArena(geometryArena);
+    geometryArena.Build();
+    // every mesh of both models gets a bound, tested against the view frustum once per frame
+    FrustumCuller culler;
+    sceneModel.UseCuller(culler);
+    planeModel.UseCuller(culler);
+    // ray and collision queries: the scene is static, the jet's hierarchy is refitted as it flies
+    BVH sceneBVH, planeBVH;
+    // the CPU occlusion rasterizer draws the scene's largest triangles; the scene model is not moved
+    SoftwareOcclusion softwareOcclusion;
+    {
+        vector<glm::vec3> triangles;
+        sceneModel.CollectTriangles(triangles);
+        sceneBVH.Build(triangles);
+        softwareOcclusion.SetOccluders(SoftwareOcclusion::SelectOccluders(triangles, MAX_OCCLUDER_TRIANGLES));
+        triangles.clear();
+        planeModel.CollectTriangles(triangles);
+        planeBVH.Build(triangles);
+    }
+    unsigned int bvhRayHits = 0;
+    bvhRaysPerSecond = sceneBVH.MeasureRaysPerSecond(100000, bvhRayHits);
+    std::cout << "BVH: " << sceneBVH.GetTriangleCount() << " scene triangles in " << sceneBVH.GetNodeCount() << " nodes, built in "
+              << sceneBVH.GetBuildMs() << " ms, " << bvhRaysPerSecond / 1e6 << " M rays/s (" << bvhRayHits << " of 100000 hit)" << std::endl;
+
+    auto shaderWaitBegin = std::chrono::high_resolution_clock::now();
+    for (ShaderPermutations& permutations : sceneShaders)
+        permutations.FinishAll();
+    bezierShader.finish();
+    skyboxShader.finish();
+    skyShader.finish();
+    proxyShader.finish();
+    float shaderWaitMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - shaderWaitBegin).count();
+    const Shader::ProgramCacheStats& programCache = Shader::ProgramCache();
+    std::cout << "Shader cache: " << programCache.hits << " hits, " << programCache.misses << " misses, "
+              << programCache.msSaved << " ms saved" << std::endl;
+    std::cout << "Shaders: waited " << shaderWaitMs << " ms after asset loading"
+              << (GLAD_GL_KHR_parallel_shader_compile ? " (parallel compile)" : "") << std::endl;
+    UniformBlocks uniformBlocks;
+    UniformBlocks::Bind(bezierShader);
+    UniformBlocks::Bind(proxyShader);
+
+    // one occludee per scene mesh, then the jet as a whole and the Bezier surface
+    OcclusionQueries occlusion(proxyShader);
+    vector<unsigned int> chunkQueries(sceneModel.meshes.size());
+    for (unsigned int& query : chunkQueries)
+        query = occlusion.Add();
+    vector<unsigned char> chunkInFrustum(sceneModel.meshes.size());
+    unsigned int planeQuery = occlusion.Add();
+    unsigned int bezierQuery = occlusion.Add();
+    int frameIndex = 0;
+
+    // per-frame state the queued draws read when the queue is flushed
+    float currentFrame = 0.0f;
+    glm::mat4 view(1.0f), projection(1.0f);
+    Shader* activeShader = nullptr;
+    Shader* planeShader = nullptr;
+    unsigned int firstChunk = sceneModel.GetFirstBound();
+    bool planeVisible = false, bezierVisible = false;
+    glm::vec3 planeBoundsMin(0.0f), planeBoundsMax(0.0f), surfaceBoundsMin(0.0f), surfaceBoundsMax(0.0f);
+
+    // every draw of a frame goes through the queue; the scene submits a command per chunk, the rest one each
+    RenderQueue renderQueue;
+    sceneModel.UseQueue(renderQueue);
+    unsigned int occlusionQuerySource = renderQueue.AddSource([&](const RenderCommand*, size_t) {
+        occlusion.BeginProxies();
+        if (planeVisible)
+            occlusion.Query(planeQuery, planeBoundsMin, planeBoundsMax, camera.Position);
+        if (bezierVisible)
+            occlusion.Query(bezierQuery, surfaceBoundsMin, surfaceBoundsMax, camera.Position);
+        occlusion.EndProxies();
+    });
+    unsigned int planeSource = renderQueue.AddSource([&](const RenderCommand*, size_t) {
+        bool useQueries = occlusionMode == GPU_OCCLUSION_QUERIES;
+        planeShader->use();
+        if (useQueries)
+            occlusion.BeginConditional(planeQuery);
+        plane.Draw(*planeShader);
+        if (useQueries)
+            occlusion.EndConditional(planeQuery);
+    });
+    unsigned int bezierSource = renderQueue.AddSource([&](const RenderCommand*, size_t) {
+        bool useQueries = occlusionMode == GPU_OCCLUSION_QUERIES;
+        if (useQueries)
+            occlusion.BeginConditional(bezierQuery);
+        RenderBezierSurface(bezierVAO, bezierVBO, bezierShader, currentFrame);
+        if (useQueries)
+            occlusion.EndConditional(bezierQuery);
+    });
+    // every chunk in the frustum, drawn or not, is tested against the finished depth buffer for the next frames
+    unsigned int chunkQuerySource = renderQueue.AddSource([&](const RenderCommand*, size_t) {
+        occlusion.BeginProxies();
+        for (unsigned int i = 0; i < chunkQueries.size(); i++) {
+            if (!chunkInFrustum[i])
+                continue;
+            glm::vec3 boundsMin, boundsMax;
+            culler.GetBounds(firstChunk + i, boundsMin, boundsMax);
+            occlusion.Query(chunkQueries[i], boundsMin, boundsMax, camera.Position);
+        }
+        occlusion.EndProxies();
+    });
+    unsigned int skySource = renderQueue.AddSource([&](const RenderCommand*, size_t) {
+        skybox.Draw(skyboxShader, view, projection);
+    });
+    unsigned int overlaySource = renderQueue.AddSource([](const RenderCommand*, size_t) {
+        ImGui::Render();
+        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    });
 
     // render loop
+    bool firstFrame = true;
     while (!glfwWindowShouldClose(window)) {
-        float currentFrame = static_cast<float>(glfwGetTime());
+        currentFrame = static_cast<float>(glfwGetTime());
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
+        Shader::Stats() = Shader::UniformStats();
+        uniformBlocks.ResetStats();
+        GLState::Stats() = GLState::Counters();
+        TextureStreamer::Get().Update();
 
         // Process input
         processInput(window);
 
+        // the directional light follows the sky, crossfade and time of day included
+        atmosphere.Update();
+        if (dayCycleSpeed > 0.0f)
+            atmosphere.SetTimeOfDay(atmosphere.GetTimeOfDay() + deltaTime * dayCycleSpeed);
+        skybox.Update(deltaTime);
+        lightDir = skybox.GetLightDirection();
+        lightColor = skybox.GetLightColor();
+
         // Update the plane's position
         plane.Update(currentFrame);
+        planeBVH.Refit(plane.GetModelMatrix());
         glm::vec3 forwardDir = plane.GetDirection();
         glm::vec3 upDir = plane.GetUpDirection();
         glm::vec3 planePosition = plane.GetPosition();
@@ -215,69 +419,103 @@ int main()
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
-        if (showBezierSurface) {
-            RenderBezierSurface(bezierVAO, bezierVBO, bezierShader, currentFrame, camera);
+        // Per-frame camera and lighting state, shared by all scene programs through uniform buffers
+        projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+        view = camera.GetViewMatrix();
+        CameraBlock cameraBlock = {};
+        cameraBlock.view = view;
+        cameraBlock.projection = projection;
+        cameraBlock.viewPos = camera.Position;
+        uniformBlocks.Update(BuildLightingBlock(), cameraBlock);
+        culler.Cull(camera.GetFrustum(projection));
+        occlusion.BeginFrame(frameIndex++);
+        for (unsigned int i = 0; i < chunkQueries.size(); i++)
+            chunkInFrustum[i] = culler.IsVisible(firstChunk + i);
+        unsigned int firstPlaneBound = planeModel.GetFirstBound();
+        unsigned int planeBoundCount = (unsigned int)planeModel.meshes.size();
+        planeVisible = false;
+        for (unsigned int i = 0; i < planeBoundCount; i++)
+            planeVisible = planeVisible || culler.IsVisible(firstPlaneBound + i);
+        UnionBounds(culler, firstPlaneBound, planeBoundCount, planeBoundsMin, planeBoundsMax);
+        // the surface stays inside its control points' hull, whose z is kept within [-1, 1]
+        glm::mat4 surfaceModel = BezierSurfaceModel();
+        glm::vec3 surfaceCorner0 = glm::vec3(surfaceModel * glm::vec4(0.0f, 0.0f, -1.0f, 1.0f));
+        glm::vec3 surfaceCorner1 = glm::vec3(surfaceModel * glm::vec4(1.0f, 1.0f, 1.0f, 1.0f));
+        surfaceBoundsMin = glm::min(surfaceCorner0, surfaceCorner1);
+        surfaceBoundsMax = glm::max(surfaceCorner0, surfaceCorner1);
+        bezierVisible = showBezierSurface;
+
+        if (occlusionMode == GPU_OCCLUSION_QUERIES) {
+            // scene chunks are skipped on the CPU by the result read back from an earlier frame; one that comes
+            // back into view shows up a frame late, which is what keeps the readback from ever stalling
+            for (unsigned int i = 0; i < chunkQueries.size(); i++) {
+                if (chunkInFrustum[i] && !occlusion.WasVisible(chunkQueries[i]))
+                    culler.Hide(firstChunk + i);
+            }
         }
-
-        // Set shaders and matrices
-        Shader* activeShader = nullptr;
-        switch (currentShadingMode) {
-        case PHONG_SHADING:
-            activeShader = &phongShader;
-            break;
-        case GOURAUD_SHADING:
-            activeShader = &gouraudShader;
-            break;
-        case FLAT_SHADING:
-            activeShader = &flatShader;
-            break;
-        }        
-        activeShader->use();
-
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-        glm::mat4 view = camera.GetViewMatrix();
-        activeShader->setMat4("projection", projection);
-        activeShader->setMat4("view", view);
-        activeShader->setVec3("lightDirection", lightDir);
-        activeShader->setVec3("lightColor", lightColor);
-        activeShader->setVec3("viewPos", camera.Position);
-        activeShader->setVec3("fogColor", fogColor);
-        activeShader->setFloat("fogIntensity", fogIntensity);
-        activeShader->setVec3("spotLight1Pos", spotLight1Pos);
-        activeShader->setVec3("spotLight1Dir", spotLightDir);
-        activeShader->setVec3("spotLight2Pos", spotLight2Pos);
-        activeShader->setVec3("spotLight2Dir", spotLightDir);
-        activeShader->setVec3("spotLightColor", spotLightColor);
-        activeShader->setFloat("spotLightCutOff", spotLightCutOff);
-        activeShader->setFloat("spotLightOuterCutOff", spotLightOuterCutOff);
-        activeShader->setVec3("planeSpotLightPos", planeSpotLightPos);
-        activeShader->setVec3("planeSpotLightDir", planeSpotLightDir);
-        activeShader->setVec3("planeSpotLightColor", planeSpotLightColor);
-        activeShader->setFloat("planeSpotLightCutOff", planeSpotLightCutOff);
-        activeShader->setFloat("planeSpotLightOuterCutOff", planeSpotLightOuterCutOff);
-        activeShader->setVec3("underPlaneSpotLightPos", underPlaneSpotLightPos);
-        activeShader->setVec3("underPlaneSpotLightDir", underPlaneSpotLightDir);
-        activeShader->setVec3("underPlaneSpotLightColor", underPlaneSpotLightColor);
-        activeShader->setFloat("underPlaneSpotLightCutOff", underPlaneSpotLightCutOff);
-        activeShader->setFloat("underPlaneSpotLightOuterCutOff", underPlaneSpotLightOuterCutOff);
-        activeShader->setFloat("constant", 1.0f);
-        activeShader->setFloat("linear", 0.09f);
-        activeShader->setFloat("quadratic", 0.032f);
-
-        glm::mat4 model = glm::mat4(1.0f);
-        activeShader->setMat4("model", model);
-        sceneModel.Draw(*activeShader);
-        
-        plane.Draw(*activeShader);
-        if (fogIntensity == 0.0f) {
-            skybox.Draw(skyboxShader, camera.GetViewMatrix(), projection);
+        else if (occlusionMode == CPU_OCCLUSION_RASTER) {
+            // the occluders are rasterized on the CPU for this very frame, so everything is tested before it is
+            // submitted and nothing waits on the GPU
+            softwareOcclusion.Render(projection * view);
+            for (unsigned int i = 0; i < chunkQueries.size(); i++) {
+                if (!chunkInFrustum[i])
+                    continue;
+                glm::vec3 boundsMin, boundsMax;
+                culler.GetBounds(firstChunk + i, boundsMin, boundsMax);
+                if (softwareOcclusion.IsOccluded(boundsMin, boundsMax))
+                    culler.Hide(firstChunk + i);
+            }
+            if (planeVisible && softwareOcclusion.IsOccluded(planeBoundsMin, planeBoundsMax))
+                planeVisible = false;
+            if (bezierVisible && softwareOcclusion.IsOccluded(surfaceBoundsMin, surfaceBoundsMax))
+                bezierVisible = false;
         }
 
-        RenderImGui(skybox, dayFaces, nightFaces);
-        ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        // what the camera looks at, and how high the jet flies above the ground below it
+        RayHit hit;
+        pickDistance = -1.0f;
+        if (sceneBVH.Raycast(camera.Position, camera.Front, 100.0f, hit))
+            pickDistance = hit.distance;
+        if (planeBVH.Raycast(camera.Position, camera.Front, pickDistance < 0.0f ? 100.0f : pickDistance, hit))
+            pickDistance = hit.distance;
+        planeClearance = -1.0f;
+        if (sceneBVH.Raycast(planePosition, glm::vec3(0.0f, -1.0f, 0.0f), 100.0f, hit))
+            planeClearance = hit.distance;
+
+        // Set shaders and matrices; the variant matches the lights and fog currently switched on, and each model's colour source
+        activeShader = &sceneShaders[currentShadingMode].Get(CurrentShaderVariant(sceneModel.HasVertexColors()));
+        planeShader = &sceneShaders[currentShadingMode].Get(CurrentShaderVariant(planeModel.HasVertexColors()));
+        sceneModel.Submit(SCENE_PASS, *activeShader, glm::mat4(1.0f), camera.Position);
+
+        // with queries the scene is the occluder: the jet and the Bezier surface test their bounds against its
+        // depth and are drawn under conditional rendering, which the GPU resolves without the CPU waiting
+        bool useQueries = occlusionMode == GPU_OCCLUSION_QUERIES;
+        if (useQueries && (planeVisible || bezierVisible))
+            renderQueue.Submit(RenderQueue::MakeKey(OCCLUSION_QUERY_PASS, proxyShader.ID, 0, 0.0f), occlusionQuerySource);
+        if (planeVisible)
+            renderQueue.Submit(RenderQueue::MakeKey(OCCLUDEE_PASS, planeShader->ID, 0, glm::length(planePosition - camera.Position)), planeSource);
+        if (bezierVisible) {
+            glm::vec3 surfaceCenter = (surfaceBoundsMin + surfaceBoundsMax) * 0.5f;
+            renderQueue.Submit(RenderQueue::MakeKey(OCCLUDEE_PASS, bezierShader.ID, 0, glm::length(surfaceCenter - camera.Position)), bezierSource);
+        }
+        if (useQueries)
+            renderQueue.Submit(RenderQueue::MakeKey(CHUNK_QUERY_PASS, proxyShader.ID, 0, 0.0f), chunkQuerySource);
+        if (fogIntensity == 0.0f)
+            renderQueue.Submit(RenderQueue::MakeKey(SKY_PASS, 0, 0, 0.0f), skySource);
+
+        size_t shaderVariantCount = 0;
+        for (const ShaderPermutations& permutations : sceneShaders)
+            shaderVariantCount += permutations.GetVariantCount();
+        RenderImGui(skybox, atmosphere, uniformBlocks, geometryArena, culler, occlusion, softwareOcclusion, renderQueue, shaderVariantCount);
+        renderQueue.Submit(RenderQueue::MakeKey(OVERLAY_PASS, 0, 0, 0.0f), overlaySource);
+        renderQueue.Flush();
 
         glfwSwapBuffers(window);
+        if (firstFrame) {
+            timeToFirstFrame = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startupBegin).count();
+            std::cout << "Time to first frame: " << timeToFirstFrame << " ms" << std::endl;
+            firstFrame = false;
+        }
         glfwPollEvents();
     }
 
@@ -285,6 +523,9 @@ int main()
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
+    TextureStreamer::Get().Stop();
+    if (uploadWindow != NULL)
+        glfwDestroyWindow(uploadWindow);
     glfwTerminate();
     return 0;
 }
@@ -413,25 +654,27 @@ void SetupImGui(GLFWwindow* window) {
     ImGui_ImplOpenGL3_Init("#version 330");
 }
 
-void RenderImGui(Skybox& skybox, std::vector<std::string>& dayFaces, std::vector<std::string>& nightFaces) {
+void RenderImGui(Skybox& skybox, Atmosphere& atmosphere, const UniformBlocks& uniformBlocks, const GeometryArena& geometryArena,
+                 const FrustumCuller& culler, const OcclusionQueries& occlusion, const SoftwareOcclusion& softwareOcclusion,
+                 const RenderQueue& renderQueue, size_t shaderVariantCount) {
     ImGui::Begin("Control Panel");
     ImGui::Text("Press 'P' to toggle cursor control.");
 
-    const char* skyboxItems[] = { "Day", "Night" };
+    const char* skyboxItems[] = { "Day", "Night", "Procedural" };
     int currentSkyboxIndex = static_cast<int>(currentSkybox);
     if (ImGui::Combo("Skybox", &currentSkyboxIndex, skyboxItems, IM_ARRAYSIZE(skyboxItems))) {
-        if (currentSkyboxIndex == DAY && currentSkybox != DAY) {
-            lightDir = glm::normalize(glm::vec3(0.0f, -1.0f, 0.0f));
-            lightColor = glm::vec3(1.0f, 1.0f, 0.9f);
-            currentSkybox = DAY;
-            skybox.SwitchTextures(dayFaces);
-        }
-        else if (currentSkyboxIndex == NIGHT && currentSkybox != NIGHT) {
-            lightDir = glm::normalize(glm::vec3(0.0f, -1.0f, 0.0f));
-            lightColor = glm::vec3(0.5f, 0.5f, 0.7f);
-            currentSkybox = NIGHT;
-            skybox.SwitchTextures(nightFaces);
-        }
+        // every sky is resident, so this only swaps handles
+        currentSkybox = static_cast<SkyboxType>(currentSkyboxIndex);
+        skybox.Select(currentSkyboxIndex, skyCrossfadeSeconds);
+    }
+    ImGui::SliderFloat("Sky Crossfade (s)", &skyCrossfadeSeconds, 0.0f, 3.0f);
+    if (currentSkybox == PROCEDURAL) {
+        float timeOfDay = atmosphere.GetTimeOfDay();
+        if (ImGui::SliderFloat("Time of Day", &timeOfDay, 0.0f, 24.0f, "%.2f h"))
+            atmosphere.SetTimeOfDay(timeOfDay);
+        ImGui::SliderFloat("Day Cycle Speed (h/s)", &dayCycleSpeed, 0.0f, 2.0f);
+        if (!atmosphere.IsReady())
+            ImGui::Text("Atmosphere: computing scattering tables...");
     }
 
     const char* cameraModes[] = { "Free Camera", "Behind Plane Camera", "Scene Camera", "Static Tracking Camera" };
@@ -449,6 +692,48 @@ void RenderImGui(Skybox& skybox, std::vector<std::string>& dayFaces, std::vector
     ImGui::ColorEdit3("Fog Color", glm::value_ptr(fogColor));
     ImGui::SliderFloat("Fog Intensity", &fogIntensity, 0.0f, 1.0f);
     ImGui::Text("Camera Position: X: %.2f, Y: %.2f, Z: %.2f", camera.Position.x, camera.Position.y, camera.Position.z);
+    const Shader::UniformStats& uniformStats = Shader::Stats();
+    ImGui::Text("Uniforms: %u uploaded, %u skipped, %u location lookups", uniformStats.uploads, uniformStats.uploadsSkipped, uniformStats.lookups);
+    ImGui::Text("Uniform buffers: %u bytes uploaded", uniformBlocks.GetBytesUploaded());
+    ImGui::Text("GL state changes: %u issued, %u filtered", GLState::Stats().issued, GLState::Stats().filtered);
+    ImGui::Text("Geometry arena: %u meshes in %u draws", geometryArena.GetMeshCount(), geometryArena.GetDrawCount());
+    ImGui::Text("Materials: %u, sampling %u texture units", MaterialLibrary::Get().GetCount(), MaterialLibrary::Get().GetUnitCount());
+    const RenderQueue::Stats& queueStats = renderQueue.GetStats();
+    ImGui::Text("Render queue: %u commands in %u runs, sorted in %.3f ms", queueStats.commands, queueStats.runs, queueStats.sortMs);
+    const FrustumCuller::Stats& cullStats = culler.GetStats();
+    ImGui::Text("Frustum culling: %u visible, %u culled (%.3f ms)", cullStats.visible, cullStats.culled, cullStats.cullMs);
+    const char* occlusionModes[] = { "Off", "GPU Queries", "CPU Raster" };
+    int occlusionModeIndex = static_cast<int>(occlusionMode);
+    if (ImGui::Combo("Occlusion Culling", &occlusionModeIndex, occlusionModes, IM_ARRAYSIZE(occlusionModes))) {
+        occlusionMode = static_cast<OcclusionMode>(occlusionModeIndex);
+    }
+    if (occlusionMode == GPU_OCCLUSION_QUERIES) {
+        const OcclusionQueries::Stats& occlusionStats = occlusion.GetStats();
+        ImGui::Text("Occlusion queries: %u issued, %u hidden, %u chunks skipped", occlusionStats.queries, occlusionStats.hidden, cullStats.occluded);
+    }
+    else if (occlusionMode == CPU_OCCLUSION_RASTER) {
+        const SoftwareOcclusion::Stats& occlusionStats = softwareOcclusion.GetStats();
+        float culledPercent = occlusionStats.tested > 0 ? 100.0f * occlusionStats.occluded / occlusionStats.tested : 0.0f;
+        ImGui::Text("Occlusion raster: %u triangles in %.2f ms, %u of %u culled (%.0f%%), tests %.3f ms", occlusionStats.occluders,
+                    occlusionStats.rasterMs, occlusionStats.occluded, occlusionStats.tested, culledPercent, occlusionStats.testMs);
+    }
+    ImGui::Text("BVH: looking at %.2f, plane %.2f above ground, %.2f M rays/s", pickDistance, planeClearance, bvhRaysPerSecond / 1e6);
+    TextureCache::Stats textureStats = TextureCache::Get().GetStats();
+    ImGui::Text("Texture cache: %u textures, %u KB uploaded, %u KB saved", textureStats.textures,
+                (unsigned int)(textureStats.bytesUploaded / 1024), (unsigned int)(textureStats.bytesSaved / 1024));
+    TextureStreamer::Stats streamingStats = TextureStreamer::Get().GetStats();
+    ImGui::Text("Texture streaming: %u pending, %u KB last frame", streamingStats.pending, (unsigned int)(streamingStats.bytesLastFrame / 1024));
+    const Shader::ProgramCacheStats& programCache = Shader::ProgramCache();
+    ShaderVariant variant = CurrentShaderVariant();
+    ImGui::Text("Shader variant: %d spot lights, fog %s (%u compiled)", variant.spotLightCount, variant.fogEnabled ? "on" : "off", (unsigned int)shaderVariantCount);
+    ImGui::Text("Time to first frame: %.0f ms", timeToFirstFrame);
+    ImGui::Text("Shader cache: %u hits, %u misses, %.1f ms saved", programCache.hits, programCache.misses, programCache.msSaved);
+    ImGui::Checkbox("Street Light 1", &spotLightEnabled[0]);
+    ImGui::SameLine();
+    ImGui::Checkbox("Street Light 2", &spotLightEnabled[1]);
+    ImGui::Checkbox("Plane Front Light", &spotLightEnabled[2]);
+    ImGui::SameLine();
+    ImGui::Checkbox("Under Plane Light", &spotLightEnabled[3]);
     ImGui::SliderFloat("Move Under Light Front-Back", &underPlaneSpotLightPitch, -90.0f, 90.0f, "%.1f degrees"); // Controls the pitch (up and down)
     ImGui::SliderFloat("Move Under Light Left-Right", &underPlaneSpotLightRoll, -180.0f, 180.0f, "%.1f degrees"); // Controls the roll (tilting left and right)
     ImGui::Checkbox("Show Bezier Surface", &showBezierSurface);
@@ -472,63 +757,87 @@ void InitializeBezierSurface(GLuint& bezierVAO, GLuint& bezierVBO) {
     glGenVertexArrays(1, &bezierVAO);
     glGenBuffers(1, &bezierVBO);
 
-    glBindVertexArray(bezierVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, bezierVBO);
+    GLState::BindVertexArray(bezierVAO);
+    GLState::BindBuffer(GL_ARRAY_BUFFER, bezierVBO);
 
     glBufferData(GL_ARRAY_BUFFER, sizeof(controlPoints), controlPoints, GL_DYNAMIC_DRAW);
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glBindVertexArray(0);
 }
 
-void RenderBezierSurface(GLuint bezierVAO, GLuint bezierVBO, Shader& bezierShader, float currentFrame, Camera& camera) {
+void RenderBezierSurface(GLuint bezierVAO, GLuint bezierVBO, Shader& bezierShader, float currentFrame) {
     if (animateControlPoints) {
         for (int i = 0; i < 16; ++i) {
             controlPoints[i].z = sin(currentFrame * animationSpeed + i) * 1.0f;
         }
     }
-    glBindBuffer(GL_ARRAY_BUFFER, bezierVBO);
+    GLState::BindBuffer(GL_ARRAY_BUFFER, bezierVBO);
     glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(controlPoints), controlPoints);
 
     bezierShader.use();
-    glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-    glm::mat4 view = camera.GetViewMatrix();
+    bezierShader.setMat4("model", BezierSurfaceModel());
+    bezierShader.setVec3("objectColor", bezierSurfaceColor);
+
+    glPatchParameteri(GL_PATCH_VERTICES, 16);
+
+    GLState::BindVertexArray(bezierVAO);
+    glDrawArrays(GL_PATCHES, 0, 16);
+}
+
+glm::mat4 BezierSurfaceModel() {
     glm::mat4 model_surface = glm::mat4(1.0f);
     model_surface = glm::translate(model_surface, glm::vec3(-9, 6, 2));
     model_surface = glm::scale(model_surface, glm::vec3(3, 4, 2));
+    return model_surface;
+}
 
-    bezierShader.setMat4("model", model_surface);
-    bezierShader.setMat4("view", view);
-    bezierShader.setMat4("projection", projection);
-    bezierShader.setVec3("objectColor", bezierSurfaceColor);
-    bezierShader.setVec3("lightDirection", lightDir);
-    bezierShader.setVec3("lightColor", lightColor);
-    bezierShader.setVec3("fogColor", fogColor);
-    bezierShader.setFloat("fogIntensity", fogIntensity);
-    bezierShader.setVec3("spotLight1Pos", spotLight1Pos);
-    bezierShader.setVec3("spotLight1Dir", spotLightDir);
-    bezierShader.setVec3("spotLight2Pos", spotLight2Pos);
-    bezierShader.setVec3("spotLight2Dir", spotLightDir);
-    bezierShader.setVec3("spotLightColor", spotLightColor);
-    bezierShader.setFloat("spotLightCutOff", spotLightCutOff);
-    bezierShader.setFloat("spotLightOuterCutOff", spotLightOuterCutOff);
-    bezierShader.setVec3("planeSpotLightPos", planeSpotLightPos);
-    bezierShader.setVec3("planeSpotLightDir", planeSpotLightDir);
-    bezierShader.setVec3("planeSpotLightColor", planeSpotLightColor);
-    bezierShader.setFloat("planeSpotLightCutOff", planeSpotLightCutOff);
-    bezierShader.setFloat("planeSpotLightOuterCutOff", planeSpotLightOuterCutOff);
-    bezierShader.setVec3("underPlaneSpotLightPos", underPlaneSpotLightPos);
-    bezierShader.setVec3("underPlaneSpotLightDir", underPlaneSpotLightDir);
-    bezierShader.setVec3("underPlaneSpotLightColor", underPlaneSpotLightColor);
-    bezierShader.setFloat("underPlaneSpotLightCutOff", underPlaneSpotLightCutOff);
-    bezierShader.setFloat("underPlaneSpotLightOuterCutOff", underPlaneSpotLightOuterCutOff);
-    bezierShader.setFloat("constant", 1.0f);
-    bezierShader.setFloat("linear", 0.09f);
-    bezierShader.setFloat("quadratic", 0.032f);
+void UnionBounds(const FrustumCuller& culler, unsigned int first, unsigned int count, glm::vec3& boundsMin, glm::vec3& boundsMax) {
+    culler.GetBounds(first, boundsMin, boundsMax);
+    for (unsigned int i = 1; i < count; i++) {
+        glm::vec3 meshMin, meshMax;
+        culler.GetBounds(first + i, meshMin, meshMax);
+        boundsMin = glm::min(boundsMin, meshMin);
+        boundsMax = glm::max(boundsMax, meshMax);
+    }
+}
 
-    glPatchParameteri(GL_PATCH_VERTICES, 16);
+LightingBlock BuildLightingBlock() {
+    LightingBlock lighting = {};
+    lighting.lightDirection = lightDir;
+    lighting.lightColor = lightColor;
+    lighting.fogColor = fogColor;
+    lighting.fogIntensity = fogIntensity;
+    lighting.constant = 1.0f;
+    lighting.linear = 0.09f;
+    lighting.quadratic = 0.032f;
+
+    SpotLightData spotLights[SPOT_LIGHT_COUNT] = {
+        { spotLight1Pos, spotLightCutOff, spotLightDir, spotLightOuterCutOff, spotLightColor, 0.0f },
+        { spotLight2Pos, spotLightCutOff, spotLightDir, spotLightOuterCutOff, spotLightColor, 0.0f },
+        { planeSpotLightPos, planeSpotLightCutOff, planeSpotLightDir, planeSpotLightOuterCutOff, planeSpotLightColor, 0.0f },
+        { underPlaneSpotLightPos, underPlaneSpotLightCutOff, underPlaneSpotLightDir, underPlaneSpotLightOuterCutOff, underPlaneSpotLightColor, 0.0f }
+    };
+
+    // Enabled lights go first so specialized programs only loop over those;
+    // the remaining slots hold a black light for programs that always read all four
+    int count = 0;
+    for (int i = 0; i < SPOT_LIGHT_COUNT; i++) {
+        if (spotLightEnabled[i] && spotLights[i].color != glm::vec3(0.0f))
+            lighting.spotLights[count++] = spotLights[i];
+    }
+    for (; count < SPOT_LIGHT_COUNT; count++)
+        lighting.spotLights[count] = { glm::vec3(0.0f), 1.0f, spotLightDir, 0.0f, glm::vec3(0.0f), 0.0f };
+    return lighting;
+}
 
-    glBindVertexArray(bezierVAO);
-    glDrawArrays(GL_PATCHES, 0, 16);
-    glBindVertexArray(0);
+ShaderVariant CurrentShaderVariant(bool vertexColors) {
+    const glm::vec3 colors[SPOT_LIGHT_COUNT] = { spotLightColor, spotLightColor, planeSpotLightColor, underPlaneSpotLightColor };
+    ShaderVariant variant = {};
+    for (int i = 0; i < SPOT_LIGHT_COUNT; i++) {
+        if (spotLightEnabled[i] && colors[i] != glm::vec3(0.0f))
+            variant.spotLightCount++;
+    }
+    variant.fogEnabled = fogIntensity > 0.0f;
+    variant.vertexColors = vertexColors;
+    return variant;
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include "occlusion_queries.h"
+
+OcclusionQueries::OcclusionQueries(const Shader& proxyShader) : proxyShader(proxyShader), frame(0) {
+    // unit cube as one triangle strip, scaled to the bounds in proxy.vs
+    float boxVertices[] = {
+        0.0f, 1.0f, 1.0f,   1.0f, 1.0f, 1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f, 1.0f,
+        1.0f, 0.0f, 0.0f,   1.0f, 1.0f, 1.0f,   1.0f, 1.0f, 0.0f,   0.0f, 1.0f, 1.0f,
+        0.0f, 1.0f, 0.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f, 0.0f,   1.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 0.0f,   1.0f, 1.0f, 0.0f
+    };
+    glGenVertexArrays(1, &boxVAO);
+    glGenBuffers(1, &boxVBO);
+    GLState::BindVertexArray(boxVAO);
+    GLState::BindBuffer(GL_ARRAY_BUFFER, boxVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(boxVertices), boxVertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+}
+
+OcclusionQueries::~OcclusionQueries() {
+    for (Occludee& occludee : occludees)
+        glDeleteQueries(OCCLUSION_QUERY_FRAMES, occludee.queries);
+    GLState::DeleteVertexArray(boxVAO);
+    GLState::DeleteBuffer(boxVBO);
+}
+
+unsigned int OcclusionQueries::Add() {
+    Occludee occludee;
+    glGenQueries(OCCLUSION_QUERY_FRAMES, occludee.queries);
+    for (int i = 0; i < OCCLUSION_QUERY_FRAMES; i++)
+        occludee.issuedFrame[i] = -1;
+    occludee.queriedThisFrame = false;
+    occludee.visible = true;
+    occludee.resultFrame = -1;
+    occludees.push_back(occludee);
+    return (unsigned int)occludees.size() - 1;
+}
+
+void OcclusionQueries::BeginFrame(int frame) {
+    this->frame = frame;
+    stats = Stats();
+    for (Occludee& occludee : occludees) {
+        occludee.queriedThisFrame = false;
+        // oldest first, so the newest result that has arrived is the one that stays
+        for (int age = OCCLUSION_QUERY_FRAMES; age >= 1; age--) {
+            int slot = (frame - age) % OCCLUSION_QUERY_FRAMES;
+            if (slot < 0 || occludee.issuedFrame[slot] != frame - age)
+                continue;
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(occludee.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                continue;
+            GLuint samplesPassed = GL_TRUE;
+            glGetQueryObjectuiv(occludee.queries[slot], GL_QUERY_RESULT, &samplesPassed);
+            occludee.visible = samplesPassed != GL_FALSE;
+            occludee.resultFrame = occludee.issuedFrame[slot];
+            occludee.issuedFrame[slot] = -1;
+        }
+        // the slot this frame reuses is dropped if the GPU never got to it
+        occludee.issuedFrame[frame % OCCLUSION_QUERY_FRAMES] = -1;
+        if (!WasVisible((unsigned int)(&occludee - occludees.data())))
+            stats.hidden++;
+    }
+}
+
+void OcclusionQueries::BeginProxies() {
+    // proxies only touch the query counters, never the colour or depth buffers
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    proxyShader.use();
+    GLState::BindVertexArray(boxVAO);
+}
+
+void OcclusionQueries::EndProxies() {
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+}
+
+void OcclusionQueries::Query(unsigned int id, const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::vec3& eye) {
+    Occludee& occludee = occludees[id];
+    // the near plane would cut the box open around an eye inside it
+    const float margin = 0.2f;
+    if (glm::all(glm::greaterThanEqual(eye, boundsMin - margin)) && glm::all(glm::lessThanEqual(eye, boundsMax + margin))) {
+        occludee.visible = true;
+        occludee.resultFrame = frame;
+        return;
+    }
+
+    int slot = frame % OCCLUSION_QUERY_FRAMES;
+    proxyShader.setVec3("boundsMin", boundsMin);
+    proxyShader.setVec3("boundsMax", boundsMax);
+    glBeginQuery(GL_ANY_SAMPLES_PASSED, occludee.queries[slot]);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 14);
+    glEndQuery(GL_ANY_SAMPLES_PASSED);
+    occludee.issuedFrame[slot] = frame;
+    occludee.queriedThisFrame = true;
+    stats.queries++;
+}
+
+void OcclusionQueries::BeginConditional(unsigned int id) const {
+    const Occludee& occludee = occludees[id];
+    if (!occludee.queriedThisFrame)
+        return;
+    // the GPU waits for its own result; the CPU carries on
+    glBeginConditionalRender(occludee.queries[frame % OCCLUSION_QUERY_FRAMES], GL_QUERY_WAIT);
+}
+
+void OcclusionQueries::EndConditional(unsigned int id) const {
+    if (occludees[id].queriedThisFrame)
+        glEndConditionalRender();
+}
+
+bool OcclusionQueries::WasVisible(unsigned int id) const {
+    const Occludee& occludee = occludees[id];
+    return occludee.visible || occludee.resultFrame < frame - OCCLUSION_QUERY_FRAMES;
+}
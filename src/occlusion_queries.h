@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <misc/shader_m.h>
+#include <misc/gl_state.h>
+
+// queries kept in flight per occludee, so a result is only read once the GPU is done with it
+const int OCCLUSION_QUERY_FRAMES = 3;
+
+// Hardware occlusion culling with GL_ANY_SAMPLES_PASSED. An occludee's bounding box is drawn as a proxy,
+// without colour or depth writes, inside a query once the occluders are in the depth buffer. The real draw can
+// then be wrapped in conditional rendering on that query, so the GPU drops it without the CPU waiting for
+// anything. The results are also read back on the CPU a frame or two later, when they are available anyway,
+// for draws that are better skipped before they are submitted.
+class OcclusionQueries {
+public:
+    struct Stats {
+        unsigned int queries = 0;      // proxies drawn this frame
+        unsigned int hidden = 0;       // occludees the latest readable results found hidden
+    };
+
+    // proxyShader draws the bounds; it reads the camera from the CameraBlock
+    explicit OcclusionQueries(const Shader& proxyShader);
+    ~OcclusionQueries();
+
+    // registers an occludee and returns its id
+    unsigned int Add();
+
+    // once per frame, before any Query: collects the results that have arrived and moves on to the next queries
+    void BeginFrame(int frame);
+
+    // the proxies share one set of state changes; Query is only valid between these two
+    void BeginProxies();
+    void EndProxies();
+    // draws the occludee's world space bounds inside a new query; an eye inside them counts as visible
+    void Query(unsigned int id, const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::vec3& eye);
+
+    // draws in between are dropped by the GPU when this frame's query saw no samples
+    void BeginConditional(unsigned int id) const;
+    void EndConditional(unsigned int id) const;
+
+    // false once the latest result read back found the occludee hidden; results older than the query ring are
+    // not trusted, so something that has not been queried for a while counts as visible
+    bool WasVisible(unsigned int id) const;
+
+    const Stats& GetStats() const { return stats; }
+
+private:
+    struct Occludee {
+        GLuint queries[OCCLUSION_QUERY_FRAMES];
+        int issuedFrame[OCCLUSION_QUERY_FRAMES];  // frame each query was issued in, -1 while it holds nothing
+        bool queriedThisFrame;
+        bool visible;                             // latest result read back
+        int resultFrame;                          // frame of that result
+    };
+
+    const Shader& proxyShader;
+    std::vector<Occludee> occludees;
+    unsigned int boxVAO, boxVBO;
+    int frame;
+    Stats stats;
+};
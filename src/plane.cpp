@@ -8,6 +8,8 @@ Plane::Plane(float radius, float speed, Model& model)
 
 void Plane::Update(float time) {
     UpdatePosition(time);
+    // the jet's bounds follow it for culling
+    model.SetCullTransform(modelMatrix);
 }
 
 void Plane::UpdatePosition(float time) {
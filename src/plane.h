@@ -15,6 +15,7 @@ public:
     glm::vec3 GetPosition() const { return position; }
     glm::vec3 GetDirection() const { return direction; }
     glm::vec3 GetUpDirection() const { return up; }
+    glm::mat4 GetModelMatrix() const { return modelMatrix; }
 private:
     float radius;         // Radius of the path
     float speed;          // Speed of the plane
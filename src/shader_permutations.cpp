@@ -0,0 +1,42 @@
+#include "shader_permutations.h"
+#include "uniform_blocks.h"
+
+std::string ShaderVariant::Defines() const {
+    return "#define SPOT_LIGHT_COUNT " + std::to_string(spotLightCount) + "\n"
+        + "#define FOG_ENABLED " + (fogEnabled ? "1" : "0") + "\n"
+        + "#define VERTEX_COLORS " + (vertexColors ? "1" : "0") + "\n";
+}
+
+ShaderPermutations::ShaderPermutations(const char* vertexPath, const char* fragmentPath)
+    : vertexPath(vertexPath), fragmentPath(fragmentPath) {
+}
+
+void ShaderPermutations::Prepare(const ShaderVariant& variant) {
+    unsigned int key = variant.Key();
+    if (variants.find(key) != variants.end())
+        return;
+    Entry entry;
+    entry.shader.reset(new Shader(Shader::Submit(vertexPath.c_str(), fragmentPath.c_str(), nullptr, nullptr, variant.Defines())));
+    entry.ready = false;
+    variants.emplace(key, std::move(entry));
+}
+
+Shader& ShaderPermutations::Get(const ShaderVariant& variant) {
+    Prepare(variant);
+    Entry& entry = variants.find(variant.Key())->second;
+    Finish(entry);
+    return *entry.shader;
+}
+
+void ShaderPermutations::FinishAll() {
+    for (auto& variant : variants)
+        Finish(variant.second);
+}
+
+void ShaderPermutations::Finish(Entry& entry) {
+    if (entry.ready)
+        return;
+    entry.shader->finish();
+    UniformBlocks::Bind(*entry.shader);
+    entry.ready = true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <misc/shader_m.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+// Compile-time switches of a scene program
+struct ShaderVariant {
+    int spotLightCount;  // spot lights packed at the front of LightingBlock::spotLights
+    bool fogEnabled;
+    bool vertexColors;   // baked palette colours instead of texture_diffuse1, see Model::HasVertexColors
+
+    unsigned int Key() const { return (unsigned int)spotLightCount << 2 | (vertexColors ? 2u : 0u) | (fogEnabled ? 1u : 0u); }
+    std::string Defines() const;
+};
+
+// Specialized programs built from one vertex/fragment source pair, compiled the first time a variant is needed
+class ShaderPermutations {
+public:
+    ShaderPermutations(const char* vertexPath, const char* fragmentPath);
+
+    // Starts compiling a variant without waiting for it
+    void Prepare(const ShaderVariant& variant);
+    // Returns a ready program for the variant, compiling it now if it was never prepared
+    Shader& Get(const ShaderVariant& variant);
+    // Waits for every prepared variant
+    void FinishAll();
+
+    size_t GetVariantCount() const { return variants.size(); }
+
+private:
+    struct Entry {
+        std::unique_ptr<Shader> shader;
+        bool ready;
+    };
+
+    void Finish(Entry& entry);
+
+    std::string vertexPath, fragmentPath;
+    std::unordered_map<unsigned int, Entry> variants;
+};
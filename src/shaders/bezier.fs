@@ -6,41 +6,34 @@ in vec3 Normal;
 
 uniform vec3 objectColor;
 
-uniform vec3 lightDirection;
-uniform vec3 lightColor;
-uniform vec3 viewPos;
-
-// Spotlight 1
-uniform vec3 spotLight1Pos;
-uniform vec3 spotLight1Dir;
-uniform vec3 spotLightColor;
-uniform float spotLightCutOff;
-uniform float spotLightOuterCutOff;
-
-// Spotlight 2
-uniform vec3 spotLight2Pos;
-uniform vec3 spotLight2Dir;
-
-// Plane Spotlight
-uniform vec3 planeSpotLightPos;
-uniform vec3 planeSpotLightDir;
-uniform vec3 planeSpotLightColor;
-uniform float planeSpotLightCutOff;
-uniform float planeSpotLightOuterCutOff;
-
-// Under-Plane Spotlight
-uniform vec3 underPlaneSpotLightPos;
-uniform vec3 underPlaneSpotLightDir;
-uniform vec3 underPlaneSpotLightColor;
-uniform float underPlaneSpotLightCutOff;
-uniform float underPlaneSpotLightOuterCutOff;
-
-uniform vec3 fogColor;
-uniform float fogIntensity;
+layout (std140) uniform CameraBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+};
 
-uniform float constant;
-uniform float linear;
-uniform float quadratic;
+struct SpotLight
+{
+    vec3 position;
+    float cutOff;
+    vec3 direction;
+    float outerCutOff;
+    vec3 color;
+};
+
+// Per-frame lighting shared by all scene shaders
+layout (std140) uniform LightingBlock
+{
+    vec3 lightDirection; // Directional light direction
+    float fogIntensity;
+    vec3 lightColor;     // Directional light color
+    float constant;      // Constant attenuation
+    vec3 fogColor;
+    float linear;        // Linear attenuation
+    float quadratic;     // Quadratic attenuation
+    SpotLight spotLights[4]; // street lights 1 and 2, plane front light, under-plane light
+};
 
 float CalculateFog(float distance, float fogIntensity)
 {
@@ -50,25 +43,25 @@ float CalculateFog(float distance, float fogIntensity)
 }
 
 // Function to calculate spotlight effect
-vec3 CalculateSpotlight(vec3 lightPos, vec3 lightDir, vec3 lightColor, vec3 normal, vec3 fragPos, vec3 viewDir, float cutOff, float outerCutOff, float constant, float linear, float quadratic)
+vec3 CalculateSpotlight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
 {
-    vec3 lightVec = normalize(lightPos - fragPos);
-    float theta = dot(lightVec, normalize(-lightDir)); // Angle between light direction and fragment direction
-    float epsilon = cutOff - outerCutOff;
-    float intensity = clamp((theta - outerCutOff) / epsilon, 0.0, 1.0);
+    vec3 lightVec = normalize(light.position - fragPos);
+    float theta = dot(lightVec, normalize(-light.direction)); // Angle between light direction and fragment direction
+    float epsilon = light.cutOff - light.outerCutOff;
+    float intensity = clamp((theta - light.outerCutOff) / epsilon, 0.0, 1.0);
 
     // Calculate the distance between the light source and the fragment
-    float distance = length(lightPos - fragPos);
+    float distance = length(light.position - fragPos);
 
     float attenuation = 1.0 / (constant + linear * distance + quadratic * (distance * distance));
 
-    vec3 ambient = 0.05 * lightColor;
+    vec3 ambient = 0.05 * light.color;
     float diff = max(dot(normal, lightVec), 0.0);
-    vec3 diffuse = diff * lightColor;
+    vec3 diffuse = diff * light.color;
     
     vec3 reflectDir = reflect(-lightVec, normal);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32.0);
-    vec3 specular = 0.5 * spec * lightColor;
+    vec3 specular = 0.5 * spec * light.color;
     
     return (ambient + intensity * (diffuse + specular)) * attenuation;
 }
@@ -91,12 +84,8 @@ void main()
     vec3 lighting = ambient + diffuse + specular;
 
     // Calculate spotlights
-    vec3 spot1 = CalculateSpotlight(spotLight1Pos, spotLight1Dir, spotLightColor, norm, FragPos, viewDir, spotLightCutOff, spotLightOuterCutOff, constant, linear, quadratic);
-    vec3 spot2 = CalculateSpotlight(spotLight2Pos, spotLight2Dir, spotLightColor, norm, FragPos, viewDir, spotLightCutOff, spotLightOuterCutOff, constant, linear, quadratic);
-    vec3 planeSpot = CalculateSpotlight(planeSpotLightPos, planeSpotLightDir, planeSpotLightColor, norm, FragPos, viewDir, planeSpotLightCutOff, planeSpotLightOuterCutOff, constant, linear, quadratic);
-    vec3 underPlaneSpot = CalculateSpotlight(underPlaneSpotLightPos, underPlaneSpotLightDir, underPlaneSpotLightColor, norm, FragPos, viewDir, underPlaneSpotLightCutOff, underPlaneSpotLightOuterCutOff, constant, linear, quadratic);
-
-    lighting += spot1 + spot2 + planeSpot + underPlaneSpot;
+    for (int i = 0; i < 4; i++)
+        lighting += CalculateSpotlight(spotLights[i], norm, FragPos, viewDir);
 
     vec3 result = lighting * objectColor;
     float distance = length(viewPos - FragPos);
@@ -1,53 +1,61 @@
 #version 410 core
+
+// Specialization switches; ShaderPermutations defines them before this point
+#ifndef SPOT_LIGHT_COUNT
+#define SPOT_LIGHT_COUNT 4
+#endif
+#ifndef FOG_ENABLED
+#define FOG_ENABLED 1
+#endif
+#ifndef VERTEX_COLORS
+#define VERTEX_COLORS 0
+#endif
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
+#if VERTEX_COLORS
+layout (location = 4) in vec4 aColor;  // the palette colour baked in at import
+#endif
 
 out vec2 TexCoords;
 flat out vec3 FinalColor;  // Pass the final color without interpolation
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-
-uniform vec3 lightDirection; // Direction of the light source
-uniform vec3 lightColor;     // Color of the light source
-uniform vec3 viewPos;        // Camera position
-
-// Spotlight 1
-uniform vec3 spotLight1Pos;
-uniform vec3 spotLight1Dir;
-uniform vec3 spotLightColor;
-uniform float spotLightCutOff;
-uniform float spotLightOuterCutOff;
-
-// Spotlight 2
-uniform vec3 spotLight2Pos;
-uniform vec3 spotLight2Dir;
-
-// Plane Spotlight (Front)
-uniform vec3 planeSpotLightPos;
-uniform vec3 planeSpotLightDir;
-uniform vec3 planeSpotLightColor;
-uniform float planeSpotLightCutOff;
-uniform float planeSpotLightOuterCutOff;
-
-// Under-Plane Spotlight
-uniform vec3 underPlaneSpotLightPos;
-uniform vec3 underPlaneSpotLightDir;
-uniform vec3 underPlaneSpotLightColor;
-uniform float underPlaneSpotLightCutOff;
-uniform float underPlaneSpotLightOuterCutOff;
-
-uniform vec3 fogColor;       // Fog color
-uniform float fogIntensity;  // Fog intensity (0.0 to 1.0)
-uniform sampler2D texture_diffuse1; // Texture sampler
 
-// Attenuation parameters
-uniform float constant;  // Constant attenuation
-uniform float linear;    // Linear attenuation
-uniform float quadratic; // Quadratic attenuation
+layout (std140) uniform CameraBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+};
+
+struct SpotLight
+{
+    vec3 position;
+    float cutOff;
+    vec3 direction;
+    float outerCutOff;
+    vec3 color;
+};
+
+// Per-frame lighting shared by all scene shaders
+layout (std140) uniform LightingBlock
+{
+    vec3 lightDirection; // Directional light direction
+    float fogIntensity;
+    vec3 lightColor;     // Directional light color
+    float constant;      // Constant attenuation
+    vec3 fogColor;
+    float linear;        // Linear attenuation
+    float quadratic;     // Quadratic attenuation
+    SpotLight spotLights[4]; // street lights 1 and 2, plane front light, under-plane light
+};
+
+#if !VERTEX_COLORS
+uniform sampler2D texture_diffuse1; // Texture sampler
+#endif
 
+#if FOG_ENABLED
 // Function to calculate fog factor based on distance
 float CalculateFog(float distance, float fogIntensity)
 {
@@ -55,29 +63,30 @@ float CalculateFog(float distance, float fogIntensity)
     fogFactor = clamp(fogFactor, 0.0, 1.0);
     return fogFactor;
 }
+#endif
 
 // Function to calculate spotlight effect with attenuation
-vec3 CalculateSpotlight(vec3 lightPos, vec3 lightDir, vec3 lightColor, vec3 normal, vec3 fragPos, vec3 viewDir, float cutOff, float outerCutOff)
+vec3 CalculateSpotlight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
 {
-    vec3 lightVec = normalize(lightPos - fragPos);
-    float theta = dot(lightVec, normalize(-lightDir)); // Angle between light direction and fragment direction
-    float epsilon = cutOff - outerCutOff;
-    float intensity = clamp((theta - outerCutOff) / epsilon, 0.0, 1.0); // Smooth edge
+    vec3 lightVec = normalize(light.position - fragPos);
+    float theta = dot(lightVec, normalize(-light.direction)); // Angle between light direction and fragment direction
+    float epsilon = light.cutOff - light.outerCutOff;
+    float intensity = clamp((theta - light.outerCutOff) / epsilon, 0.0, 1.0); // Smooth edge
 
     // Calculate the distance between the light source and the fragment
-    float distance = length(lightPos - fragPos);
+    float distance = length(light.position - fragPos);
 
     // Calculate attenuation based on the distance
     float attenuation = 1.0 / (constant + linear * distance + quadratic * (distance * distance));
 
     // Ambient, diffuse, and specular calculations for spotlight
-    vec3 ambient = 0.05 * lightColor;
+    vec3 ambient = 0.05 * light.color;
     float diff = max(dot(normal, lightVec), 0.0);
-    vec3 diffuse = diff * lightColor;
+    vec3 diffuse = diff * light.color;
     
     vec3 reflectDir = reflect(-lightVec, normal);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32.0);
-    vec3 specular = 0.5 * spec * lightColor;
+    vec3 specular = 0.5 * spec * light.color;
     
     // Apply attenuation to the spotlight effects
     return (ambient + intensity * (diffuse + specular)) * attenuation;
@@ -109,20 +118,20 @@ void main()
     vec3 lighting = ambient + diffuse + specular;
 
     // Calculate spotlight effects with attenuation
-    vec3 spot1 = CalculateSpotlight(spotLight1Pos, spotLight1Dir, spotLightColor, norm, FragPos, viewDir, spotLightCutOff, spotLightOuterCutOff);
-    vec3 spot2 = CalculateSpotlight(spotLight2Pos, spotLight2Dir, spotLightColor, norm, FragPos, viewDir, spotLightCutOff, spotLightOuterCutOff);
-    vec3 planeSpot = CalculateSpotlight(planeSpotLightPos, planeSpotLightDir, planeSpotLightColor, norm, FragPos, viewDir, planeSpotLightCutOff, planeSpotLightOuterCutOff);
-    vec3 underPlaneSpot = CalculateSpotlight(underPlaneSpotLightPos, underPlaneSpotLightDir, underPlaneSpotLightColor, norm, FragPos, viewDir, underPlaneSpotLightCutOff, underPlaneSpotLightOuterCutOff);
-
-    // Combine all lighting effects
-    lighting += spot1 + spot2 + planeSpot + underPlaneSpot;
+    for (int i = 0; i < SPOT_LIGHT_COUNT; i++)
+        lighting += CalculateSpotlight(spotLights[i], norm, FragPos, viewDir);
 
-    // Sample the texture color
+    // Sample the texture color, or take the colour baked from it
+#if VERTEX_COLORS
+    vec3 textureColor = aColor.rgb;
+#else
     vec3 textureColor = vec3(texture(texture_diffuse1, TexCoords));
+#endif
 
     // Calculate the base object color
     vec3 result = lighting * textureColor;
 
+#if FOG_ENABLED
     // Calculate the distance from the fragment to the camera
     float distance = length(viewPos - FragPos);
 
@@ -131,6 +140,9 @@ void main()
 
     // Blend the object color with the fog color using the calculated fog factor
     FinalColor = mix(fogColor, result, fogFactor);
+#else
+    FinalColor = result;
+#endif
 
     // Set the vertex position in clip space
     gl_Position = projection * view * model * vec4(aPos, 1.0);
@@ -1,17 +1,60 @@
 #version 410 core
+
+// Specialization switches; ShaderPermutations defines them before this point
+#ifndef FOG_ENABLED
+#define FOG_ENABLED 1
+#endif
+#ifndef VERTEX_COLORS
+#define VERTEX_COLORS 0
+#endif
 out vec4 FragColor;
 
 in vec2 TexCoords;
 in vec3 LightingColor;  // Receive lighting color from vertex shader
-in float FogFactor; 
+#if FOG_ENABLED
+in float FogFactor;
+#endif
 
+#if VERTEX_COLORS
+in vec3 Color;
+#else
 uniform sampler2D texture_diffuse1;
-uniform vec3 fogColor;
+#endif
+
+struct SpotLight
+{
+    vec3 position;
+    float cutOff;
+    vec3 direction;
+    float outerCutOff;
+    vec3 color;
+};
+
+// Per-frame lighting shared by all scene shaders
+layout (std140) uniform LightingBlock
+{
+    vec3 lightDirection; // Directional light direction
+    float fogIntensity;
+    vec3 lightColor;     // Directional light color
+    float constant;      // Constant attenuation
+    vec3 fogColor;
+    float linear;        // Linear attenuation
+    float quadratic;     // Quadratic attenuation
+    SpotLight spotLights[4]; // street lights 1 and 2, plane front light, under-plane light
+};
 
 void main()
 {
+#if VERTEX_COLORS
+    vec3 textureColor = Color;
+#else
     vec3 textureColor = vec3(texture(texture_diffuse1, TexCoords));
+#endif
     vec3 result = LightingColor * textureColor;
+#if FOG_ENABLED
     vec3 finalColor = mix(fogColor, result, FogFactor);
+#else
+    vec3 finalColor = result;
+#endif
     FragColor = vec4(finalColor, 1.0);
 }
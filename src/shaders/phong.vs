@@ -1,19 +1,38 @@
 #version 410 core
+
+// Specialization switch; ShaderPermutations defines it before this point
+#ifndef VERTEX_COLORS
+#define VERTEX_COLORS 0
+#endif
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
+#if VERTEX_COLORS
+layout (location = 4) in vec4 aColor;  // the palette colour baked in at import
+#endif
 
 out vec2 TexCoords;
 out vec3 FragPos;
 out vec3 Normal;
+#if VERTEX_COLORS
+out vec3 Color;
+#endif
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+
+layout (std140) uniform CameraBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+};
 
 void main()
 {
     TexCoords = aTexCoords;
+#if VERTEX_COLORS
+    Color = aColor.rgb;
+#endif
     FragPos = vec3(model * vec4(aPos, 1.0));
     Normal = mat3(transpose(inverse(model))) * aNormal;
     gl_Position = projection * view * model * vec4(aPos, 1.0);
@@ -0,0 +1,8 @@
+#version 410 core
+out vec4 FragColor;
+
+// Only counted by occlusion queries; colour writes are masked off
+void main()
+{
+    FragColor = vec4(1.0);
+}
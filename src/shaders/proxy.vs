@@ -0,0 +1,18 @@
+#version 410 core
+layout (location = 0) in vec3 aPos;  // unit cube corner
+
+// World space bounds the cube is stretched over
+uniform vec3 boundsMin;
+uniform vec3 boundsMax;
+
+layout (std140) uniform CameraBlock
+{
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+};
+
+void main()
+{
+    gl_Position = projection * view * vec4(mix(boundsMin, boundsMax, aPos), 1.0);
+}
@@ -0,0 +1,64 @@
+#version 410 core
+out vec4 FragColor;
+
+in vec3 TexCoords;
+
+// filled by Atmosphere; the coordinate mappings below mirror the ones it computes them with
+uniform sampler2D transmittance;
+uniform sampler3D skyView;
+uniform vec3 sunDirection;
+uniform float sunIntensity;
+
+const float PI = 3.14159265;
+const float GROUND_RADIUS = 6360.0;
+const float ATMOSPHERE_RADIUS = 6460.0;
+const float CAMERA_HEIGHT = 0.2;
+const float SUN_SINE_MIN = -0.2;
+const float SUN_COS_ANGLE = 0.99996;   // about half a degree across
+const vec3 NIGHT_SKY = vec3(0.004, 0.006, 0.012);
+
+// maps t in [0, 1] onto the centres of the first and last texel
+float texelCentres(float t, int size) {
+    return (t * float(size - 1) + 0.5) / float(size);
+}
+
+vec3 sampleTransmittance(float r, float mu) {
+    float horizon = sqrt(ATMOSPHERE_RADIUS * ATMOSPHERE_RADIUS - GROUND_RADIUS * GROUND_RADIUS);
+    float rho = sqrt(max(r * r - GROUND_RADIUS * GROUND_RADIUS, 0.0));
+    float discriminant = r * r * (mu * mu - 1.0) + ATMOSPHERE_RADIUS * ATMOSPHERE_RADIUS;
+    float distance = max(-r * mu + sqrt(max(discriminant, 0.0)), 0.0);
+    float distanceMin = ATMOSPHERE_RADIUS - r;
+    float distanceMax = rho + horizon;
+    ivec2 size = textureSize(transmittance, 0);
+    vec2 uv = vec2(texelCentres((distance - distanceMin) / (distanceMax - distanceMin), size.x),
+                   texelCentres(rho / horizon, size.y));
+    return texture(transmittance, uv).rgb;
+}
+
+void main()
+{
+    vec3 direction = normalize(TexCoords);
+    ivec3 size = textureSize(skyView, 0);
+
+    // azimuth measured from the sun, folded onto the half the table stores
+    vec2 horizontal = direction.xz;
+    vec2 sunHorizontal = sunDirection.xz;
+    float azimuth = 0.0;
+    if (dot(horizontal, horizontal) > 1e-8 && dot(sunHorizontal, sunHorizontal) > 1e-8)
+        azimuth = acos(clamp(dot(normalize(horizontal), normalize(sunHorizontal)), -1.0, 1.0));
+    float elevation = asin(clamp(direction.y, -1.0, 1.0));
+    float v = sign(elevation) * sqrt(abs(elevation) / (0.5 * PI));
+    float sunSlice = clamp((sunDirection.y - SUN_SINE_MIN) / (1.0 - SUN_SINE_MIN), 0.0, 1.0);
+    vec3 uvw = vec3(texelCentres(azimuth / PI, size.x), texelCentres(0.5 * v + 0.5, size.y), texelCentres(sunSlice, size.z));
+
+    // the table ends in deep twilight; below it the sky fades to black
+    float sunFade = smoothstep(-0.35, SUN_SINE_MIN, sunDirection.y);
+    vec3 radiance = texture(skyView, uvw).rgb * sunIntensity * sunFade;
+
+    if (dot(direction, sunDirection) > SUN_COS_ANGLE && direction.y > 0.0)
+        radiance += sampleTransmittance(GROUND_RADIUS + CAMERA_HEIGHT, direction.y) * sunIntensity * 50.0;
+
+    // simple exposure curve, then back to the display's gamma like the cubemaps are stored in
+    vec3 color = 1.0 - exp(-radiance) + NIGHT_SKY;
+    FragColor = vec4(pow(color, vec3(1.0 / 2.2)), 1.0);
+}
@@ -4,8 +4,14 @@ out vec4 FragColor;
 in vec3 TexCoords;
 
 uniform samplerCube skybox;
+uniform samplerCube previousSkybox;
+// below 1 while previousSkybox crossfades into skybox
+uniform float blend;
 
 void main()
 {    
-    FragColor = texture(skybox, TexCoords);
+    vec4 color = texture(skybox, TexCoords);
+    if (blend < 1.0)
+        color = mix(texture(previousSkybox, TexCoords), color, blend);
+    FragColor = color;
 }
\ No newline at end of file
@@ -1,16 +1,116 @@
 #include "skybox.h"
-#include <misc/stb_image.h>
 #include <iostream>
+#include <memory>
 
-Skybox::Skybox(const std::vector<std::string>& faces) {
+Skybox::Skybox() : current(-1), previous(-1), fadeProgress(1.0f), fadeSeconds(0.0f) {
     initSkybox();
-    cubemapTexture = loadCubemap(faces);
 }
 
 Skybox::~Skybox() {
-    glDeleteVertexArrays(1, &skyboxVAO);
-    glDeleteBuffers(1, &skyboxVBO);
-    glDeleteTextures(1, &cubemapTexture);
+    GLState::DeleteVertexArray(skyboxVAO);
+    GLState::DeleteBuffer(skyboxVBO);
+    for (const SkySet& skySet : skySets) {
+        if (!skySet.atmosphere)
+            TextureCache::Get().Release(skySet.handle);
+    }
+}
+
+int Skybox::AddSkySet(const std::string& name, const std::vector<std::string>& faces, const glm::vec3& lightDirection,
+                      const glm::vec3& lightColor, AssetLoader* loader) {
+    TextureCache& cache = TextureCache::Get();
+    SkySet skySet;
+    skySet.name = name;
+    skySet.lightDirection = glm::normalize(lightDirection);
+    skySet.lightColor = lightColor;
+    skySet.handle = cache.RequestCubemap(faces);
+    skySet.texture = cache.Acquire(skySet.handle);
+    skySet.atmosphere = nullptr;
+    skySet.shader = nullptr;
+    skySets.push_back(skySet);
+    if (current < 0)
+        current = (int)skySets.size() - 1;
+    if (!cache.Claim(skySet.handle))
+        return (int)skySets.size() - 1;
+
+    unsigned int textureID = skySet.texture;
+    unsigned int handle = skySet.handle;
+    for (unsigned int i = 0; i < faces.size(); i++) {
+        if (!loader) {
+            TextureStreamer::Get().EnqueueFile(textureID, TextureStreamer::CubemapFace, i, faces[i],
+                [handle](size_t bytes) { TextureCache::Get().AddUploadedBytes(handle, bytes); });
+            continue;
+        }
+        std::string face = faces[i];
+        loader->Run([face, i, textureID, handle, loader] {
+            auto decodeBegin = std::chrono::high_resolution_clock::now();
+            std::shared_ptr<TextureContainer> container = OpenTextureContainer(face, true);
+            loader->AddTime(LoadStage::Decode, decodeBegin);
+            loader->Upload([i, textureID, handle, container] {
+                TextureStreamer::Get().Enqueue(textureID, TextureStreamer::CubemapFace, i, container,
+                    [handle](size_t bytes) { TextureCache::Get().AddUploadedBytes(handle, bytes); });
+            });
+        });
+    }
+    return (int)skySets.size() - 1;
+}
+
+int Skybox::AddProceduralSky(const std::string& name, const Atmosphere& atmosphere, const Shader& shader) {
+    SkySet skySet;
+    skySet.name = name;
+    skySet.lightDirection = atmosphere.GetLightDirection();
+    skySet.lightColor = atmosphere.GetLightColor();
+    skySet.handle = 0;
+    skySet.texture = 0;
+    skySet.atmosphere = &atmosphere;
+    skySet.shader = &shader;
+    skySets.push_back(skySet);
+    if (current < 0)
+        current = (int)skySets.size() - 1;
+    return (int)skySets.size() - 1;
+}
+
+void Skybox::Select(int set, float fadeSeconds) {
+    if (set == current || set < 0 || set >= (int)skySets.size())
+        return;
+    if (IsProcedural(set) || IsProcedural(current))
+        fadeSeconds = 0.0f;
+    // picking the set that is fading out reverses the fade from where it is
+    float progress = (set == previous) ? 1.0f - fadeProgress : 0.0f;
+    previous = current;
+    current = set;
+    this->fadeSeconds = fadeSeconds;
+    fadeProgress = fadeSeconds > 0.0f ? progress : 1.0f;
+    if (fadeProgress >= 1.0f)
+        previous = -1;
+}
+
+void Skybox::Update(float deltaTime) {
+    // the atmosphere's light moves with the time of day, so the set keeps a copy for crossfades to start from
+    for (SkySet& skySet : skySets) {
+        if (skySet.atmosphere) {
+            skySet.lightDirection = skySet.atmosphere->GetLightDirection();
+            skySet.lightColor = skySet.atmosphere->GetLightColor();
+        }
+    }
+    if (previous < 0)
+        return;
+    fadeProgress += deltaTime / fadeSeconds;
+    if (fadeProgress >= 1.0f) {
+        fadeProgress = 1.0f;
+        previous = -1;
+    }
+}
+
+glm::vec3 Skybox::GetLightDirection() const {
+    if (previous < 0)
+        return skySets[current].lightDirection;
+    return glm::normalize(glm::mix(skySets[previous].lightDirection, skySets[current].lightDirection, fadeProgress));
+}
+
+glm::vec3 Skybox::GetLightColor() const {
+    if (previous < 0)
+        return skySets[current].lightColor;
+    return glm::mix(skySets[previous].lightColor, skySets[current].lightColor, fadeProgress);
 }
 
 void Skybox::initSkybox() {
@@ -61,54 +161,43 @@ void Skybox::initSkybox() {
 
     glGenVertexArrays(1, &skyboxVAO);
     glGenBuffers(1, &skyboxVBO);
-    glBindVertexArray(skyboxVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
+    GLState::BindVertexArray(skyboxVAO);
+    GLState::BindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
 }
 
-unsigned int Skybox::loadCubemap(const std::vector<std::string>& faces) {
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
-
-    int width, height, nrChannels;
-    for (unsigned int i = 0; i < faces.size(); i++) {
-        unsigned char* data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
-        if (data) {
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-            stbi_image_free(data);
-        }
-        else {
-            std::cout << "Cubemap texture failed to load at path: " << faces[i] << std::endl;
-            stbi_image_free(data);
-        }
+void Skybox::Draw(const Shader& shader, const glm::mat4& view, const glm::mat4& projection) {
+    // the whole scene is drawn with GL_LEQUAL, so the skybox at depth 1.0 needs no switch
+    GLState::DepthFunc(GL_LEQUAL);
+    glm::mat4 viewMatrix = glm::mat4(glm::mat3(view)); // remove translation component
+    const SkySet& skySet = skySets[current];
+    if (skySet.atmosphere) {
+        // nothing to show until the workers have filled the tables; the clear colour stands in meanwhile
+        if (!skySet.atmosphere->IsReady())
+            return;
+        skySet.shader->use();
+        skySet.shader->setMat4("view", viewMatrix);
+        skySet.shader->setMat4("projection", projection);
+        skySet.atmosphere->Bind(*skySet.shader);
+        GLState::BindVertexArray(skyboxVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 36);
+        return;
     }
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-    return textureID;
-}
 
-void Skybox::Draw(const Shader& shader, const glm::mat4& view, const glm::mat4& projection) {
-    glDepthFunc(GL_LEQUAL);
     shader.use();
-    glm::mat4 viewMatrix = glm::mat4(glm::mat3(view)); // remove translation component
     shader.setMat4("view", viewMatrix);
     shader.setMat4("projection", projection);
 
-    glBindVertexArray(skyboxVAO);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-    glBindVertexArray(0);
-    glDepthFunc(GL_LESS);
-}
+    // the sampler units never change; the shader skips uniforms whose value it already has
+    shader.setInt("skybox", 0);
+    shader.setInt("previousSkybox", 1);
+    shader.setFloat("blend", fadeProgress);
 
-void Skybox::SwitchTextures(const std::vector<std::string>& faces) {
-    glDeleteTextures(1, &cubemapTexture);
-    cubemapTexture = loadCubemap(faces);
+    GLState::BindVertexArray(skyboxVAO);
+    GLState::BindTexture(0, GL_TEXTURE_CUBE_MAP, TextureStreamer::Get().Resolve(skySets[current].texture));
+    if (previous >= 0)
+        GLState::BindTexture(1, GL_TEXTURE_CUBE_MAP, TextureStreamer::Get().Resolve(skySets[previous].texture));
+    glDrawArrays(GL_TRIANGLES, 0, 36);
 }
@@ -5,20 +5,60 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <misc/shader_m.h>
+#include <misc/gl_state.h>
+#include <misc/asset_loader.h>
+#include <misc/texture_cache.h>
+#include <misc/texture_streamer.h>
+#include "atmosphere.h"
 
+// a cubemap the skybox can show, with the directional light that belongs to it; procedural sets have no
+// cubemap and take the sky and the light from their atmosphere instead
+struct SkySet {
+    std::string name;
+    glm::vec3 lightDirection;
+    glm::vec3 lightColor;
+    unsigned int handle;   // TextureCache entry the skybox holds a reference to
+    unsigned int texture;
+    const Atmosphere* atmosphere;
+    const Shader* shader;  // sky.fs, for procedural sets
+};
+
+// Every sky set stays resident once added, so switching is a handle swap; an optional crossfade blends the
+// previous cubemap into the new one in skybox.fs while the light follows along. Switching to or from a
+// procedural set cuts straight over, as the two are drawn by different programs.
 class Skybox {
 public:
-    Skybox(const std::vector<std::string>& faces);
+    Skybox();
     ~Skybox();
 
+    // starts loading the set's cubemap in the background: the faces are opened on the loader's threads when
+    // one is given, on the texture streamer's thread otherwise; returns the set's index
+    int AddSkySet(const std::string& name, const std::vector<std::string>& faces, const glm::vec3& lightDirection,
+                  const glm::vec3& lightColor, AssetLoader* loader = nullptr);
+    // a sky drawn from the atmosphere's lookup tables with the given program; returns the set's index
+    int AddProceduralSky(const std::string& name, const Atmosphere& atmosphere, const Shader& shader);
+    // shows another set, fading over fadeSeconds when they are positive
+    void Select(int set, float fadeSeconds = 0.0f);
+    // advances the crossfade
+    void Update(float deltaTime);
+
     void Draw(const Shader& shader, const glm::mat4& view, const glm::mat4& projection);
 
-    void SwitchTextures(const std::vector<std::string>& faces);
+    // the light of the shown set, interpolated during a crossfade
+    glm::vec3 GetLightDirection() const;
+    glm::vec3 GetLightColor() const;
+    int GetSelected() const { return current; }
+    bool IsProcedural(int set) const { return skySets[set].atmosphere != nullptr; }
+    int GetSkySetCount() const { return (int)skySets.size(); }
+    const std::string& GetSkySetName(int set) const { return skySets[set].name; }
 
 private:
-    unsigned int loadCubemap(const std::vector<std::string>& faces);
-    unsigned int cubemapTexture;
+    std::vector<SkySet> skySets;
+    int current;
+    int previous;         // the set fading out, -1 when there is none
+    float fadeProgress;   // 0 at the start of a crossfade, 1 once the new set is fully shown
+    float fadeSeconds;
     unsigned int skyboxVAO, skyboxVBO;
 
     void initSkybox();
-};
\ No newline at end of file
+};
@@ -0,0 +1,43 @@
+#include "uniform_blocks.h"
+#include <cstring>
+
+UniformBlocks::UniformBlocks() : hasData(false), bytesUploaded(0) {
+    glGenBuffers(1, &lightingUBO);
+    GLState::BindBuffer(GL_UNIFORM_BUFFER, lightingUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(LightingBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, LIGHTING_BLOCK_BINDING, lightingUBO);
+
+    glGenBuffers(1, &cameraUBO);
+    GLState::BindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, cameraUBO);
+
+    std::memset(&lastLighting, 0, sizeof(lastLighting));
+    std::memset(&lastCamera, 0, sizeof(lastCamera));
+}
+
+UniformBlocks::~UniformBlocks() {
+    GLState::DeleteBuffer(lightingUBO);
+    GLState::DeleteBuffer(cameraUBO);
+}
+
+void UniformBlocks::Update(const LightingBlock& lighting, const CameraBlock& camera) {
+    if (!hasData || std::memcmp(&lighting, &lastLighting, sizeof(LightingBlock)) != 0) {
+        GLState::BindBuffer(GL_UNIFORM_BUFFER, lightingUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightingBlock), &lighting);
+        lastLighting = lighting;
+        bytesUploaded += sizeof(LightingBlock);
+    }
+    if (!hasData || std::memcmp(&camera, &lastCamera, sizeof(CameraBlock)) != 0) {
+        GLState::BindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(CameraBlock), &camera);
+        lastCamera = camera;
+        bytesUploaded += sizeof(CameraBlock);
+    }
+    hasData = true;
+}
+
+void UniformBlocks::Bind(const Shader& shader) {
+    shader.bindUniformBlock("LightingBlock", LIGHTING_BLOCK_BINDING);
+    shader.bindUniformBlock("CameraBlock", CAMERA_BLOCK_BINDING);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <misc/shader_m.h>
+#include <misc/gl_state.h>
+
+// Fixed binding points shared by every scene program
+const unsigned int LIGHTING_BLOCK_BINDING = 0;
+const unsigned int CAMERA_BLOCK_BINDING = 1;
+
+const int SPOT_LIGHT_COUNT = 4;
+
+// std140 mirror of the GLSL SpotLight struct
+struct SpotLightData {
+    glm::vec3 position;
+    float cutOff;
+    glm::vec3 direction;
+    float outerCutOff;
+    glm::vec3 color;
+    float padding;
+};
+
+// std140 mirror of the LightingBlock uniform block
+struct LightingBlock {
+    glm::vec3 lightDirection;
+    float fogIntensity;
+    glm::vec3 lightColor;
+    float constant;
+    glm::vec3 fogColor;
+    float linear;
+    float quadratic;
+    float padding[3];
+    SpotLightData spotLights[SPOT_LIGHT_COUNT];
+};
+
+// std140 mirror of the CameraBlock uniform block
+struct CameraBlock {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 viewPos;
+    float padding;
+};
+
+static_assert(sizeof(SpotLightData) == 48, "SpotLightData must match the std140 layout");
+static_assert(sizeof(LightingBlock) == 64 + SPOT_LIGHT_COUNT * 48, "LightingBlock must match the std140 layout");
+static_assert(sizeof(CameraBlock) == 144, "CameraBlock must match the std140 layout");
+
+// Per-frame uniform buffers, filled once and read by all scene programs
+class UniformBlocks {
+public:
+    UniformBlocks();
+    ~UniformBlocks();
+
+    // Uploads both blocks; unchanged blocks are not re-sent
+    void Update(const LightingBlock& lighting, const CameraBlock& camera);
+
+    // Connects the program's blocks to the fixed binding points
+    static void Bind(const Shader& shader);
+
+    unsigned int GetBytesUploaded() const { return bytesUploaded; }
+    void ResetStats() { bytesUploaded = 0; }
+
+private:
+    unsigned int lightingUBO, cameraUBO;
+    LightingBlock lastLighting;
+    CameraBlock lastCamera;
+    bool hasData;
+    unsigned int bytesUploaded;
+};